@@ -0,0 +1,283 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.  You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* End-to-end hotplug latency against a private Xvfb. Creates and removes
+ * MD pairs with create_master()/remove_master() and measures how long it
+ * takes until the tree store shows the change. Every new MD pair comes
+ * with its XTEST SDs, so each creation is also a SD hotplug. */
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "gui.h"
+
+/* give up on a change after this many us */
+#define CHANGE_TIMEOUT (5 * G_USEC_PER_SEC)
+
+static GPid server_pid;
+
+/**
+ * Start Xvfb on a free display and point DISPLAY at it.
+ */
+static gboolean start_server(const char *server)
+{
+    gchar *argv[] = { (gchar*)server, "-displayfd", "1", "-nolisten", "tcp",
+                      "-noreset", "-screen", "0", "640x480x24", NULL };
+    GError *error = NULL;
+    gchar buf[32], *display;
+    int out, len = 0;
+
+    if (!g_spawn_async_with_pipes(NULL, argv, NULL,
+                                  G_SPAWN_SEARCH_PATH | G_SPAWN_DO_NOT_REAP_CHILD,
+                                  NULL, NULL, &server_pid, NULL, &out, NULL,
+                                  &error))
+    {
+        fprintf(stderr, "Cannot start %s: %s\n", server, error->message);
+        g_error_free(error);
+        return FALSE;
+    }
+
+    /* the server writes the display number once it's ready */
+    while (len < sizeof(buf) - 1 && read(out, &buf[len], 1) == 1)
+        if (buf[len++] == '\n')
+            break;
+    buf[len] = '\0';
+    close(out);
+
+    if (len == 0)
+    {
+        fprintf(stderr, "%s didn't report a display\n", server);
+        return FALSE;
+    }
+
+    display = g_strdup_printf(":%d", atoi(buf));
+    g_setenv("DISPLAY", display, TRUE);
+    g_free(display);
+
+    return TRUE;
+}
+
+static void stop_server(void)
+{
+    if (!server_pid)
+        return;
+
+    kill(server_pid, SIGTERM);
+    waitpid(server_pid, NULL, 0);
+    g_spawn_close_pid(server_pid);
+    server_pid = 0;
+}
+
+/**
+ * Id of the top-level row called name, or 0. With slaves set, only a row
+ * that already has SDs below it counts.
+ */
+static int find_master_row(GDeviceSetup *gds, const char *name,
+                           gboolean slaves)
+{
+    GtkTreeModel *model = gtk_tree_view_get_model(gds->treeview);
+    GtkTreeIter iter;
+    const gchar *rowname;
+    int valid, id = 0;
+
+    valid = gtk_tree_model_get_iter_first(model, &iter);
+    while (valid && !id)
+    {
+        gtk_tree_model_get(model, &iter, COL_ID, &id, -1);
+        rowname = row_name(model, &iter);
+        if (id == ID_FLOATING || strcmp(rowname, name) != 0 ||
+            (slaves && !gtk_tree_model_iter_has_child(model, &iter)))
+            id = 0;
+        valid = gtk_tree_model_iter_next(model, &iter);
+    }
+
+    return id;
+}
+
+/**
+ * Run the main loop until the row called name is there (or gone, if
+ * present is FALSE), and return the time since start. -1 on timeout.
+ */
+static gint64 wait_for_row(GDeviceSetup *gds, const char *name,
+                           gboolean present, gint64 start)
+{
+    while ((find_master_row(gds, name, TRUE) != 0) != present)
+    {
+        if (g_get_monotonic_time() - start > CHANGE_TIMEOUT)
+            return -1;
+        g_main_context_iteration(NULL, FALSE);
+        g_usleep(100);
+    }
+
+    return g_get_monotonic_time() - start;
+}
+
+static int compare_int64(const void *a, const void *b)
+{
+    gint64 x = *(const gint64*)a, y = *(const gint64*)b;
+
+    return (x > y) - (x < y);
+}
+
+static void report(const char *what, GArray *times)
+{
+    gint64 *t = (gint64*)times->data;
+    int n = times->len;
+
+    if (n == 0)
+    {
+        printf("%-16s no samples\n", what);
+        return;
+    }
+
+    qsort(t, n, sizeof(gint64), compare_int64);
+    printf("%-16s %6d %10.2f %10.2f %10.2f %10.2f %10.2f\n", what, n,
+           t[0] / 1000.0, t[(n * 50 + 99) / 100 - 1] / 1000.0,
+           t[(n * 90 + 99) / 100 - 1] / 1000.0,
+           t[(n * 99 + 99) / 100 - 1] / 1000.0, t[n - 1] / 1000.0);
+}
+
+int main(int argc, char *argv[])
+{
+    GDeviceSetup gds = { 0 };
+    gchar *server = "Xvfb";
+    gboolean use_display = FALSE;
+    int iterations = 50;
+    GOptionEntry entries[] = {
+        { "iterations", 0, 0, G_OPTION_ARG_INT, &iterations,
+          "MD pairs to create and remove", "N" },
+        { "refresh-delay", 0, 0, G_OPTION_ARG_INT, &gds.refresh_delay,
+          "Milliseconds to collect device changes before refreshing", "MS" },
+        { "server", 0, 0, G_OPTION_ARG_STRING, &server,
+          "X server to start, it needs to understand -displayfd", "BINARY" },
+        { "use-display", 0, 0, G_OPTION_ARG_NONE, &use_display,
+          "Use the server in $DISPLAY instead of starting one", NULL },
+        { NULL }
+    };
+    GOptionContext *context;
+    GError *error = NULL;
+    GArray *created, *removed, *requests;
+    gchar *name, *pointer;
+    gint64 start, t;
+    int i, id, failures = 0;
+
+    gds.refresh_delay = 50;
+
+    context = g_option_context_new(NULL);
+    g_option_context_add_main_entries(context, entries, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &error))
+    {
+        fprintf(stderr, "%s\n", error->message);
+        return 1;
+    }
+    g_option_context_free(context);
+
+    if (!use_display && !start_server(server))
+        return 1;
+
+    gds.dpy = dpy_init(&gds.xi_opcode);
+    if (!gds.dpy || !gtk_init_check(&argc, &argv))
+    {
+        fprintf(stderr, "Cannot connect to X server, or X server does not "
+                        "support XI 2.\n");
+        stop_server();
+        return 1;
+    }
+
+    gds.dirty = g_hash_table_new(g_direct_hash, g_direct_equal);
+    cache_init(&gds);
+    refresh_init(&gds);
+    gds.store = query_devices(&gds);
+    gds.treeview = GTK_TREE_VIEW(gtk_tree_view_new_with_model(
+                                    GTK_TREE_MODEL(gds.store)));
+    g_object_ref_sink(gds.treeview);
+    gds.event_source = x_event_source_new(&gds);
+
+    created = g_array_new(FALSE, FALSE, sizeof(gint64));
+    removed = g_array_new(FALSE, FALSE, sizeof(gint64));
+    requests = g_array_new(FALSE, FALSE, sizeof(gint64));
+
+    for (i = 0; i < iterations; i++)
+    {
+        name = g_strdup_printf("Bench %d", i);
+        pointer = g_strdup_printf("%s pointer", name);
+
+        start = g_get_monotonic_time();
+        if (!create_master(&gds, name))
+        {
+            failures++;
+            goto next;
+        }
+        t = g_get_monotonic_time() - start;
+        g_array_append_val(requests, t);
+
+        t = wait_for_row(&gds, pointer, TRUE, start);
+        if (t < 0)
+        {
+            failures++;
+            goto next;
+        }
+        g_array_append_val(created, t);
+
+        id = find_master_row(&gds, pointer, TRUE);
+        start = g_get_monotonic_time();
+        if (!remove_master(&gds, id))
+        {
+            failures++;
+            goto next;
+        }
+        t = g_get_monotonic_time() - start;
+        g_array_append_val(requests, t);
+
+        t = wait_for_row(&gds, pointer, FALSE, start);
+        if (t < 0)
+            failures++;
+        else
+            g_array_append_val(removed, t);
+
+next:
+        g_free(pointer);
+        g_free(name);
+    }
+
+    printf("refresh delay %d ms, %d iterations, %d failed\n",
+           gds.refresh_delay, iterations, failures);
+    printf("%-16s %6s %10s %10s %10s %10s %10s\n", "ms", "count",
+           "min", "p50", "p90", "p99", "max");
+    report("request", requests);
+    report("create->row", created);
+    report("remove->gone", removed);
+
+    g_array_unref(created);
+    g_array_unref(removed);
+    g_array_unref(requests);
+
+    if (gds.refresh_source)
+        g_source_remove(gds.refresh_source);
+    g_source_destroy(gds.event_source);
+    g_source_unref(gds.event_source);
+    g_object_unref(gds.treeview);
+    g_object_unref(gds.store);
+    g_hash_table_destroy(gds.dirty);
+    rows_free(&gds);
+    cache_free(&gds);
+    names_free(&gds);
+    XCloseDisplay(gds.dpy);
+    stop_server();
+
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,281 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.  You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* Runs reconcile_devices() on synthetic hierarchies, no X server needed.
+ * Each configuration is built once, then slaves are randomly reattached
+ * or floated between generations and every reconcile is timed. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "gui.h"
+
+#ifdef __GLIBC__
+/* Count allocations by wrapping glibc's allocator */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static guint64 allocations;
+
+void *malloc(size_t size)
+{
+    allocations++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+    allocations++;
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    allocations++;
+    return __libc_realloc(ptr, size);
+}
+#define HAVE_ALLOC_COUNT 1
+#else
+static guint64 allocations;
+#define HAVE_ALLOC_COUNT 0
+#endif
+
+/* A synthetic device list, as XIQueryDevice() would return it */
+typedef struct {
+    XIDeviceInfo *devices;
+    int           ndevices;
+    int           nmasters; /* MD pairs, ids 2 .. 2 * nmasters + 1 */
+    int           nslaves;
+} Hierarchy;
+
+static int master_id(int pair, gboolean keyboard)
+{
+    return 2 + 2 * pair + (keyboard ? 1 : 0);
+}
+
+static void hierarchy_attach(Hierarchy *h, XIDeviceInfo *dev, GRand *rand)
+{
+    gboolean keyboard = (dev->deviceid % 2);
+
+    dev->use = keyboard ? XISlaveKeyboard : XISlavePointer;
+    dev->attachment = master_id(g_rand_int_range(rand, 0, h->nmasters),
+                                keyboard);
+}
+
+static void hierarchy_init(Hierarchy *h, int nmasters, int nslaves,
+                           GRand *rand)
+{
+    XIDeviceInfo *dev;
+    int i;
+
+    h->nmasters = nmasters;
+    h->nslaves = nslaves;
+    h->ndevices = 2 * nmasters + nslaves;
+    h->devices = g_new0(XIDeviceInfo, h->ndevices);
+
+    for (i = 0; i < nmasters; i++)
+    {
+        dev = &h->devices[2 * i];
+        dev->deviceid = master_id(i, FALSE);
+        dev->use = XIMasterPointer;
+        dev->attachment = master_id(i, TRUE);
+        dev->name = g_strdup_printf("Seat %d pointer", i);
+
+        dev = &h->devices[2 * i + 1];
+        dev->deviceid = master_id(i, TRUE);
+        dev->use = XIMasterKeyboard;
+        dev->attachment = master_id(i, FALSE);
+        dev->name = g_strdup_printf("Seat %d keyboard", i);
+    }
+
+    for (i = 0; i < nslaves; i++)
+    {
+        dev = &h->devices[2 * nmasters + i];
+        dev->deviceid = 2 * nmasters + 2 + i;
+        dev->name = g_strdup_printf("Device %d", i);
+        hierarchy_attach(h, dev, rand);
+    }
+}
+
+/**
+ * Move a share of the slaves: floating ones get attached, of the others
+ * one in five is floated and the rest attached elsewhere.
+ */
+static void hierarchy_churn(Hierarchy *h, double churn, GRand *rand)
+{
+    int i, n;
+
+    n = h->nslaves * churn;
+    for (i = 0; i < n; i++)
+    {
+        XIDeviceInfo *dev;
+
+        dev = &h->devices[2 * h->nmasters +
+                          g_rand_int_range(rand, 0, h->nslaves)];
+        if (dev->use != XIFloatingSlave && g_rand_int_range(rand, 0, 5) == 0)
+        {
+            dev->use = XIFloatingSlave;
+            dev->attachment = 0;
+        } else
+            hierarchy_attach(h, dev, rand);
+    }
+}
+
+static void hierarchy_free(Hierarchy *h)
+{
+    int i;
+
+    for (i = 0; i < h->ndevices; i++)
+        g_free(h->devices[i].name);
+    g_free(h->devices);
+}
+
+static int compare_int64(const void *a, const void *b)
+{
+    gint64 x = *(const gint64*)a, y = *(const gint64*)b;
+
+    return (x > y) - (x < y);
+}
+
+static void render_name(GtkTreeViewColumn *col, GtkCellRenderer *renderer,
+                        GtkTreeModel *model, GtkTreeIter *iter, gpointer data)
+{
+    g_object_set(renderer, "text", row_name(model, iter), NULL);
+}
+
+static void run(int nmasters, int nslaves, gboolean with_view,
+                int generations, double churn, guint32 seed)
+{
+    GDeviceSetup gds = { 0 };
+    GtkTreeStore *treestore;
+    GtkWidget *view = NULL;
+    Hierarchy h;
+    GRand *rand;
+    gint64 *times;
+    gint64 start, build, sum = 0;
+    guint64 allocs, alloc_sum = 0;
+    int i;
+
+    rand = g_rand_new_with_seed(seed);
+    hierarchy_init(&h, nmasters, nslaves, rand);
+
+    gds.dirty = g_hash_table_new(g_direct_hash, g_direct_equal);
+    gds.icons_loaded = TRUE; /* no icons, they'd need a display */
+    treestore = tree_store_new(&gds);
+
+    if (with_view)
+    {
+        view = gtk_tree_view_new_with_model(GTK_TREE_MODEL(treestore));
+        g_object_ref_sink(view);
+        gtk_tree_view_insert_column_with_data_func(GTK_TREE_VIEW(view), -1,
+                "Device", gtk_cell_renderer_text_new(), render_name,
+                NULL, NULL);
+        gtk_tree_view_expand_all(GTK_TREE_VIEW(view));
+    }
+
+    start = g_get_monotonic_time();
+    reconcile_devices(&gds, treestore, h.devices, h.ndevices);
+    build = g_get_monotonic_time() - start;
+
+    times = g_new(gint64, MAX(generations, 1));
+    for (i = 0; i < generations; i++)
+    {
+        hierarchy_churn(&h, churn, rand);
+
+        allocs = allocations;
+        start = g_get_monotonic_time();
+        reconcile_devices(&gds, treestore, h.devices, h.ndevices);
+        times[i] = g_get_monotonic_time() - start;
+        alloc_sum += allocations - allocs;
+        sum += times[i];
+    }
+    qsort(times, generations, sizeof(gint64), compare_int64);
+
+    printf("%7d %7d %4s %10.2f", nmasters, nslaves, with_view ? "yes" : "no",
+           build / 1000.0);
+    if (generations > 0)
+    {
+        printf(" %10.2f %10.2f %10.2f %9.1f",
+               sum / 1000.0 / generations,
+               times[(generations * 99 + 99) / 100 - 1] / 1000.0,
+               (double)sum / generations / h.ndevices * 1000.0,
+               (double)alloc_sum / generations);
+        if (!HAVE_ALLOC_COUNT)
+            printf(" (not counted)");
+    }
+    printf("\n");
+    fflush(stdout);
+
+    g_free(times);
+    if (view)
+        g_object_unref(view);
+    g_object_unref(treestore);
+    rows_free(&gds);
+    names_free(&gds);
+    g_hash_table_destroy(gds.dirty);
+    hierarchy_free(&h);
+    g_rand_free(rand);
+}
+
+int main(int argc, char *argv[])
+{
+    static const int masters[] = { 10, 100, 1000 };
+    static const int slaves[] = { 100, 1000, 10000 };
+    int generations = 20;
+    double churn = 0.05;
+    gint seed = 1;
+    gboolean have_display;
+    GOptionEntry entries[] = {
+        { "generations", 0, 0, G_OPTION_ARG_INT, &generations,
+          "Reconciles per configuration after the first", "N" },
+        { "churn", 0, 0, G_OPTION_ARG_DOUBLE, &churn,
+          "Share of slaves moved between generations", "FRACTION" },
+        { "seed", 0, 0, G_OPTION_ARG_INT, &seed,
+          "Random seed", "N" },
+        { NULL }
+    };
+    GOptionContext *context;
+    GError *error = NULL;
+    int i, j;
+
+    context = g_option_context_new(NULL);
+    g_option_context_add_main_entries(context, entries, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &error))
+    {
+        fprintf(stderr, "%s\n", error->message);
+        return 1;
+    }
+    g_option_context_free(context);
+
+    /* the runs with a GtkTreeView need GTK, the others don't */
+    have_display = gtk_init_check(&argc, &argv);
+    if (!have_display)
+        fprintf(stderr, "No display, skipping the runs with a GtkTreeView.\n");
+
+    printf("%7s %7s %4s %10s %10s %10s %10s %9s\n",
+           "masters", "slaves", "view", "build(ms)", "avg(ms)", "p99(ms)",
+           "ns/dev", "allocs");
+    for (i = 0; i < G_N_ELEMENTS(masters); i++)
+    {
+        for (j = 0; j < G_N_ELEMENTS(slaves); j++)
+        {
+            run(masters[i], slaves[j], FALSE, generations, churn, seed);
+            if (have_display)
+                run(masters[i], slaves[j], TRUE, generations, churn, seed);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,383 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.  You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* The device cache. Name, use, attachment and classes come with every
+ * XIQueryDevice and are simply taken over. Properties cost a request per
+ * device, so they are only fetched for devices new to the cache, devices
+ * whose name changed (the server reuses ids) and devices whose property
+ * changed according to XI_PropertyEvent. Hierarchy events keep the rest
+ * up to date in between. */
+
+#include <X11/Xlib.h>
+#include <X11/extensions/XInput2.h>
+#include <glib.h>
+#include <string.h>
+#include "idm.h"
+#include "stats.h"
+
+static void entry_free(gpointer data)
+{
+    DeviceEntry *entry = (DeviceEntry*)data;
+
+    g_free(entry->node);
+    g_free(entry);
+}
+
+void cache_init(GDeviceSetup *gds)
+{
+    gds->devices = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                         NULL, entry_free);
+    gds->product_id_atom = XInternAtom(gds->dpy, "Device Product ID", False);
+    gds->device_node_atom = XInternAtom(gds->dpy, "Device Node", False);
+}
+
+void cache_free(GDeviceSetup *gds)
+{
+    if (gds->devices)
+        g_hash_table_destroy(gds->devices);
+    gds->devices = NULL;
+}
+
+/**
+ * The cache entry for device id, or NULL if there's none.
+ */
+DeviceEntry* cache_lookup(GDeviceSetup *gds, int id)
+{
+    return g_hash_table_lookup(gds->devices, GINT_TO_POINTER(id));
+}
+
+static guint class_mask(XIDeviceInfo *dev, int *num_valuators)
+{
+    guint mask = 0;
+    int i;
+
+    *num_valuators = 0;
+    for (i = 0; i < dev->num_classes; i++)
+    {
+        switch(dev->classes[i]->type)
+        {
+            case XIKeyClass:
+                mask |= CLASS_KEY;
+                break;
+            case XIButtonClass:
+                mask |= CLASS_BUTTON;
+                break;
+            case XIValuatorClass:
+                mask |= CLASS_VALUATOR;
+                (*num_valuators)++;
+                break;
+#ifdef XIScrollClass
+            case XIScrollClass:
+                mask |= CLASS_SCROLL;
+                break;
+#endif
+#ifdef XITouchClass
+            case XITouchClass:
+                mask |= CLASS_TOUCH;
+                break;
+#endif
+        }
+    }
+
+    return mask;
+}
+
+static gboolean keyboard_slave(int use, guint classes)
+{
+    if (use != XIFloatingSlave)
+        return use == XISlaveKeyboard;
+
+    return !(classes & (CLASS_BUTTON | CLASS_VALUATOR));
+}
+
+/**
+ * Whether a SD needs a master keyboard. Floating SDs don't say, so they
+ * count as pointers if they have buttons or axes.
+ */
+gboolean cache_entry_is_keyboard(const DeviceEntry *entry)
+{
+    return keyboard_slave(entry->use, entry->classes);
+}
+
+/**
+ * Like cache_entry_is_keyboard(), for a device as XIQueryDevice returns
+ * it.
+ */
+gboolean is_keyboard_slave(XIDeviceInfo *dev)
+{
+    int num_valuators;
+
+    return keyboard_slave(dev->use, class_mask(dev, &num_valuators));
+}
+
+/**
+ * Take over what XIQueryDevice told us about dev.
+ * Returns TRUE if the entry's properties need fetching.
+ */
+static gboolean store_device(GDeviceSetup *gds, XIDeviceInfo *dev)
+{
+    DeviceEntry *entry = cache_lookup(gds, dev->deviceid);
+
+    if (!entry)
+    {
+        entry = g_new0(DeviceEntry, 1);
+        entry->id = dev->deviceid;
+        g_hash_table_insert(gds->devices, GINT_TO_POINTER(entry->id), entry);
+    }
+
+    /* a different name on the same id is a different device */
+    if (!entry->name || strcmp(entry->name, dev->name) != 0)
+    {
+        entry->name = intern_name(gds, dev->name);
+        entry->have_props = FALSE;
+    }
+
+    entry->use = dev->use;
+    entry->attachment = dev->attachment;
+    entry->enabled = dev->enabled;
+    entry->classes = class_mask(dev, &entry->num_valuators);
+
+    return !entry->have_props;
+}
+
+static void set_props(DeviceEntry *entry, const DeviceProps *props)
+{
+    entry->have_props = TRUE;
+    entry->have_product = props->have_product;
+    entry->vendor = props->vendor;
+    entry->product = props->product;
+    g_free(entry->node);
+    entry->node = g_strdup(props->node);
+}
+
+/**
+ * Fetch the properties of the devices in ids, all in one go.
+ */
+static void fetch_props(GDeviceSetup *gds, GArray *ids)
+{
+    guint *vendors, *products;
+    gboolean *have;
+    gchar **nodes;
+    int i, n = ids->len;
+
+    if (n == 0)
+        return;
+
+    vendors = g_new0(guint, n);
+    products = g_new0(guint, n);
+    have = g_new0(gboolean, n);
+    nodes = g_new0(gchar*, n);
+
+    get_product_ids(gds->dpy, gds->product_id_atom, (int*)ids->data, n,
+                    vendors, products, have);
+    get_device_nodes(gds->dpy, gds->device_node_atom, (int*)ids->data, n,
+                     nodes);
+
+    for (i = 0; i < n; i++)
+    {
+        DeviceEntry *entry = cache_lookup(gds, g_array_index(ids, int, i));
+
+        entry->have_props = TRUE;
+        entry->have_product = have[i];
+        entry->vendor = vendors[i];
+        entry->product = products[i];
+        g_free(entry->node);
+        entry->node = nodes[i];
+    }
+
+    g_free(vendors);
+    g_free(products);
+    g_free(have);
+    g_free(nodes);
+}
+
+static gboolean entry_unseen(gpointer key, gpointer value, gpointer data)
+{
+    return !g_hash_table_contains((GHashTable*)data, key);
+}
+
+/**
+ * Update the cache from a query of all devices. Devices not in the list
+ * are dropped. props, if not NULL, has the properties of each device,
+ * otherwise they're fetched where needed.
+ */
+void cache_update_all(GDeviceSetup *gds, XIDeviceInfo *devices, int ndevices,
+                      const DeviceProps *props)
+{
+    GHashTable *seen;
+    GArray *fetch;
+    int i;
+
+    seen = g_hash_table_new(g_direct_hash, g_direct_equal);
+    fetch = g_array_new(FALSE, FALSE, sizeof(int));
+
+    for (i = 0; i < ndevices; i++)
+    {
+        g_hash_table_add(seen, GINT_TO_POINTER(devices[i].deviceid));
+        if (props)
+        {
+            store_device(gds, &devices[i]);
+            set_props(cache_lookup(gds, devices[i].deviceid), &props[i]);
+        } else if (store_device(gds, &devices[i]))
+            g_array_append_val(fetch, devices[i].deviceid);
+    }
+
+    g_hash_table_foreach_remove(gds->devices, entry_unseen, seen);
+    g_hash_table_destroy(seen);
+
+    fetch_props(gds, fetch);
+    g_array_unref(fetch);
+}
+
+/**
+ * Update the cache with n single device queries, NULL entries are
+ * skipped. props as for cache_update_all().
+ */
+void cache_update_devices(GDeviceSetup *gds, XIDeviceInfo **infos, int n,
+                          const DeviceProps *props)
+{
+    GArray *fetch;
+    int i;
+
+    fetch = g_array_new(FALSE, FALSE, sizeof(int));
+
+    for (i = 0; i < n; i++)
+    {
+        if (!infos[i])
+            continue;
+
+        if (props)
+        {
+            store_device(gds, infos[i]);
+            set_props(cache_lookup(gds, infos[i]->deviceid), &props[i]);
+        } else if (store_device(gds, infos[i]))
+            g_array_append_val(fetch, infos[i]->deviceid);
+    }
+
+    fetch_props(gds, fetch);
+    g_array_unref(fetch);
+}
+
+/**
+ * Apply one entry of an XI_HierarchyChanged event. New devices only get
+ * into the cache with their first query.
+ */
+void cache_hierarchy_info(GDeviceSetup *gds, XIHierarchyInfo *info)
+{
+    DeviceEntry *entry;
+
+    if (info->flags & (XIMasterRemoved | XISlaveRemoved))
+    {
+        cache_remove(gds, info->deviceid);
+        return;
+    }
+
+    entry = cache_lookup(gds, info->deviceid);
+    if (!entry)
+        return;
+
+    if (info->flags & (XISlaveAttached | XISlaveDetached))
+    {
+        entry->use = info->use;
+        entry->attachment = info->attachment;
+    }
+    if (info->flags & (XIDeviceEnabled | XIDeviceDisabled))
+        entry->enabled = info->enabled;
+}
+
+/**
+ * Have the properties of device id fetched again with its next update.
+ * Returns FALSE if the device isn't in the cache.
+ */
+gboolean cache_invalidate(GDeviceSetup *gds, int id)
+{
+    DeviceEntry *entry = cache_lookup(gds, id);
+
+    if (!entry)
+        return FALSE;
+
+    entry->have_props = FALSE;
+
+    return TRUE;
+}
+
+/**
+ * Id of the MD with the given name, or 0.
+ */
+int cache_find_master(GDeviceSetup *gds, const char *name)
+{
+    GHashTableIter it;
+    DeviceEntry *entry;
+
+    g_hash_table_iter_init(&it, gds->devices);
+    while (g_hash_table_iter_next(&it, NULL, (gpointer*)&entry))
+        if ((entry->use == XIMasterPointer || entry->use == XIMasterKeyboard) &&
+            strcmp(entry->name, name) == 0)
+            return entry->id;
+
+    return 0;
+}
+
+void cache_remove(GDeviceSetup *gds, int id)
+{
+    g_hash_table_remove(gds->devices, GINT_TO_POINTER(id));
+}
+
+/**
+ * The one copy of name that gds keeps. Names are never freed before
+ * names_free(), but a name is only stored once however often its device
+ * comes and goes, so memory stays flat under hotplug churn. Its casefolded
+ * form for the search goes in along with it, so filtering the view never
+ * folds a name.
+ */
+const gchar* intern_name(GDeviceSetup *gds, const char *name)
+{
+    gchar *interned, *folded;
+
+    if (!gds->names)
+    {
+        gds->names = g_string_chunk_new(1024);
+        gds->interned = g_hash_table_new(g_str_hash, g_str_equal);
+        gds->folded = g_hash_table_new(g_direct_hash, g_direct_equal);
+    }
+
+    interned = g_hash_table_lookup(gds->interned, name);
+    if (!interned)
+    {
+        interned = g_string_chunk_insert(gds->names, name);
+        g_hash_table_add(gds->interned, interned);
+
+        folded = g_utf8_casefold(name, -1);
+        g_hash_table_insert(gds->folded, interned,
+                            g_string_chunk_insert_const(gds->names, folded));
+        stats_count(STAT_NAMES_INTERNED, 1);
+        stats_count(STAT_NAME_BYTES, strlen(name) + strlen(folded) + 2);
+        g_free(folded);
+    }
+
+    return interned;
+}
+
+void names_free(GDeviceSetup *gds)
+{
+    if (gds->folded)
+        g_hash_table_destroy(gds->folded);
+    if (gds->interned)
+        g_hash_table_destroy(gds->interned);
+    if (gds->names)
+        g_string_chunk_free(gds->names);
+    gds->folded = NULL;
+    gds->interned = NULL;
+    gds->names = NULL;
+}
@@ -0,0 +1,48 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.  You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* input-device-manager-cli: the command line modes without the window,
+ * for hooks and minimal systems that don't have GTK. */
+
+#include <X11/Xlib.h>
+#include <X11/extensions/XInput2.h>
+#include <glib.h>
+#include <stdio.h>
+#include "idm.h"
+
+int main(int argc, char *argv[])
+{
+    GDeviceSetup gds = { 0 };
+    CmdlineData cmdline = { &gds };
+    int status;
+
+    /* hierarchy changes on the command line are collected in one batch */
+    hierarchy_begin(&gds);
+    if (!cmdline_parse(&cmdline, &argc, &argv, FALSE))
+    {
+        hierarchy_abort(&gds);
+        cmdline_free(&cmdline);
+        return 1;
+    }
+
+    status = cmdline_run(&gds, &cmdline);
+    if (status < 0)
+    {
+        fprintf(stderr, "Nothing to do, see --help.\n");
+        status = 1;
+    }
+    cmdline_free(&cmdline);
+
+    return status;
+}
@@ -0,0 +1,490 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.  You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* The command line, shared by the GUI and the command line only program,
+ * and everything it can do without a window: hierarchy changes, profiles,
+ * presets, journal replays and the daemon. */
+
+#include <X11/Xlib.h>
+#include <X11/extensions/XInput2.h>
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "idm.h"
+#include "stats.h"
+
+/* One display of --displays on the command line */
+typedef struct {
+    GDeviceSetup  gds;
+    CmdlineData  *cmdline;
+    const char   *name;
+    int           status;       /* exit status */
+} DisplayRun;
+
+/**
+ * Load the auto-attach rules from path, or from the default rules file if
+ * path is NULL. The default rules file is optional, one given explicitly
+ * isn't. Takes path. Without the rule engine, there are no rules to load.
+ */
+gboolean load_rules(GDeviceSetup *gds, gchar *path)
+{
+#ifdef HAVE_RULES
+    GError *error = NULL;
+    gboolean explicit = (path != NULL);
+
+    if (!path)
+        path = g_build_filename(g_get_user_config_dir(),
+                                "input-device-manager", "rules", NULL);
+    if ((explicit || g_file_test(path, G_FILE_TEST_EXISTS)) &&
+        !rules_load(gds, path, &error))
+    {
+        fprintf(stderr, "%s: %s\n", path, error->message);
+        g_error_free(error);
+        g_free(path);
+        return FALSE;
+    }
+#endif
+    g_free(path);
+
+    return TRUE;
+}
+
+/**
+ * Like load_rules(), for the seat-switch presets.
+ */
+gboolean load_presets(GDeviceSetup *gds, gchar *path)
+{
+    GError *error = NULL;
+    gboolean explicit = (path != NULL);
+
+    if (!path)
+        path = g_build_filename(g_get_user_config_dir(),
+                                "input-device-manager", "presets", NULL);
+    if ((explicit || g_file_test(path, G_FILE_TEST_EXISTS)) &&
+        !presets_load(gds, path, &error))
+    {
+        fprintf(stderr, "%s: %s\n", path, error->message);
+        g_error_free(error);
+        g_free(path);
+        return FALSE;
+    }
+    g_free(path);
+
+    return TRUE;
+}
+
+static gboolean parse_device_id(const gchar *option_name, const gchar *value,
+                                int *id, GError **error)
+{
+    gchar *end;
+    long val;
+
+    val = strtol(value, &end, 10);
+    if (*value == '\0' || *end != '\0' || val < 2 || val > G_MAXINT)
+    {
+        g_set_error(error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                    "%s: invalid device id '%s'", option_name, value);
+        return FALSE;
+    }
+
+    *id = val;
+    return TRUE;
+}
+
+/**
+ * Command line hierarchy changes. These are only queued here and applied
+ * in one batch once the command line has been parsed.
+ */
+static gboolean option_hierarchy_change(const gchar *option_name,
+                                        const gchar *value,
+                                        gpointer data,
+                                        GError **error)
+{
+    CmdlineData *cmdline = (CmdlineData*)data;
+    int id;
+
+    if (strcmp(option_name, "--to") != 0 && cmdline->attach_id)
+    {
+        g_set_error(error, G_OPTION_ERROR, G_OPTION_ERROR_FAILED,
+                    "--attach %d needs --to", cmdline->attach_id);
+        return FALSE;
+    }
+
+    if (strcmp(option_name, "--create") == 0)
+        return create_master(cmdline->gds, value);
+
+    if (!parse_device_id(option_name, value, &id, error))
+        return FALSE;
+
+    if (strcmp(option_name, "--attach") == 0)
+        cmdline->attach_id = id;
+    else if (strcmp(option_name, "--to") == 0)
+    {
+        if (!cmdline->attach_id)
+        {
+            g_set_error(error, G_OPTION_ERROR, G_OPTION_ERROR_FAILED,
+                        "--to %d without --attach", id);
+            return FALSE;
+        }
+        change_attachment(cmdline->gds, cmdline->attach_id, id);
+        cmdline->attach_id = 0;
+    } else if (strcmp(option_name, "--float") == 0)
+        float_device(cmdline->gds, id);
+    else if (strcmp(option_name, "--remove") == 0)
+        remove_master(cmdline->gds, id);
+
+    return TRUE;
+}
+
+/**
+ * Parse our own options. With gui, the GUI's options are taken too and
+ * GTK's options are left in argv for gtk_init(). Statistics are started
+ * right away, if asked for, and --displays is split into cmdline->names.
+ */
+gboolean cmdline_parse(CmdlineData *cmdline, int *argc, char ***argv,
+                       gboolean gui)
+{
+    GOptionEntry entries[] = {
+        { "attach", 0, 0, G_OPTION_ARG_CALLBACK, option_hierarchy_change,
+          "Attach slave device ID to the master given with --to", "ID" },
+        { "to", 0, 0, G_OPTION_ARG_CALLBACK, option_hierarchy_change,
+          "Master device ID for the preceding --attach", "ID" },
+        { "float", 0, 0, G_OPTION_ARG_CALLBACK, option_hierarchy_change,
+          "Set slave device ID floating", "ID" },
+        { "create", 0, 0, G_OPTION_ARG_CALLBACK, option_hierarchy_change,
+          "Create a master device pair called NAME", "NAME" },
+        { "remove", 0, 0, G_OPTION_ARG_CALLBACK, option_hierarchy_change,
+          "Remove master device ID", "ID" },
+        { "apply-profile", 0, 0, G_OPTION_ARG_FILENAME, &cmdline->apply_profile,
+          "Apply the profile in FILE", "FILE" },
+        { "save-profile", 0, 0, G_OPTION_ARG_FILENAME, &cmdline->save_profile,
+          "Save the current hierarchy as profile to FILE", "FILE" },
+#ifdef HAVE_RULES
+        { "rules", 0, 0, G_OPTION_ARG_FILENAME, &cmdline->rules,
+          "Auto-attach new devices as the rules in FILE say", "FILE" },
+#endif
+        { "presets", 0, 0, G_OPTION_ARG_FILENAME, &cmdline->presets,
+          "Load seat-switch presets and their hotkeys from FILE", "FILE" },
+        { "preset", 0, 0, G_OPTION_ARG_STRING, &cmdline->preset,
+          "Apply the seat-switch preset NAME", "NAME" },
+        { "journal", 0, 0, G_OPTION_ARG_FILENAME, &cmdline->journal,
+          "Save the hierarchy changes made to FILE on exit", "FILE" },
+        { "replay", 0, 0, G_OPTION_ARG_FILENAME, &cmdline->replay,
+          "Apply the changes saved with --journal in FILE at once", "FILE" },
+        { "displays", 0, 0, G_OPTION_ARG_STRING, &cmdline->displays,
+          "Manage the comma-separated X DISPLAYS instead of $DISPLAY",
+          "DISPLAYS" },
+#ifdef HAVE_STATS
+        { "stats", 0, 0, G_OPTION_ARG_NONE, &cmdline->stats,
+          "Time server requests and updates, print a summary on exit or SIGUSR1",
+          NULL },
+        { "stats-json", 0, 0, G_OPTION_ARG_FILENAME, &cmdline->stats_json,
+          "Like --stats, and append every sample to FILE as JSON lines", "FILE" },
+#endif
+        { "daemon", 0, 0, G_OPTION_ARG_NONE, &cmdline->daemon,
+          "Offer the device hierarchy on the session bus instead of showing it",
+          NULL },
+        { NULL }
+    };
+    GOptionEntry gui_entries[] = {
+        { "refresh-delay", 0, 0, G_OPTION_ARG_INT, &cmdline->gds->refresh_delay,
+          "Milliseconds to collect device changes before refreshing", "MS" },
+        { "shared-connection", 0, 0, G_OPTION_ARG_NONE, &cmdline->shared,
+          "Use GTK's X connection only, and query devices on it from the "
+          "main thread", NULL },
+        { "monitor", 0, 0, G_OPTION_ARG_NONE, &cmdline->monitor,
+          "Show the raw events per second of each device", NULL },
+        { NULL }
+    };
+    GOptionContext *context;
+    GOptionGroup *group;
+    GError *error = NULL;
+    gboolean ret;
+
+    context = g_option_context_new(NULL);
+    if (gui)
+        g_option_context_set_summary(context,
+            "Without hierarchy changes or profiles on the command line, the\n"
+            "device hierarchy is shown in a window. Otherwise the changes\n"
+            "are applied in the order given, followed by --replay,\n"
+            "--preset, --apply-profile and --save-profile, and the program\n"
+            "exits.\n"
+            "With --daemon, the hierarchy is managed through D-Bus instead.");
+    else
+        g_option_context_set_summary(context,
+            "The hierarchy changes are applied in the order given, followed\n"
+            "by --replay, --preset, --apply-profile and --save-profile.\n"
+            "With --daemon, the hierarchy is managed through D-Bus instead.");
+    group = g_option_group_new(NULL, NULL, NULL, cmdline, NULL);
+    g_option_group_add_entries(group, entries);
+    if (gui)
+        g_option_group_add_entries(group, gui_entries);
+    g_option_context_set_main_group(context, group);
+    g_option_context_set_ignore_unknown_options(context, gui);
+
+    ret = g_option_context_parse(context, argc, argv, &error);
+    if (ret && cmdline->daemon &&
+        (hierarchy_pending(cmdline->gds) > 0 || cmdline->preset ||
+         cmdline->replay || cmdline->apply_profile || cmdline->save_profile))
+    {
+        g_set_error(&error, G_OPTION_ERROR, G_OPTION_ERROR_FAILED,
+                    "--daemon takes no hierarchy changes, journals, presets "
+                    "or profiles");
+        ret = FALSE;
+    }
+    if (ret && cmdline->displays && (cmdline->shared || cmdline->daemon))
+    {
+        g_set_error(&error, G_OPTION_ERROR, G_OPTION_ERROR_FAILED,
+                    "--displays goes with neither --shared-connection nor "
+                    "--daemon");
+        ret = FALSE;
+    }
+    if (ret && cmdline->attach_id)
+    {
+        g_set_error(&error, G_OPTION_ERROR, G_OPTION_ERROR_FAILED,
+                    "--attach %d needs --to", cmdline->attach_id);
+        ret = FALSE;
+    }
+
+    if (!ret)
+    {
+        fprintf(stderr, "%s\n", error->message);
+        g_error_free(error);
+    }
+    g_option_context_free(context);
+
+    if (!ret)
+        return FALSE;
+
+    /* IDM_STATS and IDM_STATS_JSON do the same as --stats and --stats-json */
+    if (!cmdline->stats_json && g_getenv("IDM_STATS_JSON"))
+        cmdline->stats_json = g_strdup(g_getenv("IDM_STATS_JSON"));
+    if (cmdline->stats || cmdline->stats_json || g_getenv("IDM_STATS"))
+        stats_init(cmdline->stats_json);
+
+    if (cmdline->displays)
+        cmdline->names = g_strsplit(cmdline->displays, ",", -1);
+
+    return TRUE;
+}
+
+/**
+ * --preset: presets are resolved against the cache, so fill it first.
+ */
+static gboolean run_preset(GDeviceSetup *gds, CmdlineData *cmdline)
+{
+    GError *error = NULL;
+    XIDeviceInfo *devices;
+    int ndevices;
+    gboolean ret;
+
+    if (!load_presets(gds, g_strdup(cmdline->presets)))
+        return FALSE;
+
+    cache_init(gds);
+    devices = query_device_info(gds->dpy, XIAllDevices, &ndevices);
+    cache_update_all(gds, devices, ndevices, NULL);
+    free_device_info(devices);
+
+    ret = preset_apply(gds, cmdline->preset, TRUE, &error);
+    if (!ret)
+    {
+        fprintf(stderr, "%s\n", error->message);
+        g_error_free(error);
+    }
+
+    presets_free(gds);
+    cache_free(gds);
+    names_free(gds);
+
+    return ret;
+}
+
+/**
+ * --replay: like --preset, devices are found in the cache.
+ */
+static gboolean run_replay(GDeviceSetup *gds, CmdlineData *cmdline)
+{
+    GError *error = NULL;
+    XIDeviceInfo *devices;
+    int ndevices;
+    gboolean ret;
+
+    cache_init(gds);
+    devices = query_device_info(gds->dpy, XIAllDevices, &ndevices);
+    cache_update_all(gds, devices, ndevices, NULL);
+    free_device_info(devices);
+
+    ret = journal_replay(gds, cmdline->replay, &error);
+    if (!ret)
+    {
+        fprintf(stderr, "%s: %s\n", cmdline->replay, error->message);
+        g_error_free(error);
+    }
+
+    cache_free(gds);
+    names_free(gds);
+
+    return ret;
+}
+
+/**
+ * Apply the hierarchy changes and profiles given on the command line to
+ * display name, NULL for $DISPLAY. Nothing but our own display connection
+ * is needed for this, GTK is never initialized.
+ */
+static int run_cmdline(GDeviceSetup *gds, CmdlineData *cmdline,
+                       const char *name)
+{
+    GError *error = NULL;
+    gboolean ret;
+
+    gds->dpy = dpy_init_display(name, &gds->xi_opcode);
+    if (!gds->dpy)
+    {
+        fprintf(stderr, "Cannot connect to X server %s, or X server does "
+                        "not support XI 2.\n", name ? name : "");
+        hierarchy_abort(gds);
+        return 1;
+    }
+    stats_set_server(ServerVendor(gds->dpy), VendorRelease(gds->dpy));
+
+    ret = hierarchy_commit(gds);
+
+    if (cmdline->replay && !run_replay(gds, cmdline))
+        ret = FALSE;
+
+    if (cmdline->preset && !run_preset(gds, cmdline))
+        ret = FALSE;
+
+    if (cmdline->apply_profile &&
+        !profile_apply(gds, cmdline->apply_profile, &error))
+    {
+        fprintf(stderr, "%s\n", error->message);
+        g_clear_error(&error);
+        ret = FALSE;
+    }
+
+    if (cmdline->save_profile &&
+        !profile_save_devices(gds, cmdline->save_profile, &error))
+    {
+        fprintf(stderr, "%s\n", error->message);
+        g_clear_error(&error);
+        ret = FALSE;
+    }
+
+    XCloseDisplay(gds->dpy);
+
+    return ret ? 0 : 1;
+}
+
+static gpointer run_display(gpointer data)
+{
+    DisplayRun *run = (DisplayRun*)data;
+
+    run->status = run_cmdline(&run->gds, run->cmdline, run->name);
+
+    return NULL;
+}
+
+/**
+ * --displays with changes on the command line: all of them go to every
+ * display, each on a thread and connection of its own, so one slow server
+ * doesn't hold up the others.
+ */
+static int run_cmdline_displays(GDeviceSetup *gds, CmdlineData *cmdline,
+                                gchar **names)
+{
+    int n = g_strv_length(names);
+    DisplayRun *runs = g_new0(DisplayRun, n);
+    GThread **threads = g_new(GThread*, n);
+    int i, status = 0;
+
+    XInitThreads();
+
+    for (i = 0; i < n; i++)
+    {
+        runs[i].cmdline = cmdline;
+        runs[i].name = names[i];
+        runs[i].gds.refresh_delay = gds->refresh_delay;
+
+        /* the names of XIAddMaster changes stay with gds->batch, which
+         * outlives the threads */
+        hierarchy_begin(&runs[i].gds);
+        hierarchy_queue(&runs[i].gds,
+                        (XIAnyHierarchyChangeInfo*)gds->batch->changes->data,
+                        gds->batch->changes->len);
+        threads[i] = g_thread_new("idm-display", run_display, &runs[i]);
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        g_thread_join(threads[i]);
+        if (runs[i].status)
+            status = runs[i].status;
+    }
+
+    hierarchy_abort(gds);
+    g_free(threads);
+    g_free(runs);
+
+    return status;
+}
+
+/**
+ * Run what the command line asks for that needs no window: the hierarchy
+ * changes, journals, presets and profiles given, or the daemon.
+ * Returns the exit status, or -1 if there's nothing of the sort.
+ */
+int cmdline_run(GDeviceSetup *gds, CmdlineData *cmdline)
+{
+    int status;
+
+    if (hierarchy_pending(gds) > 0 || cmdline->preset || cmdline->replay ||
+        cmdline->apply_profile || cmdline->save_profile)
+    {
+        if (cmdline->names)
+            status = run_cmdline_displays(gds, cmdline, cmdline->names);
+        else
+            status = run_cmdline(gds, cmdline, NULL);
+        stats_shutdown();
+        return status;
+    }
+    hierarchy_abort(gds);
+
+    if (cmdline->daemon)
+    {
+        gds->journal = journal_new(cmdline->journal, NULL, NULL);
+        return load_rules(gds, g_strdup(cmdline->rules)) &&
+               load_presets(gds, g_strdup(cmdline->presets)) ?
+                    daemon_run(gds) : 1;
+    }
+
+    return -1;
+}
+
+void cmdline_free(CmdlineData *cmdline)
+{
+    g_free(cmdline->apply_profile);
+    g_free(cmdline->save_profile);
+    g_free(cmdline->rules);
+    g_free(cmdline->stats_json);
+    g_free(cmdline->presets);
+    g_free(cmdline->preset);
+    g_free(cmdline->journal);
+    g_free(cmdline->replay);
+    g_free(cmdline->displays);
+    g_strfreev(cmdline->names);
+}
@@ -0,0 +1,306 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.  You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* --daemon: keep one X connection and the device cache, and offer them on
+ * the session bus. Queries are answered from the cache, which hierarchy
+ * events keep up to date. Changes are applied right away and their result
+ * returned to the caller. */
+
+#include <X11/Xlib.h>
+#include <X11/extensions/XInput2.h>
+#include <gio/gio.h>
+#include <glib-unix.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "idm.h"
+#include "stats.h"
+
+#define DAEMON_BUS_NAME    "io.github.bk138.InputDeviceManager"
+#define DAEMON_OBJECT_PATH "/io/github/bk138/InputDeviceManager"
+#define DAEMON_INTERFACE   DAEMON_BUS_NAME
+
+static const gchar introspection_xml[] =
+    "<node>"
+    "  <interface name='" DAEMON_INTERFACE "'>"
+    "    <method name='ListDevices'>"
+    "      <arg type='a(isiib)' name='devices' direction='out'/>"
+    "    </method>"
+    "    <method name='Attach'>"
+    "      <arg type='i' name='device' direction='in'/>"
+    "      <arg type='i' name='master' direction='in'/>"
+    "    </method>"
+    "    <method name='Float'>"
+    "      <arg type='i' name='device' direction='in'/>"
+    "    </method>"
+    "    <method name='CreateMaster'>"
+    "      <arg type='s' name='name' direction='in'/>"
+    "    </method>"
+    "    <method name='RemoveMaster'>"
+    "      <arg type='i' name='master' direction='in'/>"
+    "    </method>"
+    "    <method name='ApplyProfile'>"
+    "      <arg type='s' name='path' direction='in'/>"
+    "    </method>"
+    "    <method name='ApplyPreset'>"
+    "      <arg type='s' name='name' direction='in'/>"
+    "    </method>"
+    "    <method name='Undo'/>"
+    "    <method name='Redo'/>"
+    "    <signal name='HierarchyChanged'/>"
+    "  </interface>"
+    "</node>";
+
+typedef struct {
+    GDeviceSetup    *gds;
+    GMainLoop       *loop;
+    GDBusNodeInfo   *introspection;
+    GDBusConnection *connection;    /* once we're on the bus */
+    guint            registration;
+    int              status;        /* exit status */
+} Daemon;
+
+static gint compare_ids(gconstpointer a, gconstpointer b)
+{
+    return GPOINTER_TO_INT(a) - GPOINTER_TO_INT(b);
+}
+
+/**
+ * All devices as (id, name, use, attachment, enabled), by id.
+ */
+static GVariant* list_devices(GDeviceSetup *gds)
+{
+    GVariantBuilder builder;
+    GList *ids, *l;
+
+    g_variant_builder_init(&builder, G_VARIANT_TYPE("a(isiib)"));
+
+    ids = g_list_sort(g_hash_table_get_keys(gds->devices), compare_ids);
+    for (l = ids; l; l = l->next)
+    {
+        DeviceEntry *entry = cache_lookup(gds, GPOINTER_TO_INT(l->data));
+
+        g_variant_builder_add(&builder, "(isiib)", entry->id, entry->name,
+                              entry->use, entry->attachment, entry->enabled);
+    }
+    g_list_free(ids);
+
+    return g_variant_new("(a(isiib))", &builder);
+}
+
+static void handle_method_call(GDBusConnection *connection,
+                               const gchar *sender,
+                               const gchar *object_path,
+                               const gchar *interface_name,
+                               const gchar *method_name,
+                               GVariant *parameters,
+                               GDBusMethodInvocation *invocation,
+                               gpointer data)
+{
+    Daemon *daemon = (Daemon*)data;
+    GDeviceSetup *gds = daemon->gds;
+    GError *error = NULL;
+    const gchar *name;
+    int id, md_id;
+
+    if (g_strcmp0(method_name, "ListDevices") == 0)
+    {
+        g_dbus_method_invocation_return_value(invocation, list_devices(gds));
+        return;
+    }
+
+    if (g_strcmp0(method_name, "Attach") == 0)
+    {
+        g_variant_get(parameters, "(ii)", &id, &md_id);
+        if (!change_attachment(gds, id, md_id))
+            g_set_error(&error, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+                        "Attaching device %d to %d failed", id, md_id);
+    } else if (g_strcmp0(method_name, "Float") == 0)
+    {
+        g_variant_get(parameters, "(i)", &id);
+        if (!float_device(gds, id))
+            g_set_error(&error, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+                        "Floating device %d failed", id);
+    } else if (g_strcmp0(method_name, "CreateMaster") == 0)
+    {
+        g_variant_get(parameters, "(&s)", &name);
+        if (!create_master(gds, name))
+            g_set_error(&error, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+                        "Creating MD %s failed", name);
+    } else if (g_strcmp0(method_name, "RemoveMaster") == 0)
+    {
+        g_variant_get(parameters, "(i)", &id);
+        if (!remove_master(gds, id))
+            g_set_error(&error, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+                        "Removing MD %d failed", id);
+    } else if (g_strcmp0(method_name, "ApplyProfile") == 0)
+    {
+        g_variant_get(parameters, "(&s)", &name);
+        profile_apply(gds, name, &error);
+    } else if (g_strcmp0(method_name, "ApplyPreset") == 0)
+    {
+        g_variant_get(parameters, "(&s)", &name);
+        preset_apply(gds, name, TRUE, &error);
+    } else if (g_strcmp0(method_name, "Undo") == 0)
+    {
+        if (!journal_can_undo(gds->journal))
+            g_set_error(&error, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+                        "Nothing to undo");
+        else if (!journal_undo(gds, TRUE))
+            g_set_error(&error, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+                        "Not all changes could be undone");
+    } else if (g_strcmp0(method_name, "Redo") == 0)
+    {
+        if (!journal_can_redo(gds->journal))
+            g_set_error(&error, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+                        "Nothing to redo");
+        else if (!journal_redo(gds, TRUE))
+            g_set_error(&error, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+                        "Not all changes could be redone");
+    }
+
+    if (error)
+    {
+        g_dbus_method_invocation_return_gerror(invocation, error);
+        g_error_free(error);
+    } else
+        g_dbus_method_invocation_return_value(invocation, NULL);
+}
+
+static const GDBusInterfaceVTable interface_vtable = {
+    handle_method_call,
+    NULL,
+    NULL
+};
+
+static void daemon_hierarchy_changed(GDeviceSetup *gds, gpointer data)
+{
+    Daemon *daemon = (Daemon*)data;
+
+    if (!daemon->connection)
+        return;
+
+    g_dbus_connection_emit_signal(daemon->connection, NULL,
+                                  DAEMON_OBJECT_PATH, DAEMON_INTERFACE,
+                                  "HierarchyChanged", NULL, NULL);
+}
+
+static void on_bus_acquired(GDBusConnection *connection, const gchar *name,
+                            gpointer data)
+{
+    Daemon *daemon = (Daemon*)data;
+    GError *error = NULL;
+
+    daemon->registration = g_dbus_connection_register_object(connection,
+            DAEMON_OBJECT_PATH, daemon->introspection->interfaces[0],
+            &interface_vtable, daemon, NULL, &error);
+    if (!daemon->registration)
+    {
+        g_printerr("ERROR: Cannot register %s: %s\n", DAEMON_OBJECT_PATH,
+                   error->message);
+        g_error_free(error);
+        daemon->status = 1;
+        g_main_loop_quit(daemon->loop);
+        return;
+    }
+
+    daemon->connection = connection;
+}
+
+static void on_name_lost(GDBusConnection *connection, const gchar *name,
+                         gpointer data)
+{
+    Daemon *daemon = (Daemon*)data;
+
+    g_printerr("ERROR: Cannot own %s on the session bus\n", name);
+    daemon->status = 1;
+    g_main_loop_quit(daemon->loop);
+}
+
+static gboolean on_quit_signal(gpointer data)
+{
+    Daemon *daemon = (Daemon*)data;
+
+    g_main_loop_quit(daemon->loop);
+
+    return G_SOURCE_CONTINUE;
+}
+
+/**
+ * Run as D-Bus service until SIGINT or SIGTERM. Like the command line
+ * mode, GTK is never initialized.
+ * Returns the exit status.
+ */
+int daemon_run(GDeviceSetup *gds)
+{
+    Daemon daemon = { gds };
+    XIDeviceInfo *devices;
+    int ndevices;
+    guint owner;
+
+    gds->dpy = dpy_init(&gds->xi_opcode);
+    if (!gds->dpy)
+    {
+        fprintf(stderr, "Cannot connect to X server, or X server does not "
+                        "support XI 2.\n");
+        return 1;
+    }
+    stats_set_server(ServerVendor(gds->dpy), VendorRelease(gds->dpy));
+
+    cache_init(gds);
+    devices = query_device_info(gds->dpy, XIAllDevices, &ndevices);
+    cache_update_all(gds, devices, ndevices, NULL);
+    free_device_info(devices);
+
+    presets_grab_keys(gds);
+
+    gds->hierarchy_changed = daemon_hierarchy_changed;
+    gds->hierarchy_changed_data = &daemon;
+    gds->event_source = x_event_source_new(gds);
+
+    daemon.loop = g_main_loop_new(NULL, FALSE);
+    daemon.introspection = g_dbus_node_info_new_for_xml(introspection_xml,
+                                                        NULL);
+    owner = g_bus_own_name(G_BUS_TYPE_SESSION, DAEMON_BUS_NAME,
+                           G_BUS_NAME_OWNER_FLAGS_NONE,
+                           on_bus_acquired, NULL, on_name_lost,
+                           &daemon, NULL);
+
+    g_unix_signal_add(SIGINT, on_quit_signal, &daemon);
+    g_unix_signal_add(SIGTERM, on_quit_signal, &daemon);
+
+    g_main_loop_run(daemon.loop);
+
+    if (daemon.registration)
+        g_dbus_connection_unregister_object(daemon.connection,
+                                            daemon.registration);
+    g_bus_unown_name(owner);
+    g_dbus_node_info_unref(daemon.introspection);
+    g_main_loop_unref(daemon.loop);
+
+    g_source_destroy(gds->event_source);
+    g_source_unref(gds->event_source);
+    gds->event_source = NULL;
+    gds->hierarchy_changed = NULL;
+    if (gds->rules)
+        g_array_unref(gds->rules);
+    presets_free(gds);
+    journal_close(gds);
+    cache_free(gds);
+    names_free(gds);
+    XCloseDisplay(gds->dpy);
+    stats_shutdown();
+
+    return daemon.status;
+}
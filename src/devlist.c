@@ -0,0 +1,251 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.  You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* Compact device lists: a flat array of DeviceRecord sorted by id, with
+ * the names in one string arena. Two lists diff into the edits that turn
+ * one into the other, a merge of the two arrays. Nothing in here knows
+ * about the tree store, and refilling or diffing into existing lists
+ * allocates nothing once they're big enough. */
+
+#include <string.h>
+#include "idm.h"
+
+DeviceList* device_list_new(void)
+{
+    DeviceList *list = g_new0(DeviceList, 1);
+
+    list->records = g_array_new(FALSE, FALSE, sizeof(DeviceRecord));
+    list->names = g_string_new(NULL);
+
+    return list;
+}
+
+void device_list_free(DeviceList *list)
+{
+    if (!list)
+        return;
+
+    g_array_unref(list->records);
+    g_string_free(list->names, TRUE);
+    g_free(list);
+}
+
+void device_list_clear(DeviceList *list)
+{
+    g_array_set_size(list->records, 0);
+    g_string_truncate(list->names, 0);
+}
+
+const char* device_list_name(const DeviceList *list, const DeviceRecord *rec)
+{
+    return list->names->str + rec->name;
+}
+
+static guint add_name(DeviceList *list, const char *name)
+{
+    guint offset = list->names->len;
+
+    /* with the terminating 0, so names can be used right from the arena */
+    g_string_append_len(list->names, name, strlen(name) + 1);
+
+    return offset;
+}
+
+static gint compare_records(gconstpointer a, gconstpointer b)
+{
+    return ((const DeviceRecord*)a)->id - ((const DeviceRecord*)b)->id;
+}
+
+/**
+ * Replace the contents of list with the devices, as returned by
+ * XIQueryDevice() for XIAllDevices.
+ */
+void device_list_fill(DeviceList *list, XIDeviceInfo *devices, int ndevices)
+{
+    DeviceRecord *rec;
+    gboolean sorted = TRUE;
+    int i;
+
+    device_list_clear(list);
+    g_array_set_size(list->records, ndevices);
+
+    for (i = 0; i < ndevices; i++)
+    {
+        rec = &g_array_index(list->records, DeviceRecord, i);
+        rec->id = devices[i].deviceid;
+        rec->use = devices[i].use;
+        rec->attachment = devices[i].attachment;
+        rec->name = add_name(list, devices[i].name);
+
+        if (i > 0 && rec[-1].id > rec->id)
+            sorted = FALSE;
+    }
+
+    /* the server sends them by id, don't count on it though */
+    if (!sorted)
+        g_array_sort(list->records, compare_records);
+}
+
+/**
+ * Index of the record for id, or of where it would go if there's none.
+ */
+static guint bisect(const DeviceList *list, int id)
+{
+    const DeviceRecord *recs = (const DeviceRecord*)list->records->data;
+    guint lo = 0, hi = list->records->len;
+
+    while (lo < hi)
+    {
+        guint mid = lo + (hi - lo) / 2;
+
+        if (recs[mid].id < id)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+/**
+ * The record for id, or NULL if there's none.
+ */
+const DeviceRecord* device_list_find(const DeviceList *list, int id)
+{
+    guint i = bisect(list, id);
+
+    if (i < list->records->len &&
+        g_array_index(list->records, DeviceRecord, i).id == id)
+        return &g_array_index(list->records, DeviceRecord, i);
+
+    return NULL;
+}
+
+/**
+ * Add or update the record for id. If name is NULL, an existing record
+ * keeps its name. Renames grow the arena until the next
+ * device_list_fill().
+ */
+void device_list_set(DeviceList *list, int id, const char *name,
+                     int use, int attachment)
+{
+    DeviceRecord *rec;
+    guint i = bisect(list, id);
+
+    if (i >= list->records->len ||
+        g_array_index(list->records, DeviceRecord, i).id != id)
+    {
+        DeviceRecord new_rec = { id, use, attachment, 0 };
+
+        if (!name)
+            return;
+
+        new_rec.name = add_name(list, name);
+        g_array_insert_val(list->records, i, new_rec);
+        return;
+    }
+
+    rec = &g_array_index(list->records, DeviceRecord, i);
+    rec->use = use;
+    rec->attachment = attachment;
+    if (name && strcmp(device_list_name(list, rec), name) != 0)
+        rec->name = add_name(list, name);
+}
+
+void device_list_remove(DeviceList *list, int id)
+{
+    guint i = bisect(list, id);
+
+    if (i < list->records->len &&
+        g_array_index(list->records, DeviceRecord, i).id == id)
+        g_array_remove_index(list->records, i);
+}
+
+static gboolean record_is_master(const DeviceRecord *rec)
+{
+    return rec->use == XIMasterPointer || rec->use == XIMasterKeyboard;
+}
+
+static void add_edit(GArray *edits, int type, int id, guint index)
+{
+    DeviceEdit edit = { type, id, index };
+
+    g_array_append_val(edits, edit);
+}
+
+/* The stages of a diff, in the order their edits are applied: MDs have to
+ * be there before SDs go below them, and SDs have to be out of the way
+ * before their MD is removed. */
+enum {
+    STAGE_MASTERS,
+    STAGE_SLAVES,
+    STAGE_REMOVE_SLAVES,
+    STAGE_REMOVE_MASTERS,
+    NUM_STAGES
+};
+
+static void diff_stage(const DeviceList *from, const DeviceList *to,
+                       GArray *edits, int stage)
+{
+    const DeviceRecord *a = (const DeviceRecord*)from->records->data;
+    const DeviceRecord *b = (const DeviceRecord*)to->records->data;
+    guint i = 0, j = 0, na = from->records->len, nb = to->records->len;
+
+    while (i < na || j < nb)
+    {
+        if (j >= nb || (i < na && a[i].id < b[j].id))
+        {
+            /* only in from */
+            if (stage == (record_is_master(&a[i]) ? STAGE_REMOVE_MASTERS :
+                                                    STAGE_REMOVE_SLAVES))
+                add_edit(edits, EDIT_REMOVE, a[i].id, i);
+            i++;
+            continue;
+        }
+
+        if (stage == (record_is_master(&b[j]) ? STAGE_MASTERS : STAGE_SLAVES))
+        {
+            if (i >= na || a[i].id != b[j].id)
+                add_edit(edits, EDIT_INSERT, b[j].id, j);
+            else
+            {
+                if (a[i].use != b[j].use || a[i].attachment != b[j].attachment)
+                    add_edit(edits, EDIT_MOVE, b[j].id, j);
+                if (strcmp(device_list_name(from, &a[i]),
+                           device_list_name(to, &b[j])) != 0)
+                    add_edit(edits, EDIT_RENAME, b[j].id, j);
+            }
+        }
+
+        if (i < na && a[i].id == b[j].id)
+            i++;
+        j++;
+    }
+}
+
+/**
+ * Append to edits what turns from into to, in an order that can be
+ * applied to the tree as is. Moves and renames of the same device are two
+ * edits. The index of EDIT_REMOVE is into from, all others into to, and
+ * only good as long as the list isn't changed: applying edits that may
+ * change it goes by id.
+ */
+void device_list_diff(const DeviceList *from, const DeviceList *to,
+                      GArray *edits)
+{
+    int stage;
+
+    for (stage = 0; stage < NUM_STAGES; stage++)
+        diff_stage(from, to, edits, stage);
+}
@@ -0,0 +1,101 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.  You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* What only the GUI build has: the tree store, the view and what keeps
+ * them up to date. The core in idm.h doesn't need GTK. */
+
+#ifndef GUI_H
+#define GUI_H
+
+#include <gtk/gtk.h>
+#include "idm.h"
+
+/* References used in the tree model to store data.
+   Each enum references the column the device is being stored at. */
+enum {
+    COL_ID = 0, /* device id, int*/
+    COL_NAME,   /* device name, interned, see row_name() */
+    COL_USE,    /* use field as of XListInputDevices */
+    COL_ICON,   /* icon */
+    COL_RATE,   /* events per second with --monitor, uint */
+    NUM_COLS
+};
+
+/* What the I/O worker queried, handed to the main thread as is. Either all
+ * devices, or the devices in ids. props has one entry per device, in the
+ * same order. */
+typedef struct {
+    gboolean       all;
+    XIDeviceInfo  *devices;     /* all: ndevices of them */
+    int            ndevices;
+    int           *ids;         /* !all: n ids */
+    XIDeviceInfo **infos;       /* !all: n, NULL for gone devices */
+    int            n;
+    DeviceProps   *props;
+    guint          events;      /* gds->events when it was asked for */
+} DeviceSnapshot;
+
+typedef struct _ViewState ViewState;
+
+/* model.c: the tree store of devices */
+void clear_icons(GDeviceSetup *gds);
+GdkPixbuf* get_icon(GDeviceSetup *gds, int what);
+int icon_for_use(int use);
+const gchar* row_name(GtkTreeModel *model, GtkTreeIter *iter);
+gboolean lookup_row(GDeviceSetup *gds, GtkTreeModel *model,
+                    int id, GtkTreeIter *iter);
+void index_row(GDeviceSetup *gds, GtkTreeModel *model,
+               int id, GtkTreeIter *iter);
+gboolean update_row(GDeviceSetup *gds, GtkTreeStore *treestore,
+                    int id, const char *name, int use, int attachment);
+void rename_row(GDeviceSetup *gds, GtkTreeStore *treestore, int id,
+                const char *name);
+void remove_row(GDeviceSetup *gds, GtkTreeStore *treestore, int id);
+GtkTreeStore* tree_store_new(GDeviceSetup *gds);
+void rows_free(GDeviceSetup *gds);
+void reconcile_devices(GDeviceSetup *gds, GtkTreeStore *treestore,
+                       XIDeviceInfo *devices, int ndevices);
+gboolean update_devices(GDeviceSetup *gds, GtkTreeStore *treestore,
+                        XIDeviceInfo **infos, int n);
+void expand_master(GDeviceSetup *gds, GtkTreeModel *model, GtkTreeIter *iter);
+void expand_masters(GDeviceSetup *gds);
+ViewState* view_freeze(GDeviceSetup *gds);
+void view_thaw(GDeviceSetup *gds, ViewState *state);
+void view_attach(GDeviceSetup *gds);
+void view_refilter(GDeviceSetup *gds);
+void view_search(GDeviceSetup *gds, const char *text);
+
+/* refresh.c: keeping the tree store in line with the server */
+void refresh_init(GDeviceSetup *gds);
+GtkTreeStore* query_devices(GDeviceSetup *gds);
+void apply_snapshot(GDeviceSetup *gds, DeviceSnapshot *snap);
+Display* dpy_init_shared(GdkDisplay *display, int *xi_opcode);
+GdkFilterReturn xi_event_filter(GdkXEvent *xevent, GdkEvent *event,
+                                gpointer data);
+
+/* monitor.c: --monitor, raw event rates per device */
+Monitor* monitor_new(GDeviceSetup *gds);
+void monitor_free(Monitor *monitor);
+void monitor_event(Monitor *monitor, XIRawEvent *ev);
+guint monitor_rate(Monitor *monitor, int id);
+
+/* worker.c: device queries on a thread and connection of their own */
+Worker* worker_new(GDeviceSetup *gds);
+void worker_free(Worker *worker);
+void worker_query_all(Worker *worker);
+void worker_query_ids(Worker *worker, const int *ids, int n);
+void worker_invalidate(Worker *worker, int id);
+void snapshot_free(DeviceSnapshot *snap);
+
+#endif
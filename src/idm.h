@@ -0,0 +1,343 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.  You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef IDM_H
+#define IDM_H
+
+#include <X11/Xlib.h>
+#include <X11/extensions/XInput2.h>
+#include <glib.h>
+
+enum {
+    ICON_MOUSE,
+    ICON_KEYBOARD,
+    ICON_FLOATING,
+    NUM_ICONS
+};
+
+#define ID_FLOATING -1
+
+/* profile group and rule master for floating SDs */
+#define PROFILE_FLOATING "Floating"
+
+/* Hierarchy changes collected between hierarchy_begin() and
+ * hierarchy_commit() */
+typedef struct {
+    GArray      *changes;   /* XIAnyHierarchyChangeInfo, in order */
+    GPtrArray   *names;     /* names used by XIAddMaster changes */
+    int          depth;     /* nesting level of hierarchy_begin() */
+} HierarchyBatch;
+
+/* One MD pair for create_masters(), and what to set up for it once the
+ * server has created it */
+typedef struct {
+    const char  *name;
+    gboolean     send_core;
+    gboolean     enable;
+    const char  *cursor;        /* one of cursor_names for the pointer, or
+                                   NULL for the default */
+    Window       client_window; /* gets the pointer as client pointer, or
+                                   None */
+    const int   *slaves;        /* SDs to attach */
+    int          nslaves;
+    int          pointer;       /* set by create_masters(): the new MDs, */
+    int          keyboard;      /* or 0 if the pair wasn't created */
+} MasterSpec;
+
+/* Device classes, as a mask in DeviceEntry */
+enum {
+    CLASS_KEY      = 1 << 0,
+    CLASS_BUTTON   = 1 << 1,
+    CLASS_VALUATOR = 1 << 2,
+    CLASS_SCROLL   = 1 << 3,
+    CLASS_TOUCH    = 1 << 4
+};
+
+/* What we know about a device, kept across refreshes */
+typedef struct {
+    int          id;
+    const gchar *name;          /* interned */
+    int          use;
+    int          attachment;
+    gboolean     enabled;
+    guint        classes;       /* CLASS_* */
+    int          num_valuators;
+    gboolean     have_props;    /* properties below are fetched */
+    gboolean     have_product;  /* vendor and product are set */
+    guint        vendor;        /* "Device Product ID" */
+    guint        product;
+    gchar       *node;          /* "Device Node", or NULL */
+} DeviceEntry;
+
+/* Device properties we keep, as fetched by the I/O worker */
+typedef struct {
+    gboolean     have_product;  /* vendor and product are set */
+    guint        vendor;        /* "Device Product ID" */
+    guint        product;
+    gchar       *node;          /* "Device Node", or NULL */
+} DeviceProps;
+
+/* One device in a DeviceList */
+typedef struct {
+    int          id;
+    int          use;
+    int          attachment;
+    guint        name;          /* offset into the list's names */
+} DeviceRecord;
+
+/* Devices as a flat array sorted by id, names in one arena */
+typedef struct {
+    GArray      *records;       /* DeviceRecord */
+    GString     *names;         /* 0-terminated names, back to back */
+} DeviceList;
+
+enum {
+    EDIT_INSERT,    /* new device */
+    EDIT_MOVE,      /* use or attachment changed */
+    EDIT_REMOVE,    /* device is gone */
+    EDIT_RENAME     /* same id, different name */
+};
+
+/* One change between two DeviceLists, see device_list_diff() */
+typedef struct {
+    int          type;          /* EDIT_* */
+    int          id;
+    guint        index;         /* of the record */
+} DeviceEdit;
+
+typedef struct _GDeviceSetup GDeviceSetup;
+typedef struct _Monitor Monitor;
+typedef struct _Worker Worker;
+typedef struct _Journal Journal;
+typedef struct _JournalStep JournalStep;
+
+/* Called once the changes of hierarchy_commit_async() are through */
+typedef void (*HierarchyDoneFunc)(GDeviceSetup *gds, gboolean success,
+                                  gpointer data);
+
+/* Called after each XI_HierarchyChanged event has been applied */
+typedef void (*HierarchyChangedFunc)(GDeviceSetup *gds, gpointer data);
+
+/* Called when undo or redo become possible or impossible */
+typedef void (*JournalChangedFunc)(GDeviceSetup *gds, gpointer data);
+
+/* What the GUI does with the events on top of the cache, see refresh.c */
+typedef struct {
+    void (*hierarchy_event)(GDeviceSetup *gds, XIHierarchyEvent *ev);
+    void (*property_event)(GDeviceSetup *gds, int id);
+    void (*raw_event)(GDeviceSetup *gds, XIRawEvent *ev);
+} ViewFuncs;
+
+/* A compiled auto-attach rule */
+typedef struct {
+    GPatternSpec *glob;     /* device name pattern, or NULL */
+    GRegex       *regex;    /* device name regex, or NULL */
+    guint         vendor;   /* "Device Product ID", or 0 for any */
+    guint         product;
+    int           use;      /* XISlavePointer, XISlaveKeyboard or 0 for any */
+    gchar        *master;   /* MD pair to attach to, or "Floating" */
+} AttachRule;
+
+/* A seat-switch preset */
+typedef struct {
+    gchar        *name;
+    GPtrArray    *patterns; /* GPatternSpec for SD names */
+    GArray       *ids;      /* SD ids, int */
+    gchar        *master;   /* MD pair name or id, or "Floating" */
+    guint         keysym;   /* hotkey, or 0 */
+    guint         mods;     /* X modifier mask of the hotkey */
+    KeyCode       keycode;  /* grabbed, or 0 */
+    GArray       *changes;  /* XIAnyHierarchyChangeInfo, reused */
+} Preset;
+
+/* The GTK and GDK types are only complete with gui.h, the core only
+ * passes them around. */
+struct _GDeviceSetup {
+    Display     *dpy;       /* Display connection (in addition to GTK) */
+    struct _GdkDisplay *display;
+    const ViewFuncs *view;  /* the GUI's event handling, or NULL */
+    struct _GtkTreeView *treeview;  /* the main view */
+    struct _GtkTreeStore *store;    /* the rows, the view shows them through
+                                       a filter */
+    gchar       *search;    /* casefolded search text, or NULL */
+    struct _GtkWidget *window;
+    struct _GtkTreePath *press_path; /* row a press kept the selection for */
+    GHashTable  *rows;      /* device id -> GtkTreeIter in store */
+    GStringChunk *names;    /* device names, see intern_name() */
+    GHashTable  *interned;  /* the strings in names */
+    GHashTable  *folded;    /* interned name -> casefolded copy in names */
+    DeviceList  *shown;     /* the devices in the tree store */
+    DeviceList  *next;      /* reused by reconcile_devices() */
+    GArray      *edits;     /* DeviceEdit, likewise */
+    guint        refresh_source; /* pending refresh, 0 if none */
+    gint         refresh_delay;  /* ms to coalesce changes for */
+    gint64       fill_start;     /* startup-fill runs from here until the
+                                    tree is first filled, or 0 */
+    gboolean     dirty_all;      /* next refresh re-queries all devices */
+    GHashTable  *dirty;          /* device ids the next refresh re-queries */
+    GHashTable  *collapsed;      /* MD ids the user collapsed, or NULL */
+    int          xi_opcode;      /* XI major opcode on dpy */
+    GSource     *event_source;   /* dispatches events on dpy */
+    HierarchyBatch *batch;       /* changes not submitted yet, or NULL */
+    HierarchyChangedFunc hierarchy_changed; /* or NULL */
+    gpointer     hierarchy_changed_data;
+    GArray      *rules;          /* AttachRule, or NULL */
+    GArray      *presets;        /* Preset, or NULL */
+    GHashTable  *devices;        /* device id -> DeviceEntry */
+    Atom         product_id_atom;
+    Atom         device_node_atom;
+    gboolean     icons_loaded;
+    struct _GdkPixbuf *icons[NUM_ICONS]; /* cached, until the icon theme
+                                            changes */
+    Monitor     *monitor;        /* --monitor, or NULL */
+    Worker      *worker;         /* queries off the main thread, or NULL */
+    Journal     *journal;        /* applied changes for undo, or NULL */
+    guint        events;         /* XI_HierarchyChanged events handled */
+    Window       sync_window;    /* for hierarchy_commit_async() */
+    Atom         sync_atom;
+};
+
+/* State while parsing the command line */
+typedef struct {
+    GDeviceSetup *gds;
+    int           attach_id;    /* --attach without --to yet, or 0 */
+    gchar        *apply_profile; /* --apply-profile, or NULL */
+    gchar        *save_profile;  /* --save-profile, or NULL */
+    gchar        *rules;         /* --rules, or NULL */
+    gboolean      shared;        /* --shared-connection */
+    gboolean      stats;         /* --stats */
+    gchar        *stats_json;    /* --stats-json, or NULL */
+    gboolean      daemon;        /* --daemon */
+    gboolean      monitor;       /* --monitor */
+    gchar        *presets;       /* --presets, or NULL */
+    gchar        *preset;        /* --preset, or NULL */
+    gchar        *journal;       /* --journal, or NULL */
+    gchar        *replay;        /* --replay, or NULL */
+    gchar        *displays;      /* --displays, or NULL */
+    gchar       **names;         /* --displays split up, or NULL */
+} CmdlineData;
+
+/* devlist.c: compact device lists and their diff */
+DeviceList* device_list_new(void);
+void device_list_free(DeviceList *list);
+void device_list_clear(DeviceList *list);
+void device_list_fill(DeviceList *list, XIDeviceInfo *devices, int ndevices);
+const DeviceRecord* device_list_find(const DeviceList *list, int id);
+const char* device_list_name(const DeviceList *list, const DeviceRecord *rec);
+void device_list_set(DeviceList *list, int id, const char *name,
+                     int use, int attachment);
+void device_list_remove(DeviceList *list, int id);
+void device_list_diff(const DeviceList *from, const DeviceList *to,
+                      GArray *edits);
+
+/* xi.c: talking to the X server */
+extern const char *const cursor_names[];
+Display* dpy_init(int *xi_opcode);
+Display* dpy_init_display(const char *name, int *xi_opcode);
+Display* dpy_init_existing(Display *dpy, int *xi_opcode);
+Display* dpy_open_query(const char *name);
+void free_device_info(XIDeviceInfo *info);
+XIDeviceInfo* query_device_info(Display *dpy, int deviceid, int *ndevices);
+void query_devices_by_id(Display *dpy, const int *ids, int n,
+                         XIDeviceInfo **infos);
+void get_product_ids(Display *dpy, Atom atom, const int *ids, int n,
+                     guint *vendors, guint *products, gboolean *have);
+void get_device_nodes(Display *dpy, Atom atom, const int *ids, int n,
+                      gchar **nodes);
+void select_raw_events(Display *dpy, gboolean on);
+void error_trap_push(Display *dpy);
+int error_trap_pop(Display *dpy);
+void hierarchy_begin(GDeviceSetup *gds);
+void hierarchy_abort(GDeviceSetup *gds);
+void hierarchy_queue(GDeviceSetup *gds, const XIAnyHierarchyChangeInfo *c,
+                     int n);
+int hierarchy_pending(GDeviceSetup *gds);
+gboolean hierarchy_commit(GDeviceSetup *gds);
+void hierarchy_commit_async(GDeviceSetup *gds, HierarchyDoneFunc done,
+                            gpointer data);
+void hierarchy_async_flush(GDeviceSetup *gds);
+gboolean change_attachment(GDeviceSetup *gds, int id, int id_to);
+gboolean float_device(GDeviceSetup *gds, int id);
+gboolean remove_master(GDeviceSetup *gds, int id);
+gboolean create_master(GDeviceSetup *gds, const char* name);
+gboolean create_masters(GDeviceSetup *gds, MasterSpec *specs, int n);
+gboolean xi_filter_event(GDeviceSetup *gds, XEvent *ev);
+GSource* x_event_source_new(GDeviceSetup *gds);
+
+/* cache.c: what we know about each device, kept across refreshes */
+void cache_init(GDeviceSetup *gds);
+void cache_free(GDeviceSetup *gds);
+DeviceEntry* cache_lookup(GDeviceSetup *gds, int id);
+void cache_update_all(GDeviceSetup *gds, XIDeviceInfo *devices, int ndevices,
+                      const DeviceProps *props);
+void cache_update_devices(GDeviceSetup *gds, XIDeviceInfo **infos, int n,
+                          const DeviceProps *props);
+void cache_hierarchy_info(GDeviceSetup *gds, XIHierarchyInfo *info);
+gboolean cache_invalidate(GDeviceSetup *gds, int id);
+int cache_find_master(GDeviceSetup *gds, const char *name);
+gboolean cache_entry_is_keyboard(const DeviceEntry *entry);
+gboolean is_keyboard_slave(XIDeviceInfo *dev);
+void cache_remove(GDeviceSetup *gds, int id);
+const gchar* intern_name(GDeviceSetup *gds, const char *name);
+void names_free(GDeviceSetup *gds);
+
+/* cmdline.c: the command line, and what runs without a window */
+gboolean cmdline_parse(CmdlineData *cmdline, int *argc, char ***argv,
+                       gboolean gui);
+int cmdline_run(GDeviceSetup *gds, CmdlineData *cmdline);
+void cmdline_free(CmdlineData *cmdline);
+gboolean load_rules(GDeviceSetup *gds, gchar *path);
+gboolean load_presets(GDeviceSetup *gds, gchar *path);
+
+/* daemon.c: --daemon, the D-Bus service */
+int daemon_run(GDeviceSetup *gds);
+
+/* profile.c: device layouts saved to key files */
+gchar* master_pair_name(const char *name);
+gboolean is_xtest_device(const char *name);
+gboolean profile_save_tree(GDeviceSetup *gds, const char *path,
+                           GError **error);
+gboolean profile_save_devices(GDeviceSetup *gds, const char *path,
+                              GError **error);
+gboolean profile_apply(GDeviceSetup *gds, const char *path, GError **error);
+
+/* rules.c: auto-attach rules for new SDs */
+gboolean rules_load(GDeviceSetup *gds, const char *path, GError **error);
+void rules_apply(GDeviceSetup *gds, GArray *ids);
+
+/* presets.c: seat-switch presets and their hotkeys */
+gboolean presets_load(GDeviceSetup *gds, const char *path, GError **error);
+void presets_grab_keys(GDeviceSetup *gds);
+void presets_free(GDeviceSetup *gds);
+gboolean preset_apply(GDeviceSetup *gds, const char *name, gboolean wait,
+                      GError **error);
+gboolean presets_key_press(GDeviceSetup *gds, XKeyEvent *ev);
+
+/* journal.c: undo, redo and replay of hierarchy changes */
+Journal* journal_new(const char *path, JournalChangedFunc changed,
+                     gpointer data);
+void journal_close(GDeviceSetup *gds);
+JournalStep* journal_prepare(GDeviceSetup *gds,
+                             const XIAnyHierarchyChangeInfo *c, int n);
+JournalStep* journal_prepare_masters(GDeviceSetup *gds,
+                                     const MasterSpec *specs, int n);
+void journal_commit(GDeviceSetup *gds, JournalStep *step, gboolean success);
+gboolean journal_can_undo(Journal *journal);
+gboolean journal_can_redo(Journal *journal);
+gboolean journal_undo(GDeviceSetup *gds, gboolean wait);
+gboolean journal_redo(GDeviceSetup *gds, gboolean wait);
+gboolean journal_save(GDeviceSetup *gds, const char *path, GError **error);
+gboolean journal_replay(GDeviceSetup *gds, const char *path, GError **error);
+
+#endif
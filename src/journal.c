@@ -0,0 +1,870 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.  You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* The journal of hierarchy changes. Every batch the server applied is one
+ * step, kept with what reverts it, in a ring of the last JOURNAL_STEPS
+ * steps. The reverting operations are worked out from the cache before a
+ * batch is sent, so undo and redo never ask the server what's where.
+ * Operations name their devices, with the id they had only as a hint, so
+ * a journal saved on one display can be replayed on another. */
+
+#include <X11/Xlib.h>
+#include <X11/extensions/XInput2.h>
+#include <glib.h>
+#include <string.h>
+#include "idm.h"
+
+#define JOURNAL_STEPS 256
+
+#define JOURNAL_GROUP "Step %u"
+
+typedef enum {
+    OP_ATTACH,
+    OP_FLOAT,
+    OP_CREATE,
+    OP_REMOVE
+} OpType;
+
+static const char *const op_names[] = { "attach", "float", "create", "remove" };
+
+typedef struct {
+    OpType       type;
+    int          id;        /* of the device when recorded, or 0 */
+    const gchar *name;      /* interned: the SD, or the MD pair for create
+                               and remove */
+    const gchar *master;    /* interned: OP_ATTACH only, the MD */
+} JournalOp;
+
+struct _JournalStep {
+    GArray *ops;            /* JournalOp, as applied */
+    GArray *undo;           /* JournalOp, what reverts ops, in order */
+};
+
+struct _Journal {
+    JournalStep **steps;    /* ring of JOURNAL_STEPS */
+    guint         first;    /* index of the oldest step */
+    guint         len;      /* steps in the ring */
+    guint         pos;      /* steps in effect, the rest can be redone */
+    gboolean      busy;     /* undoing or redoing, don't record */
+    gchar        *path;     /* saved to by journal_close(), or NULL */
+    JournalChangedFunc changed;
+    gpointer      data;
+};
+
+#define step_at(journal, i) \
+    ((journal)->steps[((journal)->first + (i)) % JOURNAL_STEPS])
+
+static JournalStep* step_new(void)
+{
+    JournalStep *step = g_new(JournalStep, 1);
+
+    step->ops = g_array_new(FALSE, FALSE, sizeof(JournalOp));
+    step->undo = g_array_new(FALSE, FALSE, sizeof(JournalOp));
+
+    return step;
+}
+
+static void step_free(JournalStep *step)
+{
+    if (!step)
+        return;
+
+    g_array_unref(step->ops);
+    g_array_unref(step->undo);
+    g_free(step);
+}
+
+/**
+ * A journal for gds->journal. If path is set, journal_close() saves it
+ * there. changed, if not NULL, is called whenever journal_can_undo() or
+ * journal_can_redo() may have changed.
+ */
+Journal* journal_new(const char *path, JournalChangedFunc changed,
+                     gpointer data)
+{
+    Journal *journal = g_new0(Journal, 1);
+
+    journal->steps = g_new0(JournalStep*, JOURNAL_STEPS);
+    journal->path = g_strdup(path);
+    journal->changed = changed;
+    journal->data = data;
+
+    return journal;
+}
+
+/**
+ * Save gds->journal to its file, if it has one, and free it. The journal
+ * refers to interned names, so this goes before names_free().
+ */
+void journal_close(GDeviceSetup *gds)
+{
+    Journal *journal = gds->journal;
+    GError *error = NULL;
+    guint i;
+
+    if (!journal)
+        return;
+
+    if (journal->path && !journal_save(gds, journal->path, &error))
+    {
+        g_printerr("ERROR: %s: %s\n", journal->path, error->message);
+        g_error_free(error);
+    }
+
+    for (i = 0; i < journal->len; i++)
+        step_free(step_at(journal, i));
+    g_free(journal->steps);
+    g_free(journal->path);
+    g_free(journal);
+    gds->journal = NULL;
+}
+
+static void add_op(GArray *ops, OpType type, int id, const gchar *name,
+                   const gchar *master)
+{
+    JournalOp op = { type, id, name, master };
+
+    g_array_append_val(ops, op);
+}
+
+/**
+ * The MD id is attached to as far as the changes before tell, 0 if it's
+ * floating, -1 if it's not known.
+ */
+static int current_master(GDeviceSetup *gds, GHashTable *moved, int id)
+{
+    DeviceEntry *entry;
+    gpointer master;
+
+    if (g_hash_table_lookup_extended(moved, GINT_TO_POINTER(id), NULL,
+                                     &master))
+        return GPOINTER_TO_INT(master);
+
+    entry = cache_lookup(gds, id);
+    if (!entry)
+        return -1;
+
+    return entry->use == XIFloatingSlave ? 0 : entry->attachment;
+}
+
+/**
+ * Add to undo what puts SD entry back to MD master, 0 for floating.
+ */
+static void revert_slave(GDeviceSetup *gds, GArray *undo, DeviceEntry *entry,
+                         int master)
+{
+    DeviceEntry *md;
+
+    if (master == 0)
+    {
+        add_op(undo, OP_FLOAT, entry->id, entry->name, NULL);
+        return;
+    }
+
+    md = cache_lookup(gds, master);
+    if (md)
+        add_op(undo, OP_ATTACH, entry->id, entry->name, md->name);
+}
+
+/**
+ * Record a XIRemoveMaster. Undoing it means creating the pair again and
+ * bringing back its SDs.
+ */
+static void prepare_remove(GDeviceSetup *gds, GHashTable *moved,
+                           const XIRemoveMasterInfo *c, JournalStep *step,
+                           GArray *undo)
+{
+    DeviceEntry *md = cache_lookup(gds, c->deviceid), *entry;
+    GHashTableIter it;
+    gchar *pair;
+    const gchar *name;
+
+    if (!md || (md->use != XIMasterPointer && md->use != XIMasterKeyboard))
+        return;
+
+    pair = master_pair_name(md->name);
+    name = intern_name(gds, pair);
+    g_free(pair);
+
+    add_op(step->ops, OP_REMOVE, md->id, name, NULL);
+    add_op(undo, OP_CREATE, 0, name, NULL);
+
+    g_hash_table_iter_init(&it, gds->devices);
+    while (g_hash_table_iter_next(&it, NULL, (gpointer*)&entry))
+    {
+        int master, to;
+
+        if (entry->use != XISlavePointer && entry->use != XISlaveKeyboard &&
+            entry->use != XIFloatingSlave)
+            continue;
+
+        master = current_master(gds, moved, entry->id);
+        if (master <= 0 || (master != md->id && master != md->attachment) ||
+            is_xtest_device(entry->name))
+            continue;
+
+        revert_slave(gds, undo, entry, master);
+
+        /* where the server puts it, keyboards to the keyboard */
+        if (c->return_mode == XIFloating)
+            to = 0;
+        else if (cache_lookup(gds, master)->use == XIMasterKeyboard)
+            to = c->return_keyboard;
+        else
+            to = c->return_pointer;
+        g_hash_table_insert(moved, GINT_TO_POINTER(entry->id),
+                            GINT_TO_POINTER(to));
+    }
+}
+
+/**
+ * Work out the step for n changes about to be sent, and what reverts
+ * them. Returns NULL if there's no journal, or nothing to record.
+ */
+JournalStep* journal_prepare(GDeviceSetup *gds,
+                             const XIAnyHierarchyChangeInfo *c, int n)
+{
+    JournalStep *step;
+    GHashTable *moved; /* SD id -> MD id as of the changes so far */
+    GArray *undo;
+    int i;
+
+    if (!gds->journal || gds->journal->busy || n == 0)
+        return NULL;
+
+    step = step_new();
+    moved = g_hash_table_new(g_direct_hash, g_direct_equal);
+    undo = g_array_new(FALSE, FALSE, sizeof(JournalOp));
+
+    for (i = 0; i < n; i++)
+    {
+        DeviceEntry *entry, *md;
+        int master;
+
+        g_array_set_size(undo, 0);
+
+        switch(c[i].type)
+        {
+            case XIAttachSlave:
+                entry = cache_lookup(gds, c[i].attach.deviceid);
+                md = cache_lookup(gds, c[i].attach.new_master);
+                master = current_master(gds, moved, c[i].attach.deviceid);
+                if (!entry || !md || master < 0 ||
+                    master == c[i].attach.new_master)
+                    break;
+
+                add_op(step->ops, OP_ATTACH, entry->id, entry->name, md->name);
+                revert_slave(gds, undo, entry, master);
+                g_hash_table_insert(moved, GINT_TO_POINTER(entry->id),
+                                    GINT_TO_POINTER(md->id));
+                break;
+            case XIDetachSlave:
+                entry = cache_lookup(gds, c[i].detach.deviceid);
+                master = current_master(gds, moved, c[i].detach.deviceid);
+                if (!entry || master <= 0)
+                    break;
+
+                add_op(step->ops, OP_FLOAT, entry->id, entry->name, NULL);
+                revert_slave(gds, undo, entry, master);
+                g_hash_table_insert(moved, GINT_TO_POINTER(entry->id),
+                                    GINT_TO_POINTER(0));
+                break;
+            case XIAddMaster:
+                add_op(step->ops, OP_CREATE, 0,
+                       intern_name(gds, c[i].add.name), NULL);
+                add_op(undo, OP_REMOVE, 0, intern_name(gds, c[i].add.name),
+                       NULL);
+                break;
+            case XIRemoveMaster:
+                prepare_remove(gds, moved, &c[i].remove, step, undo);
+                break;
+        }
+
+        /* the last change is the first to revert */
+        g_array_prepend_vals(step->undo, undo->data, undo->len);
+    }
+
+    g_array_unref(undo);
+    g_hash_table_destroy(moved);
+
+    if (step->ops->len == 0)
+    {
+        step_free(step);
+        return NULL;
+    }
+
+    return step;
+}
+
+/**
+ * Work out the step for create_masters(): the pairs, then their SDs.
+ */
+JournalStep* journal_prepare_masters(GDeviceSetup *gds,
+                                     const MasterSpec *specs, int n)
+{
+    JournalStep *step;
+    GArray *undo;
+    int i, k;
+
+    if (!gds->journal || gds->journal->busy || n == 0)
+        return NULL;
+
+    step = step_new();
+    undo = g_array_new(FALSE, FALSE, sizeof(JournalOp));
+
+    for (i = 0; i < n; i++)
+    {
+        const gchar *name = intern_name(gds, specs[i].name);
+        gchar *md;
+
+        g_array_set_size(undo, 0);
+        add_op(step->ops, OP_CREATE, 0, name, NULL);
+
+        for (k = 0; k < specs[i].nslaves; k++)
+        {
+            DeviceEntry *entry = cache_lookup(gds, specs[i].slaves[k]);
+
+            if (!entry ||
+                (entry->use != XISlavePointer &&
+                 entry->use != XISlaveKeyboard && entry->use != XIFloatingSlave))
+                continue;
+
+            md = g_strdup_printf("%s %s", name,
+                                 cache_entry_is_keyboard(entry) ?
+                                 "keyboard" : "pointer");
+            add_op(step->ops, OP_ATTACH, entry->id, entry->name,
+                   intern_name(gds, md));
+            g_free(md);
+            revert_slave(gds, undo,
+                         entry, entry->use == XIFloatingSlave ?
+                                0 : entry->attachment);
+        }
+        add_op(undo, OP_REMOVE, 0, name, NULL);
+
+        g_array_prepend_vals(step->undo, undo->data, undo->len);
+    }
+
+    g_array_unref(undo);
+
+    return step;
+}
+
+static void notify(GDeviceSetup *gds)
+{
+    if (gds->journal->changed)
+        gds->journal->changed(gds, gds->journal->data);
+}
+
+/**
+ * The changes of step were sent. If they went through, step is the
+ * newest in the journal, and what could be redone is gone. If not, it's
+ * dropped: the server stops at the failed change, and the journal only
+ * holds what is clearly in effect.
+ */
+void journal_commit(GDeviceSetup *gds, JournalStep *step, gboolean success)
+{
+    Journal *journal = gds->journal;
+
+    if (!step)
+        return;
+
+    /* gone while the changes were underway */
+    if (!journal || !success)
+    {
+        step_free(step);
+        return;
+    }
+
+    while (journal->len > journal->pos)
+    {
+        journal->len--;
+        step_free(step_at(journal, journal->len));
+        step_at(journal, journal->len) = NULL;
+    }
+
+    if (journal->len == JOURNAL_STEPS)
+    {
+        step_free(step_at(journal, 0));
+        step_at(journal, 0) = NULL;
+        journal->first = (journal->first + 1) % JOURNAL_STEPS;
+        journal->len--;
+    }
+
+    step_at(journal, journal->len) = step;
+    journal->len++;
+    journal->pos = journal->len;
+
+    notify(gds);
+}
+
+gboolean journal_can_undo(Journal *journal)
+{
+    return journal && journal->pos > 0;
+}
+
+gboolean journal_can_redo(Journal *journal)
+{
+    return journal && journal->pos < journal->len;
+}
+
+/**
+ * The SD op is about: the one it was recorded for, if that's still around
+ * under the same name, or else the first SD of that name.
+ */
+static int find_slave(GDeviceSetup *gds, const JournalOp *op)
+{
+    GHashTableIter it;
+    DeviceEntry *entry = cache_lookup(gds, op->id);
+
+    /* both names are interned */
+    if (entry && entry->name == op->name)
+        return entry->id;
+
+    g_hash_table_iter_init(&it, gds->devices);
+    while (g_hash_table_iter_next(&it, NULL, (gpointer*)&entry))
+        if ((entry->use == XISlavePointer || entry->use == XISlaveKeyboard ||
+             entry->use == XIFloatingSlave) && entry->name == op->name)
+            return entry->id;
+
+    return 0;
+}
+
+/* ops on their way out, see run_ops() */
+typedef struct {
+    GDeviceSetup *gds;
+    gboolean      wait;
+    GArray       *changes;  /* XIAnyHierarchyChangeInfo not sent yet */
+    GArray       *specs;    /* MasterSpec of the pairs not created yet */
+    GArray       *slaves;   /* GArray* of SD ids, one per spec */
+    GArray       *created;  /* MasterSpec of the pairs created, with ids */
+    gboolean      ret;
+} OpRun;
+
+/**
+ * Index of the pair to be created that MD name belongs to, or -1.
+ */
+static int find_spec(GArray *specs, const char *name)
+{
+    gchar *pair = master_pair_name(name);
+    guint i;
+
+    for (i = 0; i < specs->len; i++)
+    {
+        const MasterSpec *spec = &g_array_index(specs, MasterSpec, i);
+
+        if (spec->name && strcmp(spec->name, pair) == 0)
+            break;
+    }
+    g_free(pair);
+
+    return i < specs->len ? (int)i : -1;
+}
+
+/**
+ * The id of MD name. Pairs created by this run aren't in the cache yet,
+ * so these are looked at first, newest first.
+ */
+static int find_master(OpRun *run, const char *name)
+{
+    gchar *pair = master_pair_name(name);
+    const MasterSpec *spec;
+    int i, id = 0;
+
+    for (i = (int)run->created->len - 1; i >= 0 && !id; i--)
+    {
+        spec = &g_array_index(run->created, MasterSpec, i);
+        if (strcmp(spec->name, pair) != 0)
+            continue;
+        id = g_str_has_suffix(name, " keyboard") ? spec->keyboard :
+                                                   spec->pointer;
+    }
+    g_free(pair);
+
+    return id ? id : cache_find_master(run->gds, name);
+}
+
+/**
+ * Send the changes queued in run, as one batch.
+ */
+static void flush_changes(OpRun *run)
+{
+    GDeviceSetup *gds = run->gds;
+
+    if (run->changes->len == 0)
+        return;
+
+    hierarchy_begin(gds);
+    hierarchy_queue(gds, (XIAnyHierarchyChangeInfo*)run->changes->data,
+                    run->changes->len);
+    if (run->wait)
+        run->ret = hierarchy_commit(gds) && run->ret;
+    else
+        hierarchy_commit_async(gds, NULL, NULL);
+
+    g_array_set_size(run->changes, 0);
+}
+
+/**
+ * Create the pairs queued in run, with their SDs, in one create_masters().
+ */
+static void flush_specs(OpRun *run)
+{
+    guint i;
+
+    /* only the pairs still wanted, with their SDs */
+    for (i = 0; i < run->specs->len; )
+    {
+        MasterSpec *spec = &g_array_index(run->specs, MasterSpec, i);
+        GArray *ids = g_array_index(run->slaves, GArray*, i);
+
+        if (!spec->name)
+        {
+            g_array_unref(ids);
+            g_array_remove_index(run->specs, i);
+            g_array_remove_index(run->slaves, i);
+            continue;
+        }
+        spec->slaves = (const int*)ids->data;
+        spec->nslaves = ids->len;
+        i++;
+    }
+
+    if (run->specs->len > 0)
+        run->ret = create_masters(run->gds, (MasterSpec*)run->specs->data,
+                                  run->specs->len) && run->ret;
+
+    for (i = 0; i < run->specs->len; i++)
+    {
+        MasterSpec *spec = &g_array_index(run->specs, MasterSpec, i);
+
+        spec->slaves = NULL;
+        spec->nslaves = 0;
+        if (spec->pointer)
+            g_array_append_val(run->created, *spec);
+        g_array_unref(g_array_index(run->slaves, GArray*, i));
+    }
+    g_array_set_size(run->specs, 0);
+    g_array_set_size(run->slaves, 0);
+}
+
+/**
+ * Apply n ops, in their order. Devices are found by name in the cache.
+ * Ops go out in as few batches as that order allows: the ordinary ones
+ * until the next pair to create, then the pairs in a row and the SDs that
+ * go to them in one create_masters(). Unless record is set, the changes
+ * don't make it into the journal themselves.
+ * Returns FALSE if anything failed or couldn't be found.
+ */
+static gboolean run_ops(GDeviceSetup *gds, const JournalOp *ops, guint n,
+                        gboolean wait, gboolean record)
+{
+    HierarchyBatch *pending;
+    OpRun run = { gds, wait };
+    guint i;
+
+    run.changes = g_array_new(FALSE, FALSE, sizeof(XIAnyHierarchyChangeInfo));
+    run.specs = g_array_new(FALSE, TRUE, sizeof(MasterSpec));
+    run.slaves = g_array_new(FALSE, FALSE, sizeof(GArray*));
+    run.created = g_array_new(FALSE, TRUE, sizeof(MasterSpec));
+    run.ret = TRUE;
+
+    /* this goes out on its own, apart from anything queued */
+    pending = gds->batch;
+    gds->batch = NULL;
+    gds->journal->busy = !record;
+
+    for (i = 0; i < n; i++)
+    {
+        const JournalOp *op = &ops[i];
+        XIAnyHierarchyChangeInfo c;
+        MasterSpec spec = { 0 };
+        GArray *ids;
+        gchar *md_name;
+        int id = 0, md, k;
+
+        if (op->type == OP_ATTACH || op->type == OP_FLOAT)
+        {
+            id = find_slave(gds, op);
+            if (!id)
+            {
+                g_printerr("ERROR: No device %s!\n", op->name);
+                run.ret = FALSE;
+                continue;
+            }
+        }
+
+        /* SDs that go to a pair still to be created go with it, anything
+         * else has to wait until the pairs are there */
+        k = op->type == OP_ATTACH ? find_spec(run.specs, op->master) :
+            op->type == OP_REMOVE ? find_spec(run.specs, op->name) : -1;
+        if (op->type == OP_CREATE)
+            flush_changes(&run);
+        else if (k < 0)
+            flush_specs(&run);
+
+        switch(op->type)
+        {
+            case OP_ATTACH:
+                if (k >= 0)
+                {
+                    ids = g_array_index(run.slaves, GArray*, k);
+                    g_array_append_val(ids, id);
+                    break;
+                }
+                md = find_master(&run, op->master);
+                if (!md)
+                {
+                    g_printerr("ERROR: No MD %s!\n", op->master);
+                    run.ret = FALSE;
+                    break;
+                }
+                c.attach.type = XIAttachSlave;
+                c.attach.deviceid = id;
+                c.attach.new_master = md;
+                g_array_append_val(run.changes, c);
+                break;
+            case OP_FLOAT:
+                c.detach.type = XIDetachSlave;
+                c.detach.deviceid = id;
+                g_array_append_val(run.changes, c);
+                break;
+            case OP_CREATE:
+                spec.name = op->name;
+                spec.send_core = TRUE;
+                spec.enable = TRUE;
+                ids = g_array_new(FALSE, FALSE, sizeof(int));
+                g_array_append_val(run.specs, spec);
+                g_array_append_val(run.slaves, ids);
+                break;
+            case OP_REMOVE:
+                /* created and removed again, the SDs stay where they are */
+                if (k >= 0)
+                {
+                    g_array_index(run.specs, MasterSpec, k).name = NULL;
+                    break;
+                }
+
+                md_name = g_strdup_printf("%s pointer", op->name);
+                md = find_master(&run, md_name);
+                g_free(md_name);
+                if (!md)
+                {
+                    g_printerr("ERROR: No MD %s!\n", op->name);
+                    run.ret = FALSE;
+                    break;
+                }
+                c.remove.type = XIRemoveMaster;
+                c.remove.deviceid = md;
+                c.remove.return_mode = XIAttachToMaster;
+                c.remove.return_pointer = 2; /* VCP */
+                c.remove.return_keyboard = 3; /* VCK */
+                g_array_append_val(run.changes, c);
+                break;
+        }
+    }
+
+    flush_changes(&run);
+    flush_specs(&run);
+
+    gds->journal->busy = FALSE;
+    gds->batch = pending;
+
+    g_array_unref(run.created);
+    g_array_unref(run.slaves);
+    g_array_unref(run.specs);
+    g_array_unref(run.changes);
+
+    return run.ret;
+}
+
+/**
+ * Revert the newest step in effect. It stays in the journal, for
+ * journal_redo(). If wait is FALSE, only the pairs to create back are
+ * waited for.
+ * Returns FALSE if there's nothing to undo, or not all of it could be.
+ */
+gboolean journal_undo(GDeviceSetup *gds, gboolean wait)
+{
+    Journal *journal = gds->journal;
+    JournalStep *step;
+    gboolean ret;
+
+    if (!journal_can_undo(journal))
+        return FALSE;
+
+    step = step_at(journal, journal->pos - 1);
+    journal->pos--;
+    ret = run_ops(gds, (JournalOp*)step->undo->data, step->undo->len,
+                  wait, FALSE);
+    notify(gds);
+
+    return ret;
+}
+
+/**
+ * Apply the oldest undone step again. wait as for journal_undo().
+ */
+gboolean journal_redo(GDeviceSetup *gds, gboolean wait)
+{
+    Journal *journal = gds->journal;
+    JournalStep *step;
+    gboolean ret;
+
+    if (!journal_can_redo(journal))
+        return FALSE;
+
+    step = step_at(journal, journal->pos);
+    journal->pos++;
+    ret = run_ops(gds, (JournalOp*)step->ops->data, step->ops->len,
+                  wait, FALSE);
+    notify(gds);
+
+    return ret;
+}
+
+/**
+ * Save the steps in effect to path, one group per step with an op per
+ * key, oldest first:
+ *
+ *   [Step 1]
+ *   1=create;Seat 2
+ *   2=attach;Logitech USB Receiver;Seat 2 pointer
+ */
+gboolean journal_save(GDeviceSetup *gds, const char *path, GError **error)
+{
+    Journal *journal = gds->journal;
+    GKeyFile *keyfile;
+    gchar *data;
+    gsize len;
+    guint i, j;
+    gboolean ret;
+
+    keyfile = g_key_file_new();
+    g_key_file_set_comment(keyfile, NULL, NULL,
+                           " input-device-manager journal", NULL);
+
+    for (i = 0; journal && i < journal->pos; i++)
+    {
+        JournalStep *step = step_at(journal, i);
+        gchar *group = g_strdup_printf(JOURNAL_GROUP, i + 1);
+
+        for (j = 0; j < step->ops->len; j++)
+        {
+            const JournalOp *op = &g_array_index(step->ops, JournalOp, j);
+            const gchar *list[] = { op_names[op->type], op->name, op->master };
+            gchar *key = g_strdup_printf("%u", j + 1);
+
+            g_key_file_set_string_list(keyfile, group, key, list,
+                                       op->type == OP_ATTACH ? 3 : 2);
+            g_free(key);
+        }
+        g_free(group);
+    }
+
+    data = g_key_file_to_data(keyfile, &len, NULL);
+    ret = g_file_set_contents(path, data, len, error);
+    g_free(data);
+    g_key_file_free(keyfile);
+
+    return ret;
+}
+
+static gboolean parse_op(GDeviceSetup *gds, gchar **list, gsize n,
+                         JournalOp *op)
+{
+    guint type;
+
+    for (type = 0; type < G_N_ELEMENTS(op_names); type++)
+        if (n > 0 && strcmp(list[0], op_names[type]) == 0)
+            break;
+
+    if (type == G_N_ELEMENTS(op_names) || n != (type == OP_ATTACH ? 3 : 2))
+        return FALSE;
+
+    op->type = type;
+    op->id = 0;
+    op->name = intern_name(gds, list[1]);
+    op->master = type == OP_ATTACH ? intern_name(gds, list[2]) : NULL;
+
+    return TRUE;
+}
+
+/**
+ * Apply all steps saved in path, in their order, with as few batches as
+ * run_ops() can make of them. Devices are found by name, so this works on
+ * other displays too, given the same devices. The cache has to be filled.
+ * The replay is recorded in gds->journal, if there's one.
+ */
+gboolean journal_replay(GDeviceSetup *gds, const char *path, GError **error)
+{
+    GKeyFile *keyfile;
+    GArray *ops;
+    gchar **groups, **keys;
+    Journal *own = NULL;
+    guint i, j;
+    gboolean ret = TRUE;
+
+    keyfile = g_key_file_new();
+    if (!g_key_file_load_from_file(keyfile, path, G_KEY_FILE_NONE, error))
+    {
+        g_key_file_free(keyfile);
+        return FALSE;
+    }
+
+    ops = g_array_new(FALSE, FALSE, sizeof(JournalOp));
+    groups = g_key_file_get_groups(keyfile, NULL);
+    for (i = 0; ret && groups[i]; i++)
+    {
+        keys = g_key_file_get_keys(keyfile, groups[i], NULL, NULL);
+        for (j = 0; ret && keys[j]; j++)
+        {
+            JournalOp op;
+            gchar **list;
+            gsize n;
+
+            list = g_key_file_get_string_list(keyfile, groups[i], keys[j],
+                                              &n, NULL);
+            if (!list || !parse_op(gds, list, n, &op))
+            {
+                g_set_error(error, G_KEY_FILE_ERROR,
+                            G_KEY_FILE_ERROR_INVALID_VALUE,
+                            "[%s] %s: not an operation", groups[i], keys[j]);
+                ret = FALSE;
+            } else
+                g_array_append_val(ops, op);
+            g_strfreev(list);
+        }
+        g_strfreev(keys);
+    }
+    g_strfreev(groups);
+    g_key_file_free(keyfile);
+
+    if (ret)
+    {
+        /* run_ops() wants a journal, if only to not record into it */
+        if (!gds->journal)
+            gds->journal = own = journal_new(NULL, NULL, NULL);
+
+        ret = run_ops(gds, (JournalOp*)ops->data, ops->len, TRUE, TRUE);
+        if (!ret)
+            g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                        "Not all changes of %s could be applied", path);
+
+        if (own)
+            journal_close(gds);
+    }
+    g_array_unref(ops);
+
+    return ret;
+}
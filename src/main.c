@@ -17,210 +17,195 @@
 #include <X11/Xlib.h>
 #include <X11/extensions/XInput2.h>
 #include <gtk/gtk.h>
+#include <gdk/gdkx.h>
 #include <stdlib.h>
+#include <string.h>
+#include "gui.h"
+#include "stats.h"
 
-/* References used in the tree model to store data.
-   Each enum references the column the device is being stored at. */
-enum {
-    COL_ID = 0, /* device id, int*/
-    COL_NAME,   /* device name, string */
-    COL_USE,    /* use field as of XListInputDevices */
-    COL_ICON,   /* icon */
-    COL_GENERATION,  /* increased in every query_devices */
-    NUM_COLS
-};
-
-enum {
-    ICON_MOUSE,
-    ICON_KEYBOARD,
-    ICON_FLOATING
-};
-
-#define ID_FLOATING -1
+/* dialog responses of our own */
+#define RESPONSE_LOAD_PROFILE 1
+#define RESPONSE_SAVE_PROFILE 2
+#define RESPONSE_UNDO         3
+#define RESPONSE_REDO         4
 
-typedef struct {
-    Display     *dpy;       /* Display connection (in addition to GTK) */
-    GdkDisplay *display;
-    GtkTreeView *treeview;  /* the main view */
-    GtkWidget   *window;
-    gint         generation;
+/* default window in ms to collect device changes before refreshing */
+#define REFRESH_DELAY 50
+
+/* for the startup phases of the statistics */
+static gint64 startup_time;
 
-} GDeviceSetup;
+/* the display whose devices are shown, with --displays the current page */
+static GDeviceSetup *shown_gds;
 
 typedef struct {
     GDeviceSetup *gds;
     int device_id;
 } RemoveMasterWrapperData;
 
-/* Forward declarations */
-static GtkTreeStore* query_devices(GDeviceSetup *gds);
-
-/* Xlib */
-static Display* dpy_init()
+void on_help_button()
 {
-    Display           *dpy;
-    int opcode, event, error;
-    int major = 2, minor = 0; /* XInput 2.0 */
+    // Created on first use and kept for the next one
+    static GtkWidget *dialog;
 
-    dpy = XOpenDisplay(NULL);
-    if (!dpy)
+    if (dialog)
     {
-        g_debug("Unable to open display.\n");
-        return NULL;
+        gtk_dialog_run(GTK_DIALOG(dialog));
+        gtk_widget_hide(dialog);
+        return;
     }
 
-    /* XInput Extension available? */
-    if (!XQueryExtension(dpy, "XInputExtension", &opcode, &event, &error))
-      {
-	g_debug("X Input extension not available.\n");
-	return NULL;
-      }
+    // Create a help dialog
+    dialog = gtk_message_dialog_new_with_markup(NULL,
+                                                           GTK_DIALOG_MODAL,
+                                                           GTK_MESSAGE_INFO,
+                                                           GTK_BUTTONS_OK,
+                                                           "The window shows your current input device hierarchy.\n\n"
+                                                           "You can create new <b>logical</b> cursor/keyboard focus pairs with\n"
+                                                           "the 'Create' button (and remove them again with a right click).\n\n"
+                                                           "Once you have several logical cursor/keyboard focus pairs, you can\n"
+                                                           "move your <b>physical</b> input devices between them via drag and drop.\n"
+                                                           "Select several devices with Ctrl or Shift to move them all at once.\n\n"
+                                                           "Uncheck 'Apply changes immediately' to collect several changes\n"
+                                                           "and send them all at once with 'Apply'.\n\n"
+                                                           "'Undo' and 'Redo' (Ctrl+Z, Ctrl+Shift+Z) step back and forth\n"
+                                                           "through the changes made.");
+
+    // Set the title of the dialog
+    gtk_window_set_title(GTK_WINDOW(dialog), "Help");
 
-    /* Which version of XI? */
-    if (XIQueryVersion(dpy, &major, &minor) == BadRequest)
-      {
-	g_debug("XI2 not available. Server supports %d.%d\n", major, minor);
-	return NULL;
-      }
 
-    return dpy;
+    // Run the dialog and wait for a response
+    gtk_dialog_run(GTK_DIALOG(dialog));
+
+    // Hide the dialog when done
+    gtk_widget_hide(dialog);
 }
 
+
 /**
- * Try to reattach id to id_to.
+ * The Apply button is only useful with changes waiting for it. The
+ * buttons are for the display shown.
  */
-static gboolean change_attachment(GDeviceSetup *gds, int id, int id_to)
+static void update_apply_button(GDeviceSetup *gds)
 {
-    XIAttachSlaveInfo att;
+    GtkWidget *apply;
 
-    att.type = XIAttachSlave;
-    att.deviceid = id;
-    att.new_master = id_to;
-
-    gdk_error_trap_push ();
-    XIChangeHierarchy(gds->dpy, (XIAnyHierarchyChangeInfo*)&att, 1);
-    XSync(gds->dpy, False);
-    if(gdk_error_trap_pop())
-      {
-	g_printerr("ERROR: Attaching device %d to %d failed!\n", id, id_to); 
-	return False;
-      }
+    if (gds != shown_gds)
+        return;
 
-    return True;
+    apply = gtk_dialog_get_widget_for_response(GTK_DIALOG(gds->window),
+                                               GTK_RESPONSE_APPLY);
+    if (apply)
+        gtk_widget_set_sensitive(apply, hierarchy_pending(gds) > 0);
 }
 
-
 /**
- * Set a device floating.
+ * Undo and Redo are only useful with something in the journal for them.
  */
-static gboolean float_device(GDeviceSetup *gds, int id)
+static void update_journal_buttons(GDeviceSetup *gds, gpointer data)
 {
-    XIDetachSlaveInfo c;
+    GtkWidget *button;
 
-    c.type = XIDetachSlave;
-    c.deviceid = id;
-    
-    gdk_error_trap_push ();
-    int ret = XIChangeHierarchy(gds->dpy, (XIAnyHierarchyChangeInfo*)&c, 1);
-    XSync(gds->dpy, False);
-    if(gdk_error_trap_pop())
-      {      
-	g_printerr("ERROR: Floating device %d failed!\n", id); 
-	return False;
-      }
+    if (gds != shown_gds)
+        return;
 
-    return True;
+    button = gtk_dialog_get_widget_for_response(GTK_DIALOG(gds->window),
+                                                RESPONSE_UNDO);
+    if (button)
+        gtk_widget_set_sensitive(button, journal_can_undo(gds->journal));
+    button = gtk_dialog_get_widget_for_response(GTK_DIALOG(gds->window),
+                                                RESPONSE_REDO);
+    if (button)
+        gtk_widget_set_sensitive(button, journal_can_redo(gds->journal));
 }
 
-
 /**
- * Remove a master device from the display. All SDs attached to dev will be
- * attached to VCP and VCK.
- * Effective immediately.
+ * "Apply changes immediately" toggled. If unset, changes are collected
+ * until the Apply button is clicked. Goes for all displays, data is the
+ * NULL-terminated list of them.
  */
-static gboolean remove_master(GDeviceSetup *gds, int id)
+static void signal_immediate_toggled(GtkToggleButton *button,
+                                     gpointer data)
 {
-    XIRemoveMasterInfo remove;
+    GDeviceSetup **setups = (GDeviceSetup**)data;
+    int i;
 
-    remove.type = XIRemoveMaster;
-    remove.deviceid = id;
-    remove.return_mode = XIAttachToMaster;
-    remove.return_pointer = 2; /* VCP */
-    remove.return_keyboard = 3; /* VCK */
-
-    gdk_error_trap_push ();
-    XIChangeHierarchy(gds->dpy, (XIAnyHierarchyChangeInfo*)&remove, 1);
-    XSync(gds->dpy, False);
-    if(gdk_error_trap_pop())
-      return False;
+    for (i = 0; setups[i]; i++)
+    {
+        if (gtk_toggle_button_get_active(button))
+            hierarchy_commit_async(setups[i], NULL, NULL);
+        else
+            hierarchy_begin(setups[i]);
 
-    return True;
+        update_apply_button(setups[i]);
+    }
 }
 
 /**
- * Create a master device with the given name on the display. Applied
- * immediately.
+ * Another display's page is shown, the buttons are for it now.
  */
-static gboolean create_master(GDeviceSetup *gds, const char* name)
+static void signal_switch_page(GtkNotebook *notebook, GtkWidget *page,
+                               guint num, gpointer data)
 {
-    XIAddMasterInfo cr;
-
-    cr.type = XIAddMaster;
-    cr.name = (char*)name;
-    cr.send_core = TRUE;
-    cr.enable = TRUE;
+    GDeviceSetup **setups = (GDeviceSetup**)data;
 
-    gdk_error_trap_push ();
-    XIChangeHierarchy(gds->dpy, (XIAnyHierarchyChangeInfo*)&cr, 1);
-    XSync(gds->dpy, False);
-    if(gdk_error_trap_pop())
-      {
-	g_printerr("ERROR: Creating MD failed!\n");
-	return False;
-      }
-
-    return True;
+    shown_gds = setups[num];
+    update_apply_button(shown_gds);
+    update_journal_buttons(shown_gds, NULL);
 }
 
 
-
-void on_device_change (GdkDeviceManager *device_manager,
-			GdkDevice        *device,
-			gpointer          user_data)
+/**
+ * The ids of all selected SDs, as gint32. MDs and the Floating row are
+ * left out.
+ */
+static GArray* selected_slaves(GtkTreeView *tv)
 {
-  GDeviceSetup* gds = (GDeviceSetup*)user_data;
-  g_debug("Device change detected!\n");
-  query_devices(gds);
-}
-
+    GtkTreeModel *model;
+    GtkTreeIter iter;
+    GList *rows, *l;
+    GArray *ids;
+    int id, use;
+
+    rows = gtk_tree_selection_get_selected_rows(gtk_tree_view_get_selection(tv),
+                                                &model);
+    ids = g_array_new(FALSE, FALSE, sizeof(gint32));
+    for (l = rows; l; l = l->next)
+    {
+        gtk_tree_model_get_iter(model, &iter, l->data);
+        gtk_tree_model_get(model, &iter, COL_ID, &id, COL_USE, &use, -1);
 
-void on_help_button()
-{
-    // Create a help dialog
-    GtkWidget *dialog = gtk_message_dialog_new_with_markup(NULL,
-                                                           GTK_DIALOG_MODAL,
-                                                           GTK_MESSAGE_INFO,
-                                                           GTK_BUTTONS_OK,
-                                                           "The window shows your current input device hierarchy.\n\n"
-                                                           "You can create new <b>logical</b> cursor/keyboard focus pairs with\n"
-                                                           "the 'Create' button (and remove them again with a right click).\n\n"
-                                                           "Once you have several logical cursor/keyboard focus pairs, you can\n"
-                                                           "move your <b>physical</b> input devices between them via drag and drop.");
+        if (use == XIMasterPointer || use == XIMasterKeyboard ||
+            id == ID_FLOATING)
+            continue;
 
-    // Set the title of the dialog
-    gtk_window_set_title(GTK_WINDOW(dialog), "Help");
+        g_array_append_val(ids, id);
+    }
+    g_list_free_full(rows, (GDestroyNotify)gtk_tree_path_free);
 
+    return ids;
+}
 
-    // Run the dialog and wait for a response
-    gtk_dialog_run(GTK_DIALOG(dialog));
+/**
+ * Drag started. The payload is the ids of all selected SDs.
+ */
+static void signal_dnd_get(GtkTreeView *tv,
+                           GdkDragContext *context,
+                           GtkSelectionData *selection,
+                           guint info, guint time,
+                           gpointer data)
+{
+    GArray *ids = selected_slaves(tv);
 
-    // Destroy the dialog when done
-    gtk_widget_destroy(dialog);
+    gtk_selection_data_set(selection, gtk_selection_data_get_target(selection),
+                           32, (const guchar*)ids->data,
+                           ids->len * sizeof(gint32));
+    g_array_unref(ids);
 }
 
-
 /**
- * Drag-and-drop received.
+ * Drag-and-drop received. All SDs in the payload are moved in one request.
  */
 static void signal_dnd_recv(GtkTreeView *tv,
                             GdkDragContext *context,
@@ -231,113 +216,309 @@ static void signal_dnd_recv(GtkTreeView *tv,
 {
     GDeviceSetup *gds;
     GtkTreeModel *model;
-    GtkTreeSelection *sel;
-    GtkTreeIter sel_iter, dest_iter, parent, ins_iter,
-                *final_parent, *final_sib;
+    GtkTreeIter dest_iter, parent,
+                *final_parent;
     GtkTreePath *path;
     GtkTreeViewDropPosition pos;
-    int id, md_id;
-    int use, md_use;
+    DeviceEntry *entry;
+    const gint32 *ids;
+    int i, n, md_id;
 
     gds = (GDeviceSetup*)data;
     model = gtk_tree_view_get_model(tv);
-    sel = gtk_tree_view_get_selection(tv);
-    if (!gtk_tree_selection_get_selected(sel, NULL, &sel_iter))
-        return;
-
-    gtk_tree_model_get(model, &sel_iter,
-                       COL_ID, &id,
-                       COL_USE, &use,
-                       -1);
-
-    /* MD selected? */
-    if (use == XIMasterPointer || use == XIMasterKeyboard)
-        return;
 
-    if (!gtk_tree_view_get_dest_row_at_pos(tv, x, y, &path, &pos))
+    if (gtk_selection_data_get_format(selection) != 32 ||
+        !gtk_tree_view_get_dest_row_at_pos(tv, x, y, &path, &pos))
         return;
 
     gtk_tree_model_get_iter(model, &dest_iter, path);
+    gtk_tree_path_free(path);
 
-    /* check for parent, set final_parent to parent and final_sib to the
-     * sibling we're dropping onto. */
+    /* check for parent, set final_parent to the MD we're dropping onto */
     if (!gtk_tree_model_iter_parent(model, &parent, &dest_iter))
-    {
         final_parent = &dest_iter;
-        final_sib = NULL;
-    } else
-    {
+    else
         final_parent = &parent;
-        final_sib = &dest_iter;
-    }
 
     gtk_tree_model_get(GTK_TREE_MODEL(model), final_parent,
-		       COL_ID, &md_id, COL_USE, &md_use, -1);
+		       COL_ID, &md_id, -1);
 
-    g_debug("Trying to attach %d to %d\n", id, md_id);
-    
-    /* try */
-    if(md_id == ID_FLOATING)
-        float_device(gds, id);
-    else
-        change_attachment(gds, id, md_id);
+    ids = (const gint32*)gtk_selection_data_get_data(selection);
+    n = gtk_selection_data_get_length(selection) / sizeof(gint32);
+
+    hierarchy_begin(gds);
+    for (i = 0; i < n; i++)
+    {
+        /* SDs already there don't need a change */
+        entry = cache_lookup(gds, ids[i]);
+        if (entry && (md_id == ID_FLOATING ?
+                      entry->use == XIFloatingSlave :
+                      entry->use != XIFloatingSlave &&
+                      entry->attachment == md_id))
+            continue;
+
+        g_debug("Trying to attach %d to %d\n", ids[i], md_id);
+
+        if(md_id == ID_FLOATING)
+            float_device(gds, ids[i]);
+        else
+            change_attachment(gds, ids[i], md_id);
+    }
+    /* try, the tree store follows once the server tells us */
+    hierarchy_commit_async(gds, NULL, NULL);
+    update_apply_button(gds);
+}
+
+/**
+ * Drag over, the selection may change again.
+ */
+static void signal_dnd_end(GtkTreeView *tv, GdkDragContext *context,
+                           gpointer data)
+{
+    GDeviceSetup *gds = (GDeviceSetup*)data;
+
+    if (gds->press_path)
+    {
+        gtk_tree_path_free(gds->press_path);
+        gds->press_path = NULL;
+    }
+}
+
+/**
+ * While a press is kept from changing the selection, nothing else changes
+ * it either.
+ */
+static gboolean select_row(GtkTreeSelection *selection, GtkTreeModel *model,
+                           GtkTreePath *path, gboolean selected,
+                           gpointer data)
+{
+    GDeviceSetup *gds = (GDeviceSetup*)data;
+
+    return gds->press_path == NULL;
+}
+
+/**
+ * A plain click on a row of a multi-selection would select that row only,
+ * before the drag of the whole selection can start. Keep the selection
+ * until the button goes up, and only then select the row, unless the press
+ * turned into a drag.
+ */
+static gboolean signal_button_release(GtkTreeView *treeview,
+                                      GdkEventButton *event,
+                                      gpointer data)
+{
+    GDeviceSetup *gds = (GDeviceSetup*)data;
+    GtkTreeSelection *selection;
+    GtkTreePath *path;
+
+    if (event->button != 1 || !gds->press_path)
+        return FALSE;
+
+    path = gds->press_path;
+    gds->press_path = NULL;
+
+    selection = gtk_tree_view_get_selection(treeview);
+    gtk_tree_selection_unselect_all(selection);
+    gtk_tree_selection_select_path(selection, path);
+    gtk_tree_path_free(path);
+
+    return FALSE;
 }
 
 
 
+/**
+ * A row of the create dialog: label on the left, widget on the right.
+ */
+static void add_dialog_row(GtkDialog *popup, const char *text,
+                           GtkWidget *widget)
+{
+    GtkWidget *hbox = gtk_hbox_new(FALSE, 0);
+
+    if (text)
+        gtk_box_pack_start(GTK_BOX(hbox), gtk_label_new(text), TRUE, FALSE, 3);
+    gtk_box_pack_end(GTK_BOX(hbox), widget, TRUE, FALSE, 0);
+    gtk_box_pack_start(GTK_BOX(gtk_dialog_get_content_area(popup)), hbox,
+                       TRUE, FALSE, 3);
+}
+
+/**
+ * Client window and initial SDs are for one pair only.
+ */
+static void signal_count_changed(GtkSpinButton *spin, gpointer data)
+{
+    GtkWidget **first_only = (GtkWidget**)data;
+    gboolean single = gtk_spin_button_get_value_as_int(spin) == 1;
+
+    gtk_widget_set_sensitive(first_only[0], single);
+    gtk_widget_set_sensitive(first_only[1], single);
+}
+
 /**
  * New master device button clicked.
  * Open up a dialog to prompt for the name, create the device on "ok".
+ * More than one pair gets the name numbered. A pair can be given a cursor,
+ * be the client pointer of a window and get the selected SDs right away,
+ * which is all sent at once with create_masters(). Plain pairs are
+ * queued like any other change, the rest needs the changes to be applied
+ * immediately.
+ * The dialog is built on the first click and reused after that.
  */
 static void signal_new_md(GtkWidget *widget,
                           gpointer data)
 {
+    static GtkDialog *popup;
+    static GtkWidget *entry, *count, *send_core, *enable, *cursor,
+                     *window, *attach;
+    static GtkWidget *first_only[2];
     GDeviceSetup *gds;
-    GtkDialog *popup;
-    GtkWidget *entry,
-              *label,
-              *hbox;
     gint response;
-    const gchar *name;
+    const gchar *name, *text;
+    MasterSpec *specs;
+    GArray *slaves = NULL;
+    gchar **names;
+    Window client = None;
+    int i, n;
 
     gds = (GDeviceSetup*)data;
 
-    popup = (GtkDialog*)gtk_dialog_new();
-    gtk_container_set_border_width(GTK_CONTAINER(popup), 3);
-    gtk_window_set_modal(GTK_WINDOW(popup), TRUE);
-    entry = gtk_entry_new();
+    if (!popup)
+    {
+        popup = (GtkDialog*)gtk_dialog_new();
+        gtk_container_set_border_width(GTK_CONTAINER(popup), 3);
+        gtk_window_set_modal(GTK_WINDOW(popup), TRUE);
+        gtk_window_set_transient_for(GTK_WINDOW(popup), GTK_WINDOW(gds->window));
+
+        entry = gtk_entry_new();
+        add_dialog_row(popup, "Device Name:", entry);
+        count = gtk_spin_button_new_with_range(1, 64, 1);
+        add_dialog_row(popup, "Number of Pairs:", count);
+        send_core = gtk_check_button_new_with_mnemonic("Send _core events");
+        add_dialog_row(popup, NULL, send_core);
+        enable = gtk_check_button_new_with_mnemonic("_Enable");
+        add_dialog_row(popup, NULL, enable);
+
+        cursor = gtk_combo_box_text_new();
+        gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(cursor),
+                                       "(default)");
+        for (i = 0; cursor_names[i]; i++)
+            gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(cursor),
+                                           cursor_names[i]);
+        add_dialog_row(popup, "Cursor:", cursor);
+
+        window = gtk_entry_new();
+        gtk_widget_set_tooltip_text(window, "Window id, e.g. from xwininfo. "
+                                    "Empty for none.");
+        add_dialog_row(popup, "Client Pointer of Window:", window);
+        attach = gtk_check_button_new_with_mnemonic("_Attach the selected "
+                                                    "devices");
+        add_dialog_row(popup, NULL, attach);
+
+        first_only[0] = window;
+        first_only[1] = attach;
+        g_signal_connect(G_OBJECT(count), "value-changed",
+                         G_CALLBACK(signal_count_changed), first_only);
+
+        gtk_dialog_add_button(popup, GTK_STOCK_CANCEL, GTK_RESPONSE_CANCEL);
+        gtk_dialog_add_button(popup, GTK_STOCK_OK, GTK_RESPONSE_OK);
+        gtk_dialog_set_default_response(popup, GTK_RESPONSE_OK);
+        gtk_entry_set_activates_default(GTK_ENTRY(entry), TRUE);
+    }
 
-    label = gtk_label_new("Device Name:");
-    hbox = gtk_hbox_new(FALSE, 0);
+    gtk_entry_set_text(GTK_ENTRY(entry), "");
+    gtk_spin_button_set_value(GTK_SPIN_BUTTON(count), 1);
+    gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(send_core), TRUE);
+    gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(enable), TRUE);
+    gtk_combo_box_set_active(GTK_COMBO_BOX(cursor), 0);
+    gtk_entry_set_text(GTK_ENTRY(window), "");
+    gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(attach), FALSE);
+    gtk_widget_grab_focus(entry);
+    gtk_widget_show_all(GTK_WIDGET(popup));
+    response = gtk_dialog_run(popup);
+    gtk_widget_hide(GTK_WIDGET(popup));
 
-    gtk_box_pack_start(GTK_BOX(hbox), label, TRUE, FALSE, 3);
-    gtk_box_pack_end(GTK_BOX(hbox), entry, TRUE, FALSE, 0);
-    gtk_box_pack_start(GTK_BOX(gtk_dialog_get_content_area(popup)), hbox, TRUE, FALSE, 3);
+    if (response != GTK_RESPONSE_OK)
+        return;
 
-    gtk_dialog_add_button(popup, GTK_STOCK_CANCEL, GTK_RESPONSE_CANCEL);
-    gtk_dialog_add_button(popup, GTK_STOCK_OK, GTK_RESPONSE_OK);
-    gtk_dialog_set_default_response(popup, GTK_RESPONSE_OK);
-    gtk_entry_set_activates_default(GTK_ENTRY(entry), TRUE);
+    name = gtk_entry_get_text(GTK_ENTRY(entry));
+    n = gtk_spin_button_get_value_as_int(GTK_SPIN_BUTTON(count));
 
-    gtk_widget_show_all(GTK_WIDGET(popup));
-    response = gtk_dialog_run(popup);
+    text = gtk_entry_get_text(GTK_ENTRY(window));
+    if (n == 1 && *text)
+    {
+        gchar *end;
+
+        client = strtoul(text, &end, 0);
+        if (*end || client == None)
+        {
+            g_printerr("ERROR: %s is no window id!\n", text);
+            return;
+        }
+    }
+    if (n == 1 &&
+        gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(attach)))
+        slaves = selected_slaves(gds->treeview);
 
-    if (response == GTK_RESPONSE_OK)
+    specs = g_new0(MasterSpec, n);
+    names = g_new0(gchar*, n + 1);
+    for (i = 0; i < n; i++)
     {
-        name = gtk_entry_get_text(GTK_ENTRY(entry));
-        create_master(gds, name);
+        names[i] = n == 1 ? g_strdup(name) :
+                            g_strdup_printf("%s %d", name, i + 1);
+        specs[i].name = names[i];
+        specs[i].send_core =
+            gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(send_core));
+        specs[i].enable =
+            gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(enable));
+        if (gtk_combo_box_get_active(GTK_COMBO_BOX(cursor)) > 0)
+            specs[i].cursor = cursor_names[
+                gtk_combo_box_get_active(GTK_COMBO_BOX(cursor)) - 1];
+    }
+    specs[0].client_window = client;
+    if (slaves)
+    {
+        specs[0].slaves = (const int*)slaves->data;
+        specs[0].nslaves = slaves->len;
     }
 
-    gtk_widget_hide(GTK_WIDGET(popup));
-    gtk_widget_destroy(GTK_WIDGET(popup));
+    if (client == None && (!slaves || slaves->len == 0) &&
+        gtk_combo_box_get_active(GTK_COMBO_BOX(cursor)) <= 0)
+    {
+        /* nothing waits for the new ids, the pairs are queued */
+        hierarchy_begin(gds);
+        create_masters(gds, specs, n);
+        hierarchy_commit_async(gds, NULL, NULL);
+        update_apply_button(gds);
+    } else if (gds->batch)
+    {
+        GtkWidget *message;
+
+        message = gtk_message_dialog_new(GTK_WINDOW(gds->window),
+                                         GTK_DIALOG_MODAL,
+                                         GTK_MESSAGE_ERROR,
+                                         GTK_BUTTONS_CLOSE,
+                                         "A cursor, client pointer or "
+                                         "devices for the new pairs need "
+                                         "'Apply changes immediately'.");
+        gtk_dialog_run(GTK_DIALOG(message));
+        gtk_widget_destroy(message);
+    } else
+        create_masters(gds, specs, n);
 
+    if (slaves)
+        g_array_unref(slaves);
+    g_strfreev(names);
+    g_free(specs);
 }
 
 // Your function to be executed on the main thread
 gboolean remove_master_wrapper(gpointer data) {
     RemoveMasterWrapperData *rmd = (RemoveMasterWrapperData*)data;
 
+    hierarchy_begin(rmd->gds);
     remove_master(rmd->gds, rmd->device_id);
+    hierarchy_commit_async(rmd->gds, NULL, NULL);
+    update_apply_button(rmd->gds);
 
     free(rmd);
 
@@ -351,16 +532,10 @@ gboolean remove_master_wrapper(gpointer data) {
 static gboolean signal_popup_activate(GtkWidget *menuitem, gpointer data)
 {
     GDeviceSetup *gds = (GDeviceSetup*)data;
-    GtkTreeView *treeview = GTK_TREE_VIEW(gds->treeview);
-    GtkTreeModel *model = gtk_tree_view_get_model(treeview);
-    GtkTreeSelection *selection;
-    GtkTreeIter iter;
     int id;
 
-    selection = gtk_tree_view_get_selection(treeview);
-    gtk_tree_selection_get_selected(selection, NULL, &iter);
-
-    gtk_tree_model_get(model, &iter, COL_ID, &id, -1);
+    /* the selection may hold more than the row clicked on */
+    id = GPOINTER_TO_INT(g_object_get_data(G_OBJECT(menuitem), "device-id"));
 
     RemoveMasterWrapperData *rmd = malloc(sizeof(RemoveMasterWrapperData));
     rmd->gds = gds;
@@ -384,22 +559,40 @@ static gboolean signal_button_press(GtkTreeView *treeview,
     GtkTreeSelection *selection;
     GtkTreeIter iter;
     GtkTreeModel *model;
-    gchar *name;
     int use, id;
 
     gds = (GDeviceSetup*)data;
+    if (event->type == GDK_BUTTON_PRESS && event->button == 1 &&
+        !(event->state & (GDK_SHIFT_MASK | GDK_CONTROL_MASK)))
+    {
+        selection = gtk_tree_view_get_selection(treeview);
+        if (gtk_tree_selection_count_selected_rows(selection) > 1 &&
+            gtk_tree_view_get_path_at_pos(treeview, event->x, event->y, &path,
+                                          NULL, NULL, NULL))
+        {
+            if (gtk_tree_selection_path_is_selected(selection, path))
+            {
+                if (gds->press_path)
+                    gtk_tree_path_free(gds->press_path);
+                gds->press_path = path;
+            } else
+                gtk_tree_path_free(path);
+        }
+        return FALSE;
+    }
     if (event->type == GDK_BUTTON_PRESS && event->button == 3)
     {
         selection = gtk_tree_view_get_selection(treeview);
         if (gtk_tree_view_get_path_at_pos(treeview, event->x, event->y, &path,
                                           NULL, NULL, NULL))
         {
+            gtk_tree_selection_unselect_all(selection);
             gtk_tree_selection_select_path(selection, path);
             model = gtk_tree_view_get_model(treeview);
 
             gtk_tree_model_get_iter(GTK_TREE_MODEL(model), &iter, path);
             gtk_tree_model_get(GTK_TREE_MODEL(model), &iter,
-                               COL_ID, &id, COL_NAME, &name, COL_USE, &use, -1);
+                               COL_ID, &id, COL_USE, &use, -1);
 
             if (use == XIMasterPointer || use == XIMasterKeyboard)
             {
@@ -409,6 +602,8 @@ static gboolean signal_button_press(GtkTreeView *treeview,
                 if (id == 2 || id == 3) /* VCP or VCK */
 		  gtk_widget_set_sensitive(menuitem, FALSE);
 
+                g_object_set_data(G_OBJECT(menuitem), "device-id",
+                                  GINT_TO_POINTER(id));
                 g_signal_connect(menuitem, "activate",
                                  G_CALLBACK(signal_popup_activate), gds);
                 gtk_menu_shell_append(GTK_MENU_SHELL(menu), menuitem);
@@ -425,243 +620,248 @@ static gboolean signal_button_press(GtkTreeView *treeview,
 }
 
 
-static GdkPixbuf* load_icon(int what)
+/**
+ * Icon theme changed. Reload the icons and update the MD rows.
+ */
+static void signal_icon_theme_changed(GtkIconTheme *icon_theme,
+                                      gpointer data)
 {
-    GtkIconTheme *icon_theme;
-    GdkPixbuf *pixbuf;
-    GError *error = NULL;
-    char* icon;
+    GDeviceSetup *gds = (GDeviceSetup*)data;
+    GtkTreeModel *model;
+    GtkTreeIter iter;
+    int valid;
+    int use;
 
-    icon_theme = gtk_icon_theme_get_default();
+    clear_icons(gds);
 
-    switch(what)
+    if (!gds->treeview)
+        return;
+
+    model = GTK_TREE_MODEL(gds->store);
+    valid = gtk_tree_model_get_iter_first(model, &iter);
+    while (valid)
+    {
+        gtk_tree_model_get(model, &iter, COL_USE, &use, -1);
+        gtk_tree_store_set(gds->store, &iter,
+                           COL_ICON, get_icon(gds, icon_for_use(use)), -1);
+        valid = gtk_tree_model_iter_next(model, &iter);
+    }
+}
+
+/**
+ * Load or Save Profile clicked. Ask for the file and apply or save the
+ * profile.
+ */
+static void on_profile_button(GDeviceSetup *gds, gboolean save)
+{
+    GtkWidget *chooser;
+    GtkWidget *message;
+    gchar *path;
+    GError *error = NULL;
+    gboolean ret;
+
+    chooser = gtk_file_chooser_dialog_new(save ? "Save Profile" : "Load Profile",
+                                          GTK_WINDOW(gds->window),
+                                          save ? GTK_FILE_CHOOSER_ACTION_SAVE :
+                                                 GTK_FILE_CHOOSER_ACTION_OPEN,
+                                          GTK_STOCK_CANCEL, GTK_RESPONSE_CANCEL,
+                                          save ? GTK_STOCK_SAVE : GTK_STOCK_OPEN,
+                                          GTK_RESPONSE_ACCEPT,
+                                          NULL);
+    gtk_file_chooser_set_do_overwrite_confirmation(GTK_FILE_CHOOSER(chooser),
+                                                   TRUE);
+
+    if (gtk_dialog_run(GTK_DIALOG(chooser)) != GTK_RESPONSE_ACCEPT)
     {
-        case ICON_MOUSE: icon = "mouse"; break;
-        case ICON_KEYBOARD: icon = "keyboard"; break;
-        case ICON_FLOATING: icon = "dialog-warning"; break; /* XXX */
+        gtk_widget_destroy(chooser);
+        return;
     }
 
-    pixbuf = gtk_icon_theme_load_icon(icon_theme, icon,16, 0, &error);
+    path = gtk_file_chooser_get_filename(GTK_FILE_CHOOSER(chooser));
+    gtk_widget_destroy(chooser);
+
+    if (save)
+        ret = profile_save_tree(gds, path, &error);
+    else
+        ret = profile_apply(gds, path, &error);
 
-    if (!pixbuf)
+    if (!ret)
     {
-        g_debug("Couldn't load icon: %s", error->message);
+        message = gtk_message_dialog_new(GTK_WINDOW(gds->window),
+                                         GTK_DIALOG_MODAL,
+                                         GTK_MESSAGE_ERROR,
+                                         GTK_BUTTONS_CLOSE,
+                                         "%s", error->message);
+        gtk_dialog_run(GTK_DIALOG(message));
+        gtk_widget_destroy(message);
         g_error_free(error);
     }
 
-    return pixbuf;
+    g_free(path);
 }
 
+
 /**
- * Build data storage by querying the X server for all input devices.
- * Can be called multiple times, in which case it'll clean out and re-fill
- * update the tree store.
+ * Assemble the list view.
  */
-static GtkTreeStore* query_devices(GDeviceSetup* gds)
+static void signal_row_expanded(GtkTreeView *tv, GtkTreeIter *iter,
+                                GtkTreePath *path, gpointer data)
 {
-    GtkTreeStore *treestore;
-    GtkTreeModel *model;
-    GtkTreeIter iter, child;
-    XIDeviceInfo *devices, *dev;
-    int ndevices;
-    int i, j;
-    int icontype;
-    GdkPixbuf *icon;
-    int valid, child_valid;
-    int id, masterid;
+    GDeviceSetup *gds = (GDeviceSetup*)data;
+    int id;
 
-    if (!gds->treeview)
-    {
-        treestore = gtk_tree_store_new(NUM_COLS,
-                                       G_TYPE_UINT, /* deviceid*/
-                                       G_TYPE_STRING, /* name */
-                                       G_TYPE_UINT,
-                                       GDK_TYPE_PIXBUF,
-                                       G_TYPE_UINT
-                                       );
-        model = GTK_TREE_MODEL(treestore);
-    } else
-    {
-        model = gtk_tree_view_get_model(gds->treeview);
-        treestore = GTK_TREE_STORE(model);
-    }
+    gtk_tree_model_get(gtk_tree_view_get_model(tv), iter, COL_ID, &id, -1);
+    g_hash_table_remove(gds->collapsed, GINT_TO_POINTER(id));
+}
 
-    gds->generation++;
-    devices = XIQueryDevice(gds->dpy, XIAllDevices, &ndevices);
+static void signal_row_collapsed(GtkTreeView *tv, GtkTreeIter *iter,
+                                 GtkTreePath *path, gpointer data)
+{
+    GDeviceSetup *gds = (GDeviceSetup*)data;
+    int id;
 
-    /* First, run through all master device and append them to the tree store
-     */
-    for (i = 0; i < ndevices; i++)
-    {
-        dev = &devices[i];
+    gtk_tree_model_get(gtk_tree_view_get_model(tv), iter, COL_ID, &id, -1);
+    g_hash_table_add(gds->collapsed, GINT_TO_POINTER(id));
+}
 
-        if (dev->use != XIMasterPointer && dev->use != XIMasterKeyboard)
-            continue;
+/**
+ * A MD row got its first SD. Expand it, unless the user collapsed it
+ * before.
+ */
+static void signal_row_has_child_toggled(GtkTreeModel *model,
+                                         GtkTreePath *path,
+                                         GtkTreeIter *iter,
+                                         gpointer data)
+{
+    GDeviceSetup *gds = (GDeviceSetup*)data;
 
-        valid = gtk_tree_model_get_iter_first(model, &iter);
-        g_debug("MD %d: %s", dev->deviceid,  dev->name);
+    /* not while view_freeze() has the model off the view */
+    if (!gds->treeview || !gtk_tree_view_get_model(gds->treeview))
+        return;
 
-        while(valid) {
-            gtk_tree_model_get(model, &iter, COL_ID, &id, -1);
-            if (id == dev->deviceid)
-            {
-                gtk_tree_store_set(treestore, &iter,
-                                   COL_GENERATION, gds->generation, -1);
-                valid = 0xFF;
-                break;
-            }
-            valid = gtk_tree_model_iter_next(model, &iter);
-        }
+    if (gtk_tree_path_get_depth(path) == 1 &&
+        gtk_tree_model_iter_has_child(model, iter))
+        expand_master(gds, model, iter);
+}
 
-        if (valid != 0xFF) /* new MD */
-        {
-            icontype = (dev->use == XIMasterPointer) ? ICON_MOUSE : ICON_KEYBOARD;
-            icon = load_icon(icontype);
-
-            gtk_tree_store_append(treestore, &iter, NULL);
-            gtk_tree_store_set(treestore, &iter,
-                               COL_ID, dev->deviceid,
-                               COL_NAME, dev->name,
-                               COL_USE, dev->use,
-                               COL_ICON, icon,
-                               COL_GENERATION, gds->generation,
-                               -1);
-            g_object_unref(icon);
-        }
-    }
+/**
+ * Show what the cache knows about the device under the pointer. Nothing
+ * here asks the server.
+ */
+static gboolean signal_query_tooltip(GtkWidget *widget, gint x, gint y,
+                                     gboolean keyboard_mode,
+                                     GtkTooltip *tooltip, gpointer data)
+{
+    GDeviceSetup *gds = (GDeviceSetup*)data;
+    GtkTreeView *tv = GTK_TREE_VIEW(widget);
+    GtkTreeModel *model;
+    GtkTreePath *path;
+    GtkTreeIter iter;
+    DeviceEntry *entry;
+    GString *text;
+    int id;
 
-    /* search for Floating fake master device */
-    valid = gtk_tree_model_get_iter_first(model, &iter);
-    while(valid)
-    {
-        gtk_tree_model_get(model, &iter, COL_ID, &id, -1);
-        if (id == ID_FLOATING)
-            break;
+    if (!gtk_tree_view_get_tooltip_context(tv, &x, &y, keyboard_mode,
+                                           &model, &path, &iter))
+        return FALSE;
 
-        valid = gtk_tree_model_iter_next(model, &iter);
+    gtk_tree_model_get(model, &iter, COL_ID, &id, -1);
+    entry = cache_lookup(gds, id);
+    if (!entry)
+    {
+        gtk_tree_path_free(path);
+        return FALSE;
     }
 
-    if (!valid)
-    {
-        /* Attach a fake master device for "Floating" */
-        icon = load_icon(ICON_FLOATING);
-        gtk_tree_store_append(treestore, &iter, NULL);
-        gtk_tree_store_set(treestore, &iter,
-                COL_ID, ID_FLOATING,
-                COL_NAME, "Floating",
-                COL_USE, ID_FLOATING,
-                COL_ICON, icon,
-                COL_GENERATION, gds->generation,
-                -1);
-        g_object_unref(icon);
-    } else {
-        GtkTreeIter prev;
-        GtkTreeIter pos = iter; /* current position of Floating */
-
-        /* always move Floating fake device to end of list */
-        while(valid)
-        {
-            prev = iter;
-            valid = gtk_tree_model_iter_next(model, &iter);
-        }
+    text = g_string_new(NULL);
+    g_string_append_printf(text, "Device %d%s", entry->id,
+                           entry->enabled ? "" : " (disabled)");
+    if (entry->classes)
+        g_string_append_printf(text, "\nClasses:%s%s%s%s%s",
+                               entry->classes & CLASS_KEY ? " keys" : "",
+                               entry->classes & CLASS_BUTTON ? " buttons" : "",
+                               entry->classes & CLASS_VALUATOR ? " valuators" : "",
+                               entry->classes & CLASS_SCROLL ? " scrolling" : "",
+                               entry->classes & CLASS_TOUCH ? " touch" : "");
+    if (entry->have_product)
+        g_string_append_printf(text, "\nProduct: %04x:%04x",
+                               entry->vendor, entry->product);
+    if (entry->node)
+        g_string_append_printf(text, "\nNode: %s", entry->node);
+    if (gds->monitor)
+        g_string_append_printf(text, "\nRate: %u events/s",
+                               monitor_rate(gds->monitor, entry->id));
+
+    gtk_tooltip_set_text(tooltip, text->str);
+    gtk_tree_view_set_tooltip_row(tv, tooltip, path);
+
+    g_string_free(text, TRUE);
+    gtk_tree_path_free(path);
 
-        gtk_tree_store_move_after(treestore, &pos, &prev);
+    return TRUE;
+}
 
-        /* update generation too */
-        gtk_tree_store_set(treestore, &pos,
-                           COL_GENERATION, gds->generation, -1);
-    }
+/**
+ * Fill the tree, once the window has been painted without it.
+ */
+static gboolean fill_tree(gpointer data)
+{
+    GDeviceSetup *gds = (GDeviceSetup*)data;
 
+    /* with the I/O worker, the tree is filled once its snapshot is in */
+    gds->fill_start = startup_time;
+    query_devices(gds);
 
-    /* now that we added all MDs, run through again and add SDs to the
-     * respective MD */
-    for (i = 0; i < ndevices; i++)
-    {
-        dev = &devices[i];
-
-        if (dev->use == XIMasterPointer || dev->use == XIMasterKeyboard)
-   	  continue;
-
-        g_debug("SD %d: %s", dev->deviceid, dev->name);
-
-	valid = gtk_tree_model_get_iter_first(model, &iter);
-	while(valid) {
-	  gtk_tree_model_get(model, &iter, COL_ID, &masterid, -1);
-	  if(dev->attachment == masterid || (dev->use == XIFloatingSlave && masterid == ID_FLOATING))
-	    {
-	      /* found master, check if we're already attached to it in
-	       * the tree model */
-	      child_valid = gtk_tree_model_iter_children(model, &child, &iter);
-	      while (child_valid)
-		{
-                  gtk_tree_model_get(model, &child, COL_ID, &id, -1);
-
-		  if (id == dev->deviceid)
-		    {
-		      gtk_tree_store_set(treestore, &child,
-					 COL_GENERATION, gds->generation, -1);
-		      child_valid = 0xFF;
-		      break;
-		    }
-
-		  child_valid = gtk_tree_model_iter_next(model, &child);
-		}
-
-	      /* new slave device, attach */
-	      if (child_valid != 0xFF)
-		{
-		  gtk_tree_store_append(treestore, &child, &iter);
-		  gtk_tree_store_set(treestore, &child,
-				     COL_ID, dev->deviceid,
-				     COL_NAME, dev->name,
-				     COL_USE, dev->use,
-				     COL_GENERATION, gds->generation,
-				     -1);
-		}
-	      break;
-	    }
-
-	  valid = gtk_tree_model_iter_next(model, &iter);
-	}
-    }
+    return G_SOURCE_REMOVE;
+}
 
-    XIFreeDeviceInfo(devices);
+/**
+ * First frame of the window is out. Only now ask the server for the
+ * devices.
+ */
+static gboolean signal_first_draw(GtkWidget *widget, cairo_t *cr,
+                                  gpointer data)
+{
+    stats_end(STAT_STARTUP_PAINT, startup_time);
 
-    /* clean tree store of anything that doesn't have the current
-       server generation */
+    g_signal_handlers_disconnect_by_func(widget, signal_first_draw, data);
+    g_idle_add(fill_tree, data);
 
-    valid = gtk_tree_model_get_iter_first(model, &iter);
-    while(valid)
-    {
-        int gen;
+    return FALSE;
+}
 
-        child_valid = gtk_tree_model_iter_children(model, &child, &iter);
-        while(child_valid)
-        {
-            gtk_tree_model_get(model, &child, COL_GENERATION, &gen, -1);
-            if (gen < gds->generation)
-                child_valid = gtk_tree_store_remove(treestore, &child);
-            else
-                child_valid = gtk_tree_model_iter_next(model, &child);
-        }
+/**
+ * Names are kept interned in the tree store, see row_name().
+ */
+static void render_name(GtkTreeViewColumn *col, GtkCellRenderer *renderer,
+                        GtkTreeModel *model, GtkTreeIter *iter,
+                        gpointer data)
+{
+    g_object_set(renderer, "text", row_name(model, iter), NULL);
+}
 
-        gtk_tree_model_get(model, &iter, COL_GENERATION, &gen, -1);
-        if (gen < gds->generation)
-            valid = gtk_tree_store_remove(treestore, &iter);
-        else
-            valid = gtk_tree_model_iter_next(model, &iter);
-    }
+/**
+ * Rates of 0 are left blank, so the busy devices stand out.
+ */
+static void render_rate(GtkTreeViewColumn *col, GtkCellRenderer *renderer,
+                        GtkTreeModel *model, GtkTreeIter *iter,
+                        gpointer data)
+{
+    gchar text[16] = "";
+    guint rate;
 
-    return treestore;
+    gtk_tree_model_get(model, iter, COL_RATE, &rate, -1);
+    if (rate)
+        g_snprintf(text, sizeof(text), "%u", rate);
+    g_object_set(renderer, "text", text, NULL);
 }
 
-
 /**
- * Assemble the list view.
+ * The view starts out with an empty tree store, fill_tree() fills it.
  */
 static GtkTreeView* get_tree_view(GDeviceSetup *gds)
 {
-    GtkTreeStore *ts = query_devices(gds);
+    GtkTreeStore *ts = tree_store_new(gds);
     GtkTreeView  *tv;
     GtkTreeViewColumn *col;
     GtkCellRenderer *renderer;
@@ -671,7 +871,12 @@ static GtkTreeView* get_tree_view(GDeviceSetup *gds)
     tv = (GtkTreeView*)gtk_tree_view_new();
     col = gtk_tree_view_column_new();
     gtk_tree_view_column_set_title(col, ("Input Device Hierarchy"));
+    /* all rows have the same height, so GTK doesn't need to measure each */
+    gtk_tree_view_column_set_sizing(col, GTK_TREE_VIEW_COLUMN_FIXED);
+    gtk_tree_view_column_set_fixed_width(col, 300);
+    gtk_tree_view_column_set_expand(col, TRUE);
     gtk_tree_view_append_column(tv, col);
+    gtk_tree_view_set_fixed_height_mode(tv, TRUE);
 
     renderer = gtk_cell_renderer_pixbuf_new();
     gtk_tree_view_column_pack_start(col, renderer, FALSE);
@@ -679,12 +884,29 @@ static GtkTreeView* get_tree_view(GDeviceSetup *gds)
 
     renderer = gtk_cell_renderer_text_new();
     gtk_tree_view_column_pack_start(col, renderer, TRUE);
-    gtk_tree_view_column_add_attribute(col, renderer, "text", COL_NAME);
+    gtk_tree_view_column_set_cell_data_func(col, renderer, render_name,
+                                            NULL, NULL);
+
+    if (gds->monitor)
+    {
+        col = gtk_tree_view_column_new();
+        gtk_tree_view_column_set_title(col, "rate (ev/s)");
+        gtk_tree_view_column_set_sizing(col, GTK_TREE_VIEW_COLUMN_FIXED);
+        gtk_tree_view_column_set_fixed_width(col, 90);
+        renderer = gtk_cell_renderer_text_new();
+        g_object_set(renderer, "xalign", 1.0, NULL);
+        gtk_tree_view_column_pack_start(col, renderer, TRUE);
+        gtk_tree_view_column_set_cell_data_func(col, renderer, render_rate,
+                                                NULL, NULL);
+        gtk_tree_view_append_column(tv, col);
+    }
 
-    gtk_tree_view_set_model(tv, GTK_TREE_MODEL(ts));
-    g_object_unref(ts);
+    /* gds keeps the store, the view may see it through the search filter */
+    gds->store = ts;
+    gds->treeview = tv;
+    view_attach(gds);
     gtk_tree_selection_set_mode(gtk_tree_view_get_selection(tv),
-                                GTK_SELECTION_SINGLE);
+                                GTK_SELECTION_MULTIPLE);
 
     gtk_tree_view_enable_model_drag_source(tv,
                                            GDK_BUTTON1_MASK,
@@ -695,82 +917,303 @@ static GtkTreeView* get_tree_view(GDeviceSetup *gds)
                                          dnd_targets,
                                          dnd_ntargets,
                                          GDK_ACTION_MOVE);
-    gtk_tree_view_expand_all(tv);
+    g_signal_connect(tv, "row-expanded",
+                     G_CALLBACK(signal_row_expanded), gds);
+    g_signal_connect(tv, "row-collapsed",
+                     G_CALLBACK(signal_row_collapsed), gds);
+    g_signal_connect(ts, "row-has-child-toggled",
+                     G_CALLBACK(signal_row_has_child_toggled), gds);
+    gtk_tree_selection_set_select_function(gtk_tree_view_get_selection(tv),
+                                           select_row, gds, NULL);
+    g_signal_connect(tv, "drag-data-get",
+                     G_CALLBACK(signal_dnd_get), gds);
     g_signal_connect(tv, "drag_data_received",
                      G_CALLBACK(signal_dnd_recv), gds);
+    g_signal_connect(tv, "drag-end",
+                     G_CALLBACK(signal_dnd_end), gds);
     g_signal_connect(tv, "button-press-event",
                      G_CALLBACK(signal_button_press), gds);
+    g_signal_connect(tv, "button-release-event",
+                     G_CALLBACK(signal_button_release), gds);
+    gtk_widget_set_has_tooltip(GTK_WIDGET(tv), TRUE);
+    g_signal_connect(tv, "query-tooltip",
+                     G_CALLBACK(signal_query_tooltip), gds);
 
     return tv;
 }
 
 
+/**
+ * Get everything but the widgets ready for gds, once it's connected.
+ * Rules and presets are loaded for each display, the journal is saved to
+ * journal if that's set.
+ */
+static gboolean setup_display(GDeviceSetup *gds, CmdlineData *cmdline,
+                              const char *journal)
+{
+    cache_init(gds);
+    refresh_init(gds);
+    /* --shared-connection is about having a single connection, devices are
+     * queried on it from the main thread then */
+    if (!cmdline->shared)
+        gds->worker = worker_new(gds);
+    if (cmdline->monitor)
+        gds->monitor = monitor_new(gds);
+
+    if (!load_rules(gds, g_strdup(cmdline->rules)) ||
+        !load_presets(gds, g_strdup(cmdline->presets)))
+        return FALSE;
+    presets_grab_keys(gds);
+    gds->journal = journal_new(journal, update_journal_buttons, NULL);
+
+    g_signal_connect(gtk_icon_theme_get_default(), "changed",
+                     G_CALLBACK(signal_icon_theme_changed), gds);
+
+    gds->display = gdk_display_get_default();
+    gds->dirty = g_hash_table_new(g_direct_hash, g_direct_equal);
+    gds->collapsed = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+    return TRUE;
+}
+
+/**
+ * The search text changed. GtkSearchEntry waits for a pause in typing
+ * before it says so, the filter is only rebuilt then.
+ */
+static void signal_search_changed(GtkSearchEntry *entry, gpointer data)
+{
+    GDeviceSetup *gds = (GDeviceSetup*)data;
+
+    view_search(gds, gtk_entry_get_text(GTK_ENTRY(entry)));
+}
+
+/**
+ * The device tree of gds with its search bar and Create button.
+ */
+static GtkWidget* display_page(GDeviceSetup *gds)
+{
+    GtkWidget *vbox, *search, *scrollwin, *bt_new, *icon;
+
+    search = gtk_search_entry_new();
+    gtk_entry_set_placeholder_text(GTK_ENTRY(search), "Search devices");
+    g_signal_connect(G_OBJECT(search), "search-changed",
+                     G_CALLBACK(signal_search_changed), gds);
+
+    gds->treeview = get_tree_view(gds);
+    scrollwin = gtk_scrolled_window_new(NULL, NULL);
+    gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(scrollwin),
+				   GTK_POLICY_NEVER,
+				   GTK_POLICY_AUTOMATIC);
+    gtk_container_add(GTK_CONTAINER(scrollwin), GTK_WIDGET(gds->treeview));
+
+    bt_new = gtk_button_new_with_mnemonic("_Create Cursor/Keyboard Focus");
+    icon   = gtk_image_new_from_stock(GTK_STOCK_ADD, GTK_ICON_SIZE_BUTTON);
+    gtk_button_set_image(GTK_BUTTON(bt_new), icon);
+    g_signal_connect(G_OBJECT(bt_new), "clicked",
+                     G_CALLBACK(signal_new_md), gds);
+
+    vbox = gtk_vbox_new(FALSE, 0);
+    gtk_box_pack_start(GTK_BOX(vbox), search, FALSE, FALSE, 0);
+    gtk_box_pack_start(GTK_BOX(vbox), scrollwin, TRUE, TRUE, 0);
+    gtk_box_pack_start(GTK_BOX(vbox), bt_new, 0, 0, 10);
+
+    return vbox;
+}
+
+/**
+ * Undo setup_display() and close the connection of gds.
+ */
+static void teardown_display(GDeviceSetup *gds, gboolean shared)
+{
+    /* changes that weren't applied are dropped, those sent are waited for */
+    hierarchy_abort(gds);
+    hierarchy_async_flush(gds);
+    if (gds->sync_window)
+        XDestroyWindow(gds->dpy, gds->sync_window);
+
+    worker_free(gds->worker);
+    gds->worker = NULL;
+
+    if (gds->refresh_source)
+        g_source_remove(gds->refresh_source);
+    if (gds->event_source)
+    {
+        g_source_destroy(gds->event_source);
+        g_source_unref(gds->event_source);
+    }
+    if (gds->rules)
+        g_array_unref(gds->rules);
+    presets_free(gds);
+    journal_close(gds);
+    clear_icons(gds);
+    g_hash_table_destroy(gds->dirty);
+    g_hash_table_destroy(gds->collapsed);
+    rows_free(gds);
+    g_clear_object(&gds->store);
+    g_free(gds->search);
+    gds->search = NULL;
+    cache_free(gds);
+    names_free(gds);
+    monitor_free(gds->monitor);
+    if (shared)
+        gdk_window_remove_filter(NULL, xi_event_filter, gds);
+    else
+        XCloseDisplay(gds->dpy);
+}
+
 int main (int argc, char *argv[])
 {
-    GDeviceSetup gds = { NULL, NULL, NULL, NULL, 0};
+    GDeviceSetup gds = { 0 };
+    CmdlineData cmdline = { &gds };
+    GDeviceSetup **setups;
     GtkWidget *window;
-    GtkWidget *scrollwin;
-    GtkWidget *bt_new;
-    GtkWidget *icon;
-    GtkWidget *message;
+    GtkWidget *notebook;
+    GtkWidget *cb_immediate;
+    GtkAccelGroup *accel;
+    gchar **names;
+    int ndisplays, i;
     int response;
     int loop = TRUE;
 
+    startup_time = g_get_monotonic_time();
+    gds.refresh_delay = REFRESH_DELAY;
+
+    /* hierarchy changes on the command line are collected in one batch */
+    hierarchy_begin(&gds);
+    if (!cmdline_parse(&cmdline, &argc, &argv, TRUE))
+    {
+        hierarchy_abort(&gds);
+        cmdline_free(&cmdline);
+        return 1;
+    }
+    names = cmdline.names;
+
+    response = cmdline_run(&gds, &cmdline);
+    if (response >= 0)
+    {
+        cmdline_free(&cmdline);
+        return response;
+    }
+
     /*
       We run okay under XWayland, but not native Wayland
     */
     gdk_set_allowed_backends("x11");
 
-    gds.dpy = dpy_init();
+    /* the I/O worker talks to the server from its own thread */
+    XInitThreads();
+
+    /* one GDeviceSetup per display, all in the one main loop */
+    ndisplays = names ? g_strv_length(names) : 1;
+    setups = g_new0(GDeviceSetup*, ndisplays + 1);
+    setups[0] = &gds;
+    for (i = 1; i < ndisplays; i++)
+    {
+        setups[i] = g_new0(GDeviceSetup, 1);
+        setups[i]->refresh_delay = gds.refresh_delay;
+    }
+    shown_gds = setups[0];
+
+    for (i = 0; !cmdline.shared && i < ndisplays; i++)
+    {
+        setups[i]->dpy = dpy_init_display(names ? names[i] : NULL,
+                                          &setups[i]->xi_opcode);
+        if (!setups[i]->dpy)
+        {
+            fprintf(stderr, "Cannot connect to X server %s, or X server does "
+                            "not support XI 2.", names ? names[i] : "");
+            return 1;
+        }
+    }
+    gtk_init(&argc, &argv);
+
+    if (cmdline.shared)
+        gds.dpy = dpy_init_shared(gdk_display_get_default(), &gds.xi_opcode);
     if (!gds.dpy)
     {
-        fprintf(stderr, "Cannot connect to X server, or X server does not "
-                        "support XI 2.");
+        fprintf(stderr, "X server does not support XI 2.");
         return 1;
     }
-    gtk_init(&argc, &argv);
+    stats_set_server(ServerVendor(gds.dpy), VendorRelease(gds.dpy));
+
+    for (i = 0; i < ndisplays; i++)
+    {
+        gchar *journal = cmdline.journal;
 
-    gds.display = gdk_display_get_default();
+        /* each display has its own journal file */
+        if (journal && names)
+            journal = g_strdup_printf("%s.%s", cmdline.journal, names[i]);
+        else
+            journal = g_strdup(journal);
+
+        if (!setup_display(setups[i], &cmdline, journal))
+            return 1;
+        g_free(journal);
+    }
 
     /* init dialog window */
     window = gtk_dialog_new();
     gtk_window_set_title(GTK_WINDOW(window), "Input Device Manager");
     gtk_window_set_default_size (GTK_WINDOW(window), 10, 500);
-
-    gds.window = window;
     gtk_container_set_border_width(GTK_CONTAINER(window), 10);
+    for (i = 0; i < ndisplays; i++)
+        setups[i]->window = window;
 
     gtk_dialog_add_buttons(GTK_DIALOG(window),
                            GTK_STOCK_HELP, GTK_RESPONSE_HELP,
+                           "_Load Profile", RESPONSE_LOAD_PROFILE,
+                           "_Save Profile", RESPONSE_SAVE_PROFILE,
+                           GTK_STOCK_UNDO, RESPONSE_UNDO,
+                           GTK_STOCK_REDO, RESPONSE_REDO,
+                           GTK_STOCK_APPLY, GTK_RESPONSE_APPLY,
                            GTK_STOCK_CLOSE, GTK_RESPONSE_CLOSE,
                            NULL);
+    update_apply_button(shown_gds);
+    update_journal_buttons(shown_gds, NULL);
+
+    /* Ctrl+Z and Ctrl+Shift+Z, as everywhere else */
+    accel = gtk_accel_group_new();
+    gtk_window_add_accel_group(GTK_WINDOW(window), accel);
+    gtk_widget_add_accelerator(
+        gtk_dialog_get_widget_for_response(GTK_DIALOG(window), RESPONSE_UNDO),
+        "clicked", accel, GDK_KEY_z, GDK_CONTROL_MASK, GTK_ACCEL_VISIBLE);
+    gtk_widget_add_accelerator(
+        gtk_dialog_get_widget_for_response(GTK_DIALOG(window), RESPONSE_REDO),
+        "clicked", accel, GDK_KEY_z, GDK_CONTROL_MASK | GDK_SHIFT_MASK,
+        GTK_ACCEL_VISIBLE);
+
+    /* main dialog area, a page per display if there's more than one */
+    if (ndisplays == 1)
+        gtk_box_pack_start(GTK_BOX(gtk_dialog_get_content_area(GTK_DIALOG(window))),
+                           display_page(&gds), TRUE, TRUE, 0);
+    else
+    {
+        notebook = gtk_notebook_new();
+        for (i = 0; i < ndisplays; i++)
+            gtk_notebook_append_page(GTK_NOTEBOOK(notebook),
+                                     display_page(setups[i]),
+                                     gtk_label_new(names[i]));
+        gtk_box_pack_start(GTK_BOX(gtk_dialog_get_content_area(GTK_DIALOG(window))),
+                           notebook, TRUE, TRUE, 0);
+        g_signal_connect(G_OBJECT(notebook), "switch-page",
+                         G_CALLBACK(signal_switch_page), setups);
+    }
 
-    /* main dialog area */
-    gds.treeview = get_tree_view(&gds);
-    scrollwin = gtk_scrolled_window_new(NULL, NULL);
-    gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(scrollwin),
-				   GTK_POLICY_NEVER,
-				   GTK_POLICY_AUTOMATIC);
-    gtk_container_add(GTK_CONTAINER(scrollwin), GTK_WIDGET(gds.treeview));
-
-
-    bt_new = gtk_button_new_with_mnemonic("_Create Cursor/Keyboard Focus");
-    icon   = gtk_image_new_from_stock(GTK_STOCK_ADD, GTK_ICON_SIZE_BUTTON);
-    gtk_button_set_image(GTK_BUTTON(bt_new), icon);
-
-    gtk_box_pack_start(GTK_BOX(gtk_dialog_get_content_area(GTK_DIALOG(window))),
-                       GTK_WIDGET(scrollwin), TRUE, TRUE, 0);
-    gtk_box_pack_start(GTK_BOX(gtk_dialog_get_content_area(GTK_DIALOG(window))), bt_new, 0, 0, 10);
-    g_signal_connect(G_OBJECT(bt_new), "clicked",
-                     G_CALLBACK(signal_new_md), &gds);
-    g_signal_connect (gdk_display_get_device_manager (gds.display), "device-added",
-		      G_CALLBACK (on_device_change), &gds);
-    g_signal_connect (gdk_display_get_device_manager (gds.display), "device-removed",
-		      G_CALLBACK (on_device_change), &gds);
-    g_signal_connect (gdk_display_get_device_manager (gds.display), "device-changed",
-		      G_CALLBACK (on_device_change), &gds);
-
+    cb_immediate = gtk_check_button_new_with_mnemonic("Apply changes _immediately");
+    gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(cb_immediate), TRUE);
+    gtk_box_pack_start(GTK_BOX(gtk_dialog_get_content_area(GTK_DIALOG(window))), cb_immediate, 0, 0, 0);
+    g_signal_connect(G_OBJECT(cb_immediate), "toggled",
+                     G_CALLBACK(signal_immediate_toggled), setups);
+    for (i = 0; i < ndisplays; i++)
+    {
+        if (cmdline.shared)
+            gdk_window_add_filter(NULL, xi_event_filter, setups[i]);
+        else
+            setups[i]->event_source = x_event_source_new(setups[i]);
 
+        g_signal_connect_after(window, "draw",
+                               G_CALLBACK(signal_first_draw), setups[i]);
+    }
     gtk_widget_show_all(window);
 
     do {
@@ -780,6 +1223,22 @@ int main (int argc, char *argv[])
             case GTK_RESPONSE_HELP:
                 on_help_button();
                 break;
+            case RESPONSE_LOAD_PROFILE:
+            case RESPONSE_SAVE_PROFILE:
+                on_profile_button(shown_gds, response == RESPONSE_SAVE_PROFILE);
+                break;
+            case RESPONSE_UNDO:
+                journal_undo(shown_gds, FALSE);
+                break;
+            case RESPONSE_REDO:
+                journal_redo(shown_gds, FALSE);
+                break;
+            case GTK_RESPONSE_APPLY:
+                /* submit the pending changes, keep collecting */
+                hierarchy_commit_async(shown_gds, NULL, NULL);
+                hierarchy_begin(shown_gds);
+                update_apply_button(shown_gds);
+                break;
             case GTK_RESPONSE_CLOSE:
                 loop = FALSE;
                 break;
@@ -789,7 +1248,15 @@ int main (int argc, char *argv[])
         }
     } while (loop);
 
-    XCloseDisplay(gds.dpy);
+    for (i = ndisplays - 1; i >= 0; i--)
+    {
+        teardown_display(setups[i], cmdline.shared);
+        if (i > 0)
+            g_free(setups[i]);
+    }
+    g_free(setups);
+    cmdline_free(&cmdline);
+    stats_shutdown();
 
     return 0;
 }
@@ -0,0 +1,741 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.  You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* The tree store of devices. Nothing in here talks to the X server, the
+ * device lists come from the caller. */
+
+#include <string.h>
+#include "gui.h"
+#include "stats.h"
+
+static GdkPixbuf* load_icon(int what)
+{
+    GtkIconTheme *icon_theme;
+    GdkPixbuf *pixbuf;
+    GError *error = NULL;
+    char* icon;
+
+    icon_theme = gtk_icon_theme_get_default();
+
+    switch(what)
+    {
+        case ICON_MOUSE: icon = "mouse"; break;
+        case ICON_KEYBOARD: icon = "keyboard"; break;
+        case ICON_FLOATING: icon = "dialog-warning"; break; /* XXX */
+    }
+
+    pixbuf = gtk_icon_theme_load_icon(icon_theme, icon,16, 0, &error);
+
+    if (!pixbuf)
+    {
+        g_debug("Couldn't load icon: %s", error->message);
+        g_error_free(error);
+    }
+
+    return pixbuf;
+}
+
+void clear_icons(GDeviceSetup *gds)
+{
+    int i;
+
+    for (i = 0; i < NUM_ICONS; i++)
+        g_clear_object(&gds->icons[i]);
+    gds->icons_loaded = FALSE;
+}
+
+/**
+ * Icon for the given ICON_* type. The pixbuf is owned by gds and may be
+ * NULL if the theme doesn't have it.
+ */
+GdkPixbuf* get_icon(GDeviceSetup *gds, int what)
+{
+    int i;
+
+    if (!gds->icons_loaded)
+    {
+        for (i = 0; i < NUM_ICONS; i++)
+            gds->icons[i] = load_icon(i);
+        gds->icons_loaded = TRUE;
+    }
+
+    return gds->icons[what];
+}
+
+int icon_for_use(int use)
+{
+    switch(use)
+    {
+        case XIMasterPointer: return ICON_MOUSE;
+        case XIMasterKeyboard: return ICON_KEYBOARD;
+        default: return ICON_FLOATING;
+    }
+}
+
+/**
+ * The name of the row at iter. Owned by the tree store's rows, not copied.
+ */
+const gchar* row_name(GtkTreeModel *model, GtkTreeIter *iter)
+{
+    gpointer name;
+
+    gtk_tree_model_get(model, iter, COL_NAME, &name, -1);
+
+    return name;
+}
+
+/**
+ * Look up the row for the device with the given id in the tree store.
+ * Returns TRUE and fills in iter if the row exists.
+ * GtkTreeStore iters stay valid as long as their row, so the index keeps
+ * them as they are: no path to walk, and nothing for the store to update
+ * on inserts and deletes the way it does for row references.
+ */
+gboolean lookup_row(GDeviceSetup *gds, GtkTreeModel *model,
+                    int id, GtkTreeIter *iter)
+{
+    GtkTreeIter *row;
+
+    row = g_hash_table_lookup(gds->rows, GINT_TO_POINTER(id));
+    if (!row)
+        return FALSE;
+
+    *iter = *row;
+
+    return TRUE;
+}
+
+/**
+ * Remember iter as the row for the device with the given id. The entry
+ * has to go with the row, see forget_rows().
+ */
+void index_row(GDeviceSetup *gds, GtkTreeModel *model,
+               int id, GtkTreeIter *iter)
+{
+    GtkTreeIter *row;
+
+    row = g_hash_table_lookup(gds->rows, GINT_TO_POINTER(id));
+    if (!row)
+    {
+        row = g_new(GtkTreeIter, 1);
+        g_hash_table_insert(gds->rows, GINT_TO_POINTER(id), row);
+    }
+    *row = *iter;
+}
+
+/**
+ * The row at iter is about to be removed from the tree store. Drop it and
+ * the SDs below it from the index and gds->shown. Their ids are added to
+ * gds->dirty, it's up to the caller to start the refresh.
+ */
+static void forget_rows(GDeviceSetup *gds, GtkTreeModel *model,
+                        GtkTreeIter *iter, int id)
+{
+    GtkTreeIter child;
+    int valid, childid;
+
+    valid = gtk_tree_model_iter_children(model, &child, iter);
+    while (valid)
+    {
+        gtk_tree_model_get(model, &child, COL_ID, &childid, -1);
+        g_hash_table_add(gds->dirty, GINT_TO_POINTER(childid));
+        g_hash_table_remove(gds->rows, GINT_TO_POINTER(childid));
+        device_list_remove(gds->shown, childid);
+        valid = gtk_tree_model_iter_next(model, &child);
+    }
+
+    g_hash_table_remove(gds->rows, GINT_TO_POINTER(id));
+}
+
+/**
+ * The view's iter for the row at iter of gds->store. FALSE if the search
+ * filters the row out, or while the model is off the view.
+ */
+static gboolean view_iter(GDeviceSetup *gds, GtkTreeIter *iter,
+                          GtkTreeIter *view)
+{
+    GtkTreeModel *model;
+
+    if (!gds->treeview || !(model = gtk_tree_view_get_model(gds->treeview)))
+        return FALSE;
+
+    if (model == GTK_TREE_MODEL(gds->store))
+    {
+        *view = *iter;
+        return TRUE;
+    }
+
+    return gtk_tree_model_filter_convert_child_iter_to_iter(
+                GTK_TREE_MODEL_FILTER(model), view, iter);
+}
+
+/**
+ * Whether the row at iter is selected in the view. FALSE while the model
+ * is off the view, view_thaw() takes care of the selection then.
+ */
+static gboolean row_selected(GDeviceSetup *gds, GtkTreeIter *iter)
+{
+    GtkTreeIter view;
+
+    if (!view_iter(gds, iter, &view))
+        return FALSE;
+
+    return gtk_tree_selection_iter_is_selected(
+                gtk_tree_view_get_selection(gds->treeview), &view);
+}
+
+/**
+ * Make sure there's a row for the device with the given id in the right
+ * place: MDs at the top level, SDs below their MD or the Floating row.
+ * A row in the wrong place is moved there. GtkTreeStore can't reparent,
+ * so a move is one row-deleted and one row-inserted with the row's data,
+ * and the selection is carried over. If name is NULL, the name is taken
+ * from the existing row. gds->shown follows along.
+ * Returns FALSE if the row couldn't be placed, i.e. the MD row doesn't
+ * exist or the device is unknown.
+ */
+gboolean update_row(GDeviceSetup *gds, GtkTreeStore *treestore,
+                    int id, const char *name, int use, int attachment)
+{
+    GtkTreeModel *model = GTK_TREE_MODEL(treestore);
+    GtkTreeIter iter, parent, floating, view;
+    gboolean is_master, has_parent, selected = FALSE, moved = FALSE;
+    int masterid = 0, parentid = 0;
+
+    is_master = (use == XIMasterPointer || use == XIMasterKeyboard);
+    if (!is_master)
+    {
+        masterid = (use == XIFloatingSlave) ? ID_FLOATING : attachment;
+        if (!lookup_row(gds, model, masterid, &parent))
+            return FALSE;
+    }
+
+    if (lookup_row(gds, model, id, &iter))
+    {
+        GtkTreeIter p;
+
+        has_parent = gtk_tree_model_iter_parent(model, &p, &iter);
+        if (has_parent)
+            gtk_tree_model_get(model, &p, COL_ID, &parentid, -1);
+
+        if (is_master ? !has_parent : (has_parent && parentid == masterid))
+        {
+            device_list_set(gds->shown, id, name, use, attachment);
+            return TRUE;
+        }
+
+        /* in the wrong place, take it out and put it back below */
+        if (!name)
+            name = row_name(model, &iter);
+        selected = row_selected(gds, &iter);
+        forget_rows(gds, model, &iter, id);
+        gtk_tree_store_remove(treestore, &iter);
+        moved = TRUE;
+
+        /* removing a former MD row may have invalidated parent */
+        if (!is_master && !lookup_row(gds, model, masterid, &parent))
+        {
+            device_list_remove(gds->shown, id);
+            stats_count(STAT_ROWS_REMOVED, 1);
+            return FALSE;
+        }
+    }
+
+    if (!name)
+    {
+        device_list_remove(gds->shown, id);
+        return FALSE;
+    }
+    name = intern_name(gds, name);
+
+    /* inserting with the values set emits a single row-inserted */
+    if (is_master)
+    {
+        /* Floating stays at the end of the list */
+        gtk_tree_store_insert_with_values(treestore, &iter, NULL,
+                lookup_row(gds, model, ID_FLOATING, &floating) ?
+                    gtk_tree_model_iter_n_children(model, NULL) - 1 : -1,
+                COL_ID, id,
+                COL_NAME, name,
+                COL_USE, use,
+                COL_ICON, get_icon(gds, icon_for_use(use)),
+                -1);
+    } else
+    {
+        gtk_tree_store_insert_with_values(treestore, &iter, &parent, -1,
+                COL_ID, id,
+                COL_NAME, name,
+                COL_USE, use,
+                -1);
+    }
+    index_row(gds, model, id, &iter);
+    stats_count(moved ? STAT_ROWS_MOVED : STAT_ROWS_INSERTED, 1);
+    device_list_set(gds->shown, id, name, use, attachment);
+
+    if (selected && view_iter(gds, &iter, &view))
+        gtk_tree_selection_select_iter(
+                gtk_tree_view_get_selection(gds->treeview), &view);
+
+    return TRUE;
+}
+
+/**
+ * Give the row for the device with the given id a new name.
+ */
+void rename_row(GDeviceSetup *gds, GtkTreeStore *treestore, int id,
+                const char *name)
+{
+    const DeviceRecord *rec;
+    GtkTreeIter iter;
+
+    if (!lookup_row(gds, GTK_TREE_MODEL(treestore), id, &iter))
+        return;
+
+    gtk_tree_store_set(treestore, &iter,
+                       COL_NAME, intern_name(gds, name), -1);
+    rec = device_list_find(gds->shown, id);
+    if (rec)
+        device_list_set(gds->shown, id, name, rec->use, rec->attachment);
+}
+
+/**
+ * Remove the row for the device with the given id. The ids of any SDs
+ * still below the row are added to gds->dirty, it's up to the caller to
+ * start the refresh.
+ */
+void remove_row(GDeviceSetup *gds, GtkTreeStore *treestore, int id)
+{
+    GtkTreeModel *model = GTK_TREE_MODEL(treestore);
+    GtkTreeIter iter;
+
+    if (!lookup_row(gds, model, id, &iter))
+        return;
+
+    forget_rows(gds, model, &iter, id);
+    gtk_tree_store_remove(treestore, &iter);
+    device_list_remove(gds->shown, id);
+    stats_count(STAT_ROWS_REMOVED, 1);
+
+    /* the server reuses ids, a new MD shouldn't start collapsed */
+    if (gds->collapsed)
+        g_hash_table_remove(gds->collapsed, GINT_TO_POINTER(id));
+}
+
+
+/**
+ * A new, empty tree store for gds. Forgets the rows of the previous one.
+ */
+GtkTreeStore* tree_store_new(GDeviceSetup *gds)
+{
+    GtkTreeStore *treestore;
+
+    treestore = gtk_tree_store_new(NUM_COLS,
+                                   G_TYPE_UINT, /* deviceid*/
+                                   G_TYPE_POINTER, /* name */
+                                   G_TYPE_UINT,
+                                   GDK_TYPE_PIXBUF,
+                                   G_TYPE_UINT /* rate */
+                                   );
+    if (gds->rows)
+        g_hash_table_destroy(gds->rows);
+    gds->rows = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
+                                      g_free);
+
+    if (!gds->shown)
+    {
+        gds->shown = device_list_new();
+        gds->next = device_list_new();
+        gds->edits = g_array_new(FALSE, FALSE, sizeof(DeviceEdit));
+    }
+    device_list_clear(gds->shown);
+
+    return treestore;
+}
+
+/**
+ * Free what tree_store_new() set up in gds.
+ */
+void rows_free(GDeviceSetup *gds)
+{
+    if (gds->rows)
+        g_hash_table_destroy(gds->rows);
+    gds->rows = NULL;
+    device_list_free(gds->shown);
+    device_list_free(gds->next);
+    gds->shown = gds->next = NULL;
+    if (gds->edits)
+        g_array_unref(gds->edits);
+    gds->edits = NULL;
+}
+
+/**
+ * Make treestore match the devices, as returned by XIQueryDevice() for
+ * XIAllDevices. Rows of devices not in the list are removed.
+ * The devices are diffed against gds->shown, so only rows that changed
+ * are touched and a run without changes is linear in the number of
+ * devices with no tree store access at all.
+ */
+void reconcile_devices(GDeviceSetup *gds, GtkTreeStore *treestore,
+                       XIDeviceInfo *devices, int ndevices)
+{
+    GtkTreeModel *model = GTK_TREE_MODEL(treestore);
+    GtkTreeIter iter;
+    DeviceList *shown;
+    const DeviceRecord *rec;
+    const DeviceEdit *edit;
+    gint64 start = stats_start();
+    guint i;
+
+    device_list_fill(gds->next, devices, ndevices);
+    g_array_set_size(gds->edits, 0);
+    device_list_diff(gds->shown, gds->next, gds->edits);
+
+    /* the new list is what the tree will show, update_row() and
+     * remove_row() keep it in line where the tree doesn't follow */
+    shown = gds->shown;
+    gds->shown = gds->next;
+    gds->next = shown;
+
+    /* Floating goes in before any SD needs it, and stays last */
+    if (!lookup_row(gds, model, ID_FLOATING, &iter))
+    {
+        /* Attach a fake master device for "Floating" */
+        gtk_tree_store_insert_with_values(treestore, &iter, NULL, -1,
+                COL_ID, ID_FLOATING,
+                COL_NAME, intern_name(gds, "Floating"),
+                COL_USE, ID_FLOATING,
+                COL_ICON, get_icon(gds, ICON_FLOATING),
+                -1);
+        index_row(gds, model, ID_FLOATING, &iter);
+        stats_count(STAT_ROWS_INSERTED, 1);
+    }
+
+    for (i = 0; i < gds->edits->len; i++)
+    {
+        edit = &g_array_index(gds->edits, DeviceEdit, i);
+
+        switch (edit->type)
+        {
+            case EDIT_INSERT:
+            case EDIT_MOVE:
+                /* not where the edit saw it if update_row() dropped
+                 * records, or gone itself */
+                rec = device_list_find(gds->shown, edit->id);
+                if (!rec)
+                    break;
+                g_debug("%s %d: %s",
+                        edit->type == EDIT_INSERT ? "insert" : "move",
+                        rec->id, device_list_name(gds->shown, rec));
+                update_row(gds, treestore, rec->id,
+                           device_list_name(gds->shown, rec),
+                           rec->use, rec->attachment);
+                break;
+            case EDIT_RENAME:
+                rec = device_list_find(gds->shown, edit->id);
+                if (!rec)
+                    break;
+                rename_row(gds, treestore, rec->id,
+                           device_list_name(gds->shown, rec));
+                break;
+            case EDIT_REMOVE:
+                g_debug("remove %d", edit->id);
+                remove_row(gds, treestore, edit->id);
+                break;
+        }
+    }
+
+    /* always keep Floating fake device at the end of the list, but
+     * don't emit rows-reordered when it already is */
+    if (lookup_row(gds, model, ID_FLOATING, &iter))
+    {
+        GtkTreeIter next = iter;
+
+        if (gtk_tree_model_iter_next(model, &next))
+            gtk_tree_store_move_before(treestore, &iter, NULL);
+    }
+
+    view_refilter(gds);
+    stats_end(STAT_RECONCILE, start);
+}
+
+/**
+ * Update the rows of n devices, MDs first so the SDs have somewhere to
+ * go. NULL entries are skipped.
+ * Returns FALSE if any row couldn't be placed.
+ */
+gboolean update_devices(GDeviceSetup *gds, GtkTreeStore *treestore,
+                        XIDeviceInfo **infos, int n)
+{
+    XIDeviceInfo *info;
+    gboolean ret = TRUE;
+    int i, pass;
+
+    for (pass = 0; pass < 2; pass++)
+    {
+        for (i = 0; i < n; i++)
+        {
+            gboolean is_master;
+
+            info = infos[i];
+            if (!info)
+                continue;
+            is_master = (info->use == XIMasterPointer ||
+                         info->use == XIMasterKeyboard);
+            if (is_master != (pass == 0))
+                continue;
+
+            if (!update_row(gds, treestore, info->deviceid, info->name,
+                            info->use, info->attachment))
+                ret = FALSE;
+        }
+    }
+    view_refilter(gds);
+
+    return ret;
+}
+
+/**
+ * Expand the MD row at iter of gds->store, unless the user collapsed it
+ * or the search filters it out.
+ */
+void expand_master(GDeviceSetup *gds, GtkTreeModel *model, GtkTreeIter *iter)
+{
+    GtkTreePath *path;
+    GtkTreeIter view;
+    int id;
+
+    gtk_tree_model_get(model, iter, COL_ID, &id, -1);
+    if (gds->collapsed &&
+        g_hash_table_contains(gds->collapsed, GINT_TO_POINTER(id)))
+        return;
+
+    if (!view_iter(gds, iter, &view))
+        return;
+
+    path = gtk_tree_model_get_path(gtk_tree_view_get_model(gds->treeview),
+                                   &view);
+    gtk_tree_view_expand_row(gds->treeview, path, FALSE);
+    gtk_tree_path_free(path);
+}
+
+/**
+ * Expand all MD rows the user didn't collapse.
+ */
+void expand_masters(GDeviceSetup *gds)
+{
+    GtkTreeModel *model = GTK_TREE_MODEL(gds->store);
+    GtkTreeIter iter;
+    int valid;
+
+    valid = gtk_tree_model_get_iter_first(model, &iter);
+    while (valid)
+    {
+        expand_master(gds, model, &iter);
+        valid = gtk_tree_model_iter_next(model, &iter);
+    }
+}
+
+/* What view_thaw() needs to put back */
+struct _ViewState {
+    GArray       *selected;    /* device ids */
+    int           top;         /* id of the first visible row, or 0 */
+    gboolean      have_top;
+};
+
+static void save_selected(GtkTreeModel *model, GtkTreePath *path,
+                          GtkTreeIter *iter, gpointer data)
+{
+    int id;
+
+    gtk_tree_model_get(model, iter, COL_ID, &id, -1);
+    g_array_append_val((GArray*)data, id);
+}
+
+/**
+ * Take the model off the view, so a large update doesn't make the view
+ * follow every single row change. Selection, scroll position and
+ * expansion come back with view_thaw().
+ */
+ViewState* view_freeze(GDeviceSetup *gds)
+{
+    ViewState *state = g_new0(ViewState, 1);
+    GtkTreeModel *model = gtk_tree_view_get_model(gds->treeview);
+    GtkTreePath *start;
+    GtkTreeIter iter;
+
+    state->selected = g_array_new(FALSE, FALSE, sizeof(int));
+    gtk_tree_selection_selected_foreach(
+            gtk_tree_view_get_selection(gds->treeview),
+            save_selected, state->selected);
+
+    if (gtk_tree_view_get_visible_range(gds->treeview, &start, NULL))
+    {
+        if (gtk_tree_model_get_iter(model, &iter, start))
+        {
+            gtk_tree_model_get(model, &iter, COL_ID, &state->top, -1);
+            state->have_top = TRUE;
+        }
+        gtk_tree_path_free(start);
+    }
+
+    gtk_tree_view_set_model(gds->treeview, NULL);
+
+    return state;
+}
+
+/**
+ * Put the model back after view_freeze() and restore what can be. Rows
+ * the search hides drop out of the selection.
+ */
+void view_thaw(GDeviceSetup *gds, ViewState *state)
+{
+    GtkTreeModel *model = GTK_TREE_MODEL(gds->store);
+    GtkTreeSelection *selection;
+    GtkTreePath *path;
+    GtkTreeIter iter, view;
+    int i;
+
+    view_attach(gds);
+    expand_masters(gds);
+
+    selection = gtk_tree_view_get_selection(gds->treeview);
+    for (i = 0; i < state->selected->len; i++)
+        if (lookup_row(gds, model,
+                       g_array_index(state->selected, int, i), &iter) &&
+            view_iter(gds, &iter, &view))
+            gtk_tree_selection_select_iter(selection, &view);
+
+    if (state->have_top && lookup_row(gds, model, state->top, &iter) &&
+        view_iter(gds, &iter, &view))
+    {
+        path = gtk_tree_model_get_path(gtk_tree_view_get_model(gds->treeview),
+                                       &view);
+        gtk_tree_view_scroll_to_cell(gds->treeview, path, NULL, TRUE, 0, 0);
+        gtk_tree_path_free(path);
+    }
+
+    g_array_unref(state->selected);
+    g_free(state);
+}
+
+/**
+ * Whether the casefolded name of the row at iter contains the search.
+ */
+static gboolean row_matches(GDeviceSetup *gds, GtkTreeModel *model,
+                            GtkTreeIter *iter)
+{
+    const gchar *folded;
+
+    folded = g_hash_table_lookup(gds->folded, row_name(model, iter));
+
+    return folded && strstr(folded, gds->search);
+}
+
+/**
+ * A row is shown if it matches the search, if its MD does, or if it's a
+ * MD with a matching SD, so a match is never shown out of place.
+ */
+static gboolean row_visible(GtkTreeModel *model, GtkTreeIter *iter,
+                            gpointer data)
+{
+    GDeviceSetup *gds = (GDeviceSetup*)data;
+    GtkTreeIter other;
+    gboolean valid;
+
+    if (!gds->search || !gds->folded || row_matches(gds, model, iter))
+        return TRUE;
+
+    if (gtk_tree_model_iter_parent(model, &other, iter))
+        return row_matches(gds, model, &other);
+
+    valid = gtk_tree_model_iter_children(model, &other, iter);
+    while (valid)
+    {
+        if (row_matches(gds, model, &other))
+            return TRUE;
+        valid = gtk_tree_model_iter_next(model, &other);
+    }
+
+    return FALSE;
+}
+
+/**
+ * Put gds->store on the view, through a filter if there's a search. Without
+ * one the view gets the store itself, so there's no filter to keep up to
+ * date.
+ */
+void view_attach(GDeviceSetup *gds)
+{
+    GtkTreeModel *filter;
+
+    if (!gds->search)
+    {
+        gtk_tree_view_set_model(gds->treeview, GTK_TREE_MODEL(gds->store));
+        return;
+    }
+
+    filter = gtk_tree_model_filter_new(GTK_TREE_MODEL(gds->store), NULL);
+    gtk_tree_model_filter_set_visible_func(GTK_TREE_MODEL_FILTER(filter),
+                                           row_visible, gds, NULL);
+    gtk_tree_view_set_model(gds->treeview, filter);
+    g_object_unref(filter);
+}
+
+/**
+ * Check all rows against the search again. A row only matching through
+ * its MD or SDs isn't picked up by the filter when these change, so this
+ * is needed after rows were added, moved or renamed.
+ */
+void view_refilter(GDeviceSetup *gds)
+{
+    GtkTreeModel *model;
+
+    if (!gds->search || !gds->treeview ||
+        !(model = gtk_tree_view_get_model(gds->treeview)) ||
+        !GTK_IS_TREE_MODEL_FILTER(model))
+        return;
+
+    gtk_tree_model_filter_refilter(GTK_TREE_MODEL_FILTER(model));
+    expand_masters(gds);
+}
+
+/**
+ * Show only the devices whose name contains text, ignoring case. NULL or
+ * an empty text shows all of them again. The model is only swapped when
+ * the search starts or ends, while it goes on the filter is kept and
+ * checks the rows again.
+ */
+void view_search(GDeviceSetup *gds, const char *text)
+{
+    gchar *search = (text && *text) ? g_utf8_casefold(text, -1) : NULL;
+    gboolean swap;
+
+    if (g_strcmp0(search, gds->search) == 0)
+    {
+        g_free(search);
+        return;
+    }
+
+    swap = !search || !gds->search;
+    g_free(gds->search);
+    gds->search = search;
+
+    if (!gds->treeview || !gtk_tree_view_get_model(gds->treeview))
+        return;
+
+    if (swap)
+        view_thaw(gds, view_freeze(gds));
+    else
+        view_refilter(gds);
+}
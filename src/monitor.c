@@ -0,0 +1,161 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.  You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* --monitor: raw events per second for each device. An event only bumps
+ * the counter of its source device. A timer moves the counters into a
+ * ring of the last MONITOR_TICKS intervals and updates the rate column
+ * once per interval, so the view is never redrawn per event. */
+
+#include <X11/Xlib.h>
+#include <X11/extensions/XInput2.h>
+#include <gtk/gtk.h>
+#include "gui.h"
+
+/* device ids the server hands out are below this */
+#define MONITOR_SLOTS 256
+
+/* the rate covers one second, updated four times per second */
+#define MONITOR_TICKS 4
+#define MONITOR_INTERVAL (1000 / MONITOR_TICKS)
+
+typedef struct {
+    gint  count;                  /* events since the last tick */
+    guint ring[MONITOR_TICKS];    /* events per interval */
+    guint sum;                    /* of ring */
+} MonitorSlot;
+
+struct _Monitor {
+    GDeviceSetup *gds;
+    guint         timer;
+    int           pos;            /* where the next tick goes in the rings */
+    MonitorSlot   slots[MONITOR_SLOTS];
+};
+
+/**
+ * Count a raw event. Only the counter of its source device is touched.
+ * Events of a MD are copies of those of its SDs and not counted.
+ */
+void monitor_event(Monitor *monitor, XIRawEvent *ev)
+{
+    if (ev->deviceid != ev->sourceid ||
+        ev->sourceid < 0 || ev->sourceid >= MONITOR_SLOTS)
+        return;
+
+    g_atomic_int_inc(&monitor->slots[ev->sourceid].count);
+}
+
+/**
+ * Events per second of device id over the last second.
+ */
+guint monitor_rate(Monitor *monitor, int id)
+{
+    if (id < 0 || id >= MONITOR_SLOTS)
+        return 0;
+
+    return monitor->slots[id].sum;
+}
+
+static void set_rate(GtkTreeModel *model, GtkTreeIter *iter, guint rate)
+{
+    guint shown;
+
+    /* only rows with a new rate are touched */
+    gtk_tree_model_get(model, iter, COL_RATE, &shown, -1);
+    if (shown != rate)
+        gtk_tree_store_set(GTK_TREE_STORE(model), iter, COL_RATE, rate, -1);
+}
+
+/**
+ * Show the rates in the tree store. A MD shows the sum of its SDs.
+ */
+static void update_rates(Monitor *monitor)
+{
+    GtkTreeModel *model;
+    GtkTreeIter iter, child;
+    gboolean valid, child_valid;
+    guint total;
+    int id;
+
+    /* not while view_freeze() has the model off the view */
+    if (!monitor->gds->treeview ||
+        !gtk_tree_view_get_model(monitor->gds->treeview))
+        return;
+
+    model = GTK_TREE_MODEL(monitor->gds->store);
+
+    valid = gtk_tree_model_get_iter_first(model, &iter);
+    while (valid)
+    {
+        total = 0;
+        child_valid = gtk_tree_model_iter_children(model, &child, &iter);
+        while (child_valid)
+        {
+            gtk_tree_model_get(model, &child, COL_ID, &id, -1);
+            if (id >= 0 && id < MONITOR_SLOTS)
+            {
+                total += monitor->slots[id].sum;
+                set_rate(model, &child, monitor->slots[id].sum);
+            }
+            child_valid = gtk_tree_model_iter_next(model, &child);
+        }
+
+        set_rate(model, &iter, total);
+
+        valid = gtk_tree_model_iter_next(model, &iter);
+    }
+}
+
+static gboolean monitor_tick(gpointer data)
+{
+    Monitor *monitor = (Monitor*)data;
+    int i;
+
+    for (i = 0; i < MONITOR_SLOTS; i++)
+    {
+        MonitorSlot *slot = &monitor->slots[i];
+        guint n = g_atomic_int_and((guint*)&slot->count, 0);
+
+        slot->sum += n - slot->ring[monitor->pos];
+        slot->ring[monitor->pos] = n;
+    }
+    monitor->pos = (monitor->pos + 1) % MONITOR_TICKS;
+
+    update_rates(monitor);
+
+    return G_SOURCE_CONTINUE;
+}
+
+/**
+ * Start counting the raw events of all devices.
+ */
+Monitor* monitor_new(GDeviceSetup *gds)
+{
+    Monitor *monitor = g_new0(Monitor, 1);
+
+    monitor->gds = gds;
+    select_raw_events(gds->dpy, TRUE);
+    monitor->timer = g_timeout_add(MONITOR_INTERVAL, monitor_tick, monitor);
+
+    return monitor;
+}
+
+void monitor_free(Monitor *monitor)
+{
+    if (!monitor)
+        return;
+
+    select_raw_events(monitor->gds->dpy, FALSE);
+    g_source_remove(monitor->timer);
+    g_free(monitor);
+}
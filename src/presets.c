@@ -0,0 +1,467 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.  You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "idm.h"
+
+/* Seat-switch presets are key files with one group per preset, the group
+ * name names the preset:
+ *   devices glob patterns for the SD names, or SD ids
+ *   master  name of the MD pair to attach them to, its pointer's or
+ *           keyboard's id, or "Floating"
+ *   hotkey  optional, global hotkey in GTK accelerator syntax, e.g.
+ *           <Control><Alt>1, with the modifiers <Shift>, <Control>,
+ *           <Alt> and <Super>
+ * Applying a preset resolves it against the device cache, so it takes no
+ * server round trips. What's left to change goes out as one
+ * XIChangeHierarchy. */
+
+/* modifiers that don't count for a hotkey */
+#define IGNORED_MODS (LockMask | Mod2Mask)
+
+static void preset_clear(gpointer data)
+{
+    Preset *preset = (Preset*)data;
+
+    g_free(preset->name);
+    g_free(preset->master);
+    g_ptr_array_unref(preset->patterns);
+    g_array_unref(preset->ids);
+    g_array_unref(preset->changes);
+}
+
+/* hotkey modifiers by their GTK accelerator names */
+static const struct {
+    const char *name;
+    guint       mask;
+} modifiers[] = {
+    { "<Shift>",   ShiftMask },
+    { "<Control>", ControlMask },
+    { "<Ctrl>",    ControlMask },
+    { "<Primary>", ControlMask },
+    { "<Alt>",     Mod1Mask },
+    { "<Mod1>",    Mod1Mask },
+    { "<Super>",   Mod4Mask },
+    { "<Mod4>",    Mod4Mask },
+};
+
+/**
+ * Parse a hotkey like gtk_accelerator_parse() would, without needing GTK.
+ * Returns FALSE if val is no hotkey.
+ */
+static gboolean parse_hotkey(const char *val, guint *keysym, guint *mods)
+{
+    KeySym sym, lower, upper;
+    gsize i, len = 0;
+
+    *mods = 0;
+    while (*val == '<')
+    {
+        for (i = 0; i < G_N_ELEMENTS(modifiers); i++)
+        {
+            len = strlen(modifiers[i].name);
+            if (g_ascii_strncasecmp(val, modifiers[i].name, len) == 0)
+                break;
+        }
+        if (i == G_N_ELEMENTS(modifiers))
+            return FALSE;
+
+        *mods |= modifiers[i].mask;
+        val += len;
+    }
+
+    sym = XStringToKeysym(val);
+    if (sym == NoSymbol)
+        return FALSE;
+
+    /* like GTK, keep letters lower case */
+    XConvertCase(sym, &lower, &upper);
+    *keysym = lower;
+
+    return TRUE;
+}
+
+static gboolean preset_parse(GKeyFile *keyfile, const char *group,
+                             Preset *preset, GError **error)
+{
+    gchar **devices, *val, *end;
+    gsize i, ndevices;
+    guint key, mods;
+
+    preset->name = g_strdup(group);
+    preset->patterns = g_ptr_array_new_with_free_func(
+                            (GDestroyNotify)g_pattern_spec_free);
+    preset->ids = g_array_new(FALSE, FALSE, sizeof(int));
+    preset->changes = g_array_new(FALSE, FALSE,
+                                  sizeof(XIAnyHierarchyChangeInfo));
+
+    preset->master = g_key_file_get_string(keyfile, group, "master", error);
+    if (!preset->master)
+        return FALSE;
+
+    devices = g_key_file_get_string_list(keyfile, group, "devices",
+                                         &ndevices, error);
+    if (!devices)
+        return FALSE;
+
+    for (i = 0; i < ndevices; i++)
+    {
+        int id = strtol(devices[i], &end, 10);
+
+        if (*devices[i] && !*end)
+            g_array_append_val(preset->ids, id);
+        else
+            g_ptr_array_add(preset->patterns, g_pattern_spec_new(devices[i]));
+    }
+    g_strfreev(devices);
+
+    val = g_key_file_get_string(keyfile, group, "hotkey", NULL);
+    if (val)
+    {
+        if (!parse_hotkey(val, &key, &mods))
+        {
+            g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                        "[%s]: invalid hotkey '%s'", group, val);
+            g_free(val);
+            return FALSE;
+        }
+        preset->keysym = key;
+        preset->mods = mods;
+    }
+    g_free(val);
+
+    return TRUE;
+}
+
+/**
+ * Load the presets at path. Their hotkeys are grabbed with
+ * presets_grab_keys().
+ */
+gboolean presets_load(GDeviceSetup *gds, const char *path, GError **error)
+{
+    GKeyFile *keyfile;
+    GArray *presets;
+    gchar **groups;
+    int i;
+    gboolean ret = TRUE;
+
+    keyfile = g_key_file_new();
+    if (!g_key_file_load_from_file(keyfile, path, G_KEY_FILE_NONE, error))
+    {
+        g_key_file_free(keyfile);
+        return FALSE;
+    }
+
+    presets = g_array_new(FALSE, TRUE, sizeof(Preset));
+    g_array_set_clear_func(presets, preset_clear);
+
+    groups = g_key_file_get_groups(keyfile, NULL);
+    for (i = 0; ret && groups[i]; i++)
+    {
+        Preset preset = { 0 };
+
+        ret = preset_parse(keyfile, groups[i], &preset, error);
+        g_array_append_val(presets, preset);
+    }
+
+    g_strfreev(groups);
+    g_key_file_free(keyfile);
+
+    if (!ret)
+    {
+        g_array_unref(presets);
+        return FALSE;
+    }
+
+    presets_free(gds);
+    gds->presets = presets;
+
+    return TRUE;
+}
+
+static void grab_key(GDeviceSetup *gds, Preset *preset, gboolean grab)
+{
+    Window root = DefaultRootWindow(gds->dpy);
+    guint extra[] = { 0, LockMask, Mod2Mask, LockMask | Mod2Mask };
+    int i;
+
+    for (i = 0; i < G_N_ELEMENTS(extra); i++)
+    {
+        if (grab)
+            XGrabKey(gds->dpy, preset->keycode, preset->mods | extra[i],
+                     root, False, GrabModeAsync, GrabModeAsync);
+        else
+            XUngrabKey(gds->dpy, preset->keycode, preset->mods | extra[i],
+                       root);
+    }
+}
+
+/**
+ * Grab the hotkeys of the presets on gds->dpy, for presets_key_press().
+ * A hotkey some other client has grabbed already is reported and left
+ * out.
+ */
+void presets_grab_keys(GDeviceSetup *gds)
+{
+    int i;
+
+    if (!gds->presets)
+        return;
+
+    for (i = 0; i < gds->presets->len; i++)
+    {
+        Preset *preset = &g_array_index(gds->presets, Preset, i);
+
+        if (!preset->keysym)
+            continue;
+
+        preset->keycode = XKeysymToKeycode(gds->dpy, preset->keysym);
+        if (!preset->keycode)
+            continue;
+
+        error_trap_push(gds->dpy);
+        grab_key(gds, preset, TRUE);
+        if (error_trap_pop(gds->dpy))
+        {
+            g_printerr("ERROR: Hotkey of preset %s is taken\n", preset->name);
+            grab_key(gds, preset, FALSE);
+            preset->keycode = 0;
+        }
+    }
+}
+
+void presets_free(GDeviceSetup *gds)
+{
+    int i;
+
+    if (!gds->presets)
+        return;
+
+    for (i = 0; gds->dpy && i < gds->presets->len; i++)
+    {
+        Preset *preset = &g_array_index(gds->presets, Preset, i);
+
+        if (preset->keycode)
+            grab_key(gds, preset, FALSE);
+    }
+
+    g_array_unref(gds->presets);
+    gds->presets = NULL;
+}
+
+static gboolean preset_matches(Preset *preset, DeviceEntry *entry)
+{
+    int i;
+
+    for (i = 0; i < preset->ids->len; i++)
+        if (g_array_index(preset->ids, int, i) == entry->id)
+            return TRUE;
+
+    for (i = 0; i < preset->patterns->len; i++)
+        if (g_pattern_match_string(g_ptr_array_index(preset->patterns, i),
+                                   entry->name))
+            return TRUE;
+
+    return FALSE;
+}
+
+/**
+ * Find the MD pair of the preset, as master pointer and keyboard id.
+ * Both are ID_FLOATING for "Floating".
+ */
+static gboolean find_masters(GDeviceSetup *gds, Preset *preset,
+                             int *pointer, int *keyboard, GError **error)
+{
+    DeviceEntry *entry;
+    gchar *name, *end;
+    int id;
+
+    *pointer = *keyboard = 0;
+
+    if (strcmp(preset->master, PROFILE_FLOATING) == 0)
+    {
+        *pointer = *keyboard = ID_FLOATING;
+        return TRUE;
+    }
+
+    id = strtol(preset->master, &end, 10);
+    entry = (*preset->master && !*end) ? cache_lookup(gds, id) : NULL;
+    if (entry && entry->use == XIMasterPointer)
+    {
+        *pointer = entry->id;
+        *keyboard = entry->attachment;
+    } else if (entry && entry->use == XIMasterKeyboard)
+    {
+        *pointer = entry->attachment;
+        *keyboard = entry->id;
+    } else
+    {
+        name = g_strdup_printf("%s pointer", preset->master);
+        *pointer = cache_find_master(gds, name);
+        g_free(name);
+        name = g_strdup_printf("%s keyboard", preset->master);
+        *keyboard = cache_find_master(gds, name);
+        g_free(name);
+    }
+
+    if (!*pointer || !*keyboard)
+    {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                    "Preset %s: no MD pair %s", preset->name, preset->master);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/**
+ * Fill preset->changes with the changes that take its SDs where they
+ * belong. SDs that are there already are left out.
+ */
+static gboolean preset_build(GDeviceSetup *gds, Preset *preset,
+                             GError **error)
+{
+    GHashTableIter it;
+    DeviceEntry *entry;
+    XIAnyHierarchyChangeInfo c;
+    int pointer, keyboard, md;
+
+    g_array_set_size(preset->changes, 0);
+
+    if (!find_masters(gds, preset, &pointer, &keyboard, error))
+        return FALSE;
+
+    g_hash_table_iter_init(&it, gds->devices);
+    while (g_hash_table_iter_next(&it, NULL, (gpointer*)&entry))
+    {
+        if (entry->use != XISlavePointer && entry->use != XISlaveKeyboard &&
+            entry->use != XIFloatingSlave)
+            continue;
+        if (is_xtest_device(entry->name) || !preset_matches(preset, entry))
+            continue;
+
+        md = cache_entry_is_keyboard(entry) ? keyboard : pointer;
+        if (md == ID_FLOATING)
+        {
+            if (entry->use == XIFloatingSlave)
+                continue;
+            c.detach.type = XIDetachSlave;
+            c.detach.deviceid = entry->id;
+        } else
+        {
+            if (entry->use != XIFloatingSlave && entry->attachment == md)
+                continue;
+            c.attach.type = XIAttachSlave;
+            c.attach.deviceid = entry->id;
+            c.attach.new_master = md;
+        }
+        g_array_append_val(preset->changes, c);
+    }
+
+    return TRUE;
+}
+
+static Preset* find_preset(GDeviceSetup *gds, const char *name)
+{
+    int i;
+
+    for (i = 0; gds->presets && i < gds->presets->len; i++)
+    {
+        Preset *preset = &g_array_index(gds->presets, Preset, i);
+
+        if (strcmp(preset->name, name) == 0)
+            return preset;
+    }
+
+    return NULL;
+}
+
+static gboolean apply(GDeviceSetup *gds, Preset *preset, gboolean wait,
+                      GError **error)
+{
+    HierarchyBatch *pending;
+    gboolean ret = TRUE;
+
+    if (!preset_build(gds, preset, error))
+        return FALSE;
+
+    /* the preset goes out on its own, apart from anything queued */
+    pending = gds->batch;
+    gds->batch = NULL;
+    hierarchy_begin(gds);
+    hierarchy_queue(gds, (XIAnyHierarchyChangeInfo*)preset->changes->data,
+                    preset->changes->len);
+    if (wait)
+        ret = hierarchy_commit(gds);
+    else
+        hierarchy_commit_async(gds, NULL, NULL);
+    gds->batch = pending;
+
+    if (!ret)
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                    "Not all changes of preset %s could be applied",
+                    preset->name);
+
+    return ret;
+}
+
+/**
+ * Apply the preset with the given name. If wait is FALSE, the changes are
+ * sent without waiting for the server, failures are only reported on
+ * stderr.
+ */
+gboolean preset_apply(GDeviceSetup *gds, const char *name, gboolean wait,
+                      GError **error)
+{
+    Preset *preset = find_preset(gds, name);
+
+    if (!preset)
+    {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_NOENT,
+                    "No preset %s", name);
+        return FALSE;
+    }
+
+    return apply(gds, preset, wait, error);
+}
+
+/**
+ * A KeyPress on gds->dpy. Applies the preset whose hotkey it is.
+ * Returns TRUE if it was a hotkey.
+ */
+gboolean presets_key_press(GDeviceSetup *gds, XKeyEvent *ev)
+{
+    GError *error = NULL;
+    int i;
+
+    for (i = 0; gds->presets && i < gds->presets->len; i++)
+    {
+        Preset *preset = &g_array_index(gds->presets, Preset, i);
+
+        if (!preset->keycode || preset->keycode != ev->keycode ||
+            preset->mods != (ev->state & ~IGNORED_MODS))
+            continue;
+
+        g_debug("Hotkey for preset %s", preset->name);
+        if (!apply(gds, preset, FALSE, &error))
+        {
+            g_printerr("ERROR: %s\n", error->message);
+            g_clear_error(&error);
+        }
+        return TRUE;
+    }
+
+    return FALSE;
+}
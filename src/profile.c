@@ -0,0 +1,383 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.  You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <string.h>
+#include "idm.h"
+
+/* Profiles are key files with one group per MD pair, named like the pair
+ * without the " pointer"/" keyboard" suffix. The "devices" key lists the
+ * glob patterns of the SDs that belong to the pair. SDs matching the
+ * "Floating" group are set floating. */
+#define PROFILE_KEY_DEVICES "devices"
+
+typedef struct {
+    const gchar  *master;   /* profile group, owned by the group list */
+    GPatternSpec *pattern;
+} ProfileRule;
+
+/**
+ * Name of the MD pair a MD belongs to, i.e. the name without the
+ * " pointer" or " keyboard" suffix. Free with g_free().
+ */
+gchar* master_pair_name(const char *name)
+{
+    if (g_str_has_suffix(name, " pointer"))
+        return g_strndup(name, strlen(name) - strlen(" pointer"));
+    if (g_str_has_suffix(name, " keyboard"))
+        return g_strndup(name, strlen(name) - strlen(" keyboard"));
+
+    return g_strdup(name);
+}
+
+/**
+ * The XTEST devices are bound to their MD and can't be moved.
+ */
+gboolean is_xtest_device(const char *name)
+{
+    return g_str_has_suffix(name, "XTEST pointer") ||
+           g_str_has_suffix(name, "XTEST keyboard");
+}
+
+static void profile_add(GKeyFile *keyfile, const char *group,
+                        const char *device)
+{
+    gchar **devices;
+    gsize ndevices = 0;
+
+    devices = g_key_file_get_string_list(keyfile, group, PROFILE_KEY_DEVICES,
+                                         &ndevices, NULL);
+    if (device)
+    {
+        devices = g_renew(gchar*, devices, ndevices + 2);
+        devices[ndevices++] = g_strdup(device);
+        devices[ndevices] = NULL;
+    }
+    g_key_file_set_string_list(keyfile, group, PROFILE_KEY_DEVICES,
+                               (const gchar * const *)devices, ndevices);
+    g_strfreev(devices);
+}
+
+static gboolean profile_write(GKeyFile *keyfile, const char *path,
+                              GError **error)
+{
+    gchar *data;
+    gsize len;
+    gboolean ret;
+
+    g_key_file_set_comment(keyfile, NULL, NULL,
+                           " input-device-manager profile", NULL);
+    data = g_key_file_to_data(keyfile, &len, NULL);
+    ret = g_file_set_contents(path, data, len, error);
+    g_free(data);
+
+    return ret;
+}
+
+/**
+ * Save the hierarchy as shown in the tree store as profile. gds->shown has
+ * every row of it, so this doesn't need the store itself.
+ */
+gboolean profile_save_tree(GDeviceSetup *gds, const char *path,
+                           GError **error)
+{
+    const DeviceRecord *rec, *master;
+    GKeyFile *keyfile;
+    const gchar *name;
+    gchar *group;
+    guint i;
+    gboolean ret;
+
+    keyfile = g_key_file_new();
+
+    /* empty MDs are saved too, so they get created */
+    for (i = 0; i < gds->shown->records->len; i++)
+    {
+        rec = &g_array_index(gds->shown->records, DeviceRecord, i);
+        if (rec->use != XIMasterPointer && rec->use != XIMasterKeyboard)
+            continue;
+
+        group = master_pair_name(device_list_name(gds->shown, rec));
+        profile_add(keyfile, group, NULL);
+        g_free(group);
+    }
+    profile_add(keyfile, PROFILE_FLOATING, NULL);
+
+    for (i = 0; i < gds->shown->records->len; i++)
+    {
+        rec = &g_array_index(gds->shown->records, DeviceRecord, i);
+        name = device_list_name(gds->shown, rec);
+        if (rec->use == XIMasterPointer || rec->use == XIMasterKeyboard ||
+            is_xtest_device(name))
+            continue;
+
+        master = (rec->use == XIFloatingSlave) ? NULL :
+                 device_list_find(gds->shown, rec->attachment);
+        if (rec->use != XIFloatingSlave && !master)
+            continue;
+
+        group = master ? master_pair_name(device_list_name(gds->shown, master)) :
+                         g_strdup(PROFILE_FLOATING);
+        profile_add(keyfile, group, name);
+        g_free(group);
+    }
+
+    ret = profile_write(keyfile, path, error);
+    g_key_file_free(keyfile);
+
+    return ret;
+}
+
+/**
+ * Save the hierarchy as the server has it as profile. For when there is no
+ * tree store.
+ */
+gboolean profile_save_devices(GDeviceSetup *gds, const char *path,
+                              GError **error)
+{
+    XIDeviceInfo *devices, *dev;
+    GHashTable *groups; /* MD id -> group */
+    GKeyFile *keyfile;
+    const gchar *group;
+    int ndevices;
+    int i;
+    gboolean ret;
+
+    keyfile = g_key_file_new();
+    groups = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+
+    devices = query_device_info(gds->dpy, XIAllDevices, &ndevices);
+    for (i = 0; i < ndevices; i++)
+    {
+        dev = &devices[i];
+        if (dev->use == XIMasterPointer || dev->use == XIMasterKeyboard)
+        {
+            gchar *pair = master_pair_name(dev->name);
+
+            profile_add(keyfile, pair, NULL);
+            g_hash_table_insert(groups, GINT_TO_POINTER(dev->deviceid), pair);
+        }
+    }
+
+    for (i = 0; i < ndevices; i++)
+    {
+        dev = &devices[i];
+        if (dev->use == XIMasterPointer || dev->use == XIMasterKeyboard ||
+            is_xtest_device(dev->name))
+            continue;
+
+        if (dev->use == XIFloatingSlave)
+            group = PROFILE_FLOATING;
+        else
+            group = g_hash_table_lookup(groups,
+                                        GINT_TO_POINTER(dev->attachment));
+        if (group)
+            profile_add(keyfile, group, dev->name);
+    }
+    free_device_info(devices);
+
+    ret = profile_write(keyfile, path, error);
+    g_hash_table_destroy(groups);
+    g_key_file_free(keyfile);
+
+    return ret;
+}
+
+static void rule_clear(gpointer data)
+{
+    ProfileRule *rule = (ProfileRule*)data;
+
+    g_pattern_spec_free(rule->pattern);
+}
+
+/**
+ * Match name against the profile rules.
+ * Returns the profile group the device belongs to, or NULL.
+ */
+static const gchar* profile_match(GArray *rules, const char *name)
+{
+    int i;
+
+    for (i = 0; i < rules->len; i++)
+    {
+        ProfileRule *rule = &g_array_index(rules, ProfileRule, i);
+
+        if (g_pattern_match_string(rule->pattern, name))
+            return rule->master;
+    }
+
+    return NULL;
+}
+
+/**
+ * Queue the changes needed to get the SDs in devices to where the profile
+ * wants them. SDs for MDs that don't exist yet are skipped.
+ */
+static void profile_attach_slaves(GDeviceSetup *gds, GArray *rules,
+                                  XIDeviceInfo *devices, int ndevices)
+{
+    XIDeviceInfo *dev;
+    GHashTable *masters; /* MD name -> MD id */
+    const gchar *group;
+    gchar *name;
+    int i, id;
+
+    masters = g_hash_table_new(g_str_hash, g_str_equal);
+    for (i = 0; i < ndevices; i++)
+    {
+        dev = &devices[i];
+        if (dev->use == XIMasterPointer || dev->use == XIMasterKeyboard)
+            g_hash_table_insert(masters, dev->name,
+                                GINT_TO_POINTER(dev->deviceid));
+    }
+
+    for (i = 0; i < ndevices; i++)
+    {
+        dev = &devices[i];
+        if (dev->use == XIMasterPointer || dev->use == XIMasterKeyboard ||
+            is_xtest_device(dev->name))
+            continue;
+
+        group = profile_match(rules, dev->name);
+        if (!group)
+            continue;
+
+        if (strcmp(group, PROFILE_FLOATING) == 0)
+        {
+            if (dev->use != XIFloatingSlave)
+                float_device(gds, dev->deviceid);
+            continue;
+        }
+
+        name = g_strdup_printf("%s %s", group,
+                               is_keyboard_slave(dev) ? "keyboard" : "pointer");
+        id = GPOINTER_TO_INT(g_hash_table_lookup(masters, name));
+        g_free(name);
+
+        if (id && (dev->use == XIFloatingSlave || dev->attachment != id))
+            change_attachment(gds, dev->deviceid, id);
+    }
+
+    g_hash_table_destroy(masters);
+}
+
+/**
+ * Apply the profile at path. MDs that are in the profile but not on the
+ * server are created, MDs not in the profile are removed and SDs are
+ * moved to the MD of the first pattern they match. All this happens in
+ * one request, unless MDs had to be created, in which case their SDs
+ * follow in a second one.
+ * The changes are applied right away, even within hierarchy_begin().
+ */
+gboolean profile_apply(GDeviceSetup *gds, const char *path,
+                       GError **error)
+{
+    GKeyFile *keyfile;
+    GArray *rules;
+    HierarchyBatch *pending;
+    XIDeviceInfo *devices, *dev;
+    gchar **groups, **patterns;
+    gchar *pair;
+    gboolean created = FALSE;
+    gboolean ret;
+    int ndevices;
+    int i, j;
+
+    keyfile = g_key_file_new();
+    if (!g_key_file_load_from_file(keyfile, path, G_KEY_FILE_NONE, error))
+    {
+        g_key_file_free(keyfile);
+        return FALSE;
+    }
+
+    /* compile all patterns up front, in the order of the file */
+    rules = g_array_new(FALSE, FALSE, sizeof(ProfileRule));
+    g_array_set_clear_func(rules, rule_clear);
+    groups = g_key_file_get_groups(keyfile, NULL);
+    for (i = 0; groups[i]; i++)
+    {
+        patterns = g_key_file_get_string_list(keyfile, groups[i],
+                                              PROFILE_KEY_DEVICES, NULL, NULL);
+        for (j = 0; patterns && patterns[j]; j++)
+        {
+            ProfileRule rule = { groups[i], g_pattern_spec_new(patterns[j]) };
+            g_array_append_val(rules, rule);
+        }
+        g_strfreev(patterns);
+    }
+
+    pending = gds->batch;
+    gds->batch = NULL;
+
+    devices = query_device_info(gds->dpy, XIAllDevices, &ndevices);
+
+    hierarchy_begin(gds);
+    for (i = 0; groups[i]; i++)
+    {
+        gchar *name;
+        gboolean exists = FALSE;
+
+        if (strcmp(groups[i], PROFILE_FLOATING) == 0)
+            continue;
+
+        name = g_strdup_printf("%s pointer", groups[i]);
+        for (j = 0; j < ndevices && !exists; j++)
+            exists = (devices[j].use == XIMasterPointer &&
+                      strcmp(devices[j].name, name) == 0);
+        g_free(name);
+
+        if (!exists)
+        {
+            create_master(gds, groups[i]);
+            created = TRUE;
+        }
+    }
+
+    for (i = 0; i < ndevices; i++)
+    {
+        dev = &devices[i];
+        if (dev->use != XIMasterPointer || dev->deviceid == 2) /* VCP */
+            continue;
+
+        pair = master_pair_name(dev->name);
+        if (!g_key_file_has_group(keyfile, pair))
+            remove_master(gds, dev->deviceid);
+        g_free(pair);
+    }
+
+    profile_attach_slaves(gds, rules, devices, ndevices);
+    ret = hierarchy_commit(gds);
+    free_device_info(devices);
+
+    /* the new MDs have ids now */
+    if (created)
+    {
+        devices = query_device_info(gds->dpy, XIAllDevices, &ndevices);
+        hierarchy_begin(gds);
+        profile_attach_slaves(gds, rules, devices, ndevices);
+        ret = hierarchy_commit(gds) && ret;
+        free_device_info(devices);
+    }
+
+    gds->batch = pending;
+
+    g_array_unref(rules);
+    g_strfreev(groups);
+    g_key_file_free(keyfile);
+
+    if (!ret)
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                    "Not all changes in %s could be applied", path);
+
+    return ret;
+}
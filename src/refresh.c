@@ -0,0 +1,389 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.  You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* Keeping the tree store in line with the server. xi.c hands the events
+ * over through gds->view, changes are applied to the rows right away
+ * where the event says enough, new devices are queried with the next
+ * refresh. Nothing in here is needed without the GUI. */
+
+#include <X11/Xlib.h>
+#include <X11/extensions/XInput2.h>
+#include <gtk/gtk.h>
+#include <gdk/gdkx.h>
+#include "gui.h"
+#include "stats.h"
+
+/* re-query everything rather than this many devices one by one */
+#define REQUERY_MAX 8
+
+/* full refreshes of more devices than this run with the model off the
+ * view */
+#define DETACH_MIN 256
+
+static void requery_devices(GDeviceSetup *gds);
+
+static gboolean refresh_timeout(gpointer data)
+{
+    GDeviceSetup *gds = (GDeviceSetup*)data;
+
+    gds->refresh_source = 0;
+    if (gds->dirty_all || g_hash_table_size(gds->dirty) > REQUERY_MAX)
+        query_devices(gds);
+    else
+        requery_devices(gds);
+
+    return FALSE;
+}
+
+static void start_refresh_timer(GDeviceSetup *gds)
+{
+    if (gds->refresh_source)
+        return;
+
+    if (gds->refresh_delay > 0)
+        gds->refresh_source = g_timeout_add(gds->refresh_delay,
+                                            refresh_timeout, gds);
+    else
+        gds->refresh_source = g_idle_add(refresh_timeout, gds);
+}
+
+/**
+ * Mark the tree store as dirty. The actual refresh happens once
+ * gds->refresh_delay ms after the first change, so a burst of changes
+ * costs only one query_devices().
+ */
+static void schedule_refresh(GDeviceSetup *gds)
+{
+    gds->dirty_all = TRUE;
+    start_refresh_timer(gds);
+}
+
+/**
+ * Mark a single device as dirty. Like schedule_refresh(), but the refresh
+ * only queries the devices marked.
+ */
+static void schedule_requery(GDeviceSetup *gds, int id)
+{
+    g_hash_table_add(gds->dirty, GINT_TO_POINTER(id));
+    start_refresh_timer(gds);
+}
+
+/**
+ * The tree store holds all devices for the first time since
+ * gds->fill_start was set.
+ */
+static void tree_filled(GDeviceSetup *gds)
+{
+    if (!gds->fill_start)
+        return;
+
+    stats_end(STAT_STARTUP_FILL, gds->fill_start);
+    gds->fill_start = 0;
+}
+
+/**
+ * Bring the tree store in line with a query of all devices. props as for
+ * cache_update_all().
+ */
+static void apply_all_devices(GDeviceSetup *gds, GtkTreeStore *treestore,
+                              XIDeviceInfo *devices, int ndevices,
+                              const DeviceProps *props)
+{
+    ViewState *state = NULL;
+
+    cache_update_all(gds, devices, ndevices, props);
+    if (gds->treeview && ndevices > DETACH_MIN)
+        state = view_freeze(gds);
+    reconcile_devices(gds, treestore, devices, ndevices);
+    if (state)
+        view_thaw(gds, state);
+}
+
+/**
+ * Update the rows of the n devices in ids, infos[i] is NULL if ids[i] is
+ * gone. props as for cache_update_all().
+ */
+static void apply_devices(GDeviceSetup *gds, GtkTreeStore *treestore,
+                          const int *ids, XIDeviceInfo **infos, int n,
+                          const DeviceProps *props)
+{
+    gint64 start;
+    int i;
+
+    cache_update_devices(gds, infos, n, props);
+    start = stats_start();
+
+    for (i = 0; i < n; i++)
+    {
+        if (!infos[i])
+        {
+            g_debug("Device %d is gone", ids[i]);
+            cache_remove(gds, ids[i]);
+            remove_row(gds, treestore, ids[i]);
+        }
+    }
+
+    if (!update_devices(gds, treestore, infos, n))
+        schedule_refresh(gds);
+
+    stats_end(STAT_REQUERY, start);
+
+    /* rows removed here may have left their SDs to query */
+    if (g_hash_table_size(gds->dirty) > 0)
+        start_refresh_timer(gds);
+}
+
+/**
+ * Build data storage by querying the X server for all input devices.
+ * Can be called multiple times, in which case it'll clean out and re-fill
+ * update the tree store. With the I/O worker, the tree store is only
+ * updated once its snapshot is in, see apply_snapshot().
+ */
+GtkTreeStore* query_devices(GDeviceSetup* gds)
+{
+    GtkTreeStore *treestore;
+    XIDeviceInfo *devices;
+    int ndevices;
+
+    if (!gds->treeview)
+        treestore = tree_store_new(gds);
+    else
+        treestore = gds->store;
+
+    /* this run picks up everything that was marked dirty */
+    gds->dirty_all = FALSE;
+    g_hash_table_remove_all(gds->dirty);
+
+    if (gds->worker && gds->treeview)
+    {
+        worker_query_all(gds->worker);
+        return treestore;
+    }
+
+    devices = query_device_info(gds->dpy, XIAllDevices, &ndevices);
+    apply_all_devices(gds, treestore, devices, ndevices, NULL);
+    free_device_info(devices);
+    if (gds->treeview)
+        tree_filled(gds);
+
+    if (gds->hierarchy_changed)
+        gds->hierarchy_changed(gds, gds->hierarchy_changed_data);
+
+    return treestore;
+}
+
+/**
+ * Query only the devices marked with schedule_requery() and update their
+ * rows. Devices that no longer exist have their rows removed.
+ */
+static void requery_devices(GDeviceSetup *gds)
+{
+    GtkTreeStore *treestore;
+    GHashTable *dirty;
+    GHashTableIter it;
+    gpointer key;
+    GArray *ids;
+    GPtrArray *infos;
+
+    if (!gds->treeview)
+        return;
+
+    treestore = gds->store;
+
+    /* removing rows below may mark more devices dirty, these are left for
+     * the next refresh */
+    dirty = gds->dirty;
+    gds->dirty = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+    ids = g_array_sized_new(FALSE, FALSE, sizeof(int), g_hash_table_size(dirty));
+    g_hash_table_iter_init(&it, dirty);
+    while (g_hash_table_iter_next(&it, &key, NULL))
+    {
+        int id = GPOINTER_TO_INT(key);
+        g_array_append_val(ids, id);
+    }
+    g_hash_table_destroy(dirty);
+
+    if (gds->worker)
+    {
+        worker_query_ids(gds->worker, (int*)ids->data, ids->len);
+        g_array_unref(ids);
+        return;
+    }
+
+    infos = g_ptr_array_new_with_free_func((GDestroyNotify)free_device_info);
+    g_ptr_array_set_size(infos, ids->len);
+    query_devices_by_id(gds->dpy, (int*)ids->data, ids->len,
+                        (XIDeviceInfo**)infos->pdata);
+    apply_devices(gds, treestore, (int*)ids->data,
+                  (XIDeviceInfo**)infos->pdata, ids->len, NULL);
+
+    g_ptr_array_unref(infos);
+    g_array_unref(ids);
+}
+
+/**
+ * A snapshot from the I/O worker is in. Update the tree store from it, as
+ * query_devices() or requery_devices() would have.
+ */
+void apply_snapshot(GDeviceSetup *gds, DeviceSnapshot *snap)
+{
+    GtkTreeStore *treestore;
+    int i;
+
+    if (!gds->treeview)
+        return;
+
+    treestore = gds->store;
+
+    if (snap->all)
+    {
+        apply_all_devices(gds, treestore, snap->devices, snap->ndevices,
+                          snap->props);
+        tree_filled(gds);
+    } else
+        apply_devices(gds, treestore, snap->ids, snap->infos, snap->n,
+                      snap->props);
+
+    /* events handled since the query may be newer than what it saw, ask
+     * again */
+    if (snap->events != gds->events)
+    {
+        if (snap->all)
+            schedule_refresh(gds);
+        else
+            for (i = 0; i < snap->n; i++)
+                schedule_requery(gds, snap->ids[i]);
+    }
+
+    if (gds->hierarchy_changed)
+        gds->hierarchy_changed(gds, gds->hierarchy_changed_data);
+}
+
+/**
+ * Apply an XI_HierarchyChanged event to the tree store, the cache has it
+ * already. Attachment changes and removals are applied right away, all
+ * the event tells us about new devices is the id, so these are queried in
+ * the next refresh.
+ */
+static void view_hierarchy_event(GDeviceSetup *gds, XIHierarchyEvent *ev)
+{
+    GtkTreeStore *treestore = gds->store;
+    XIHierarchyInfo *info;
+    gint64 start;
+    int i;
+
+    if (!gds->treeview)
+        return;
+
+    start = stats_start();
+
+    /* SD changes first, so SDs are out of the way of removed MDs */
+    for (i = 0; i < ev->num_info; i++)
+    {
+        info = &ev->info[i];
+
+        if (info->use == XIMasterPointer || info->use == XIMasterKeyboard)
+        {
+            if (info->flags & XIMasterAdded)
+                schedule_requery(gds, info->deviceid);
+            continue;
+        }
+
+        if (info->flags & XISlaveRemoved)
+            remove_row(gds, treestore, info->deviceid);
+        else if (info->flags & XISlaveAdded)
+            schedule_requery(gds, info->deviceid);
+        else if (info->flags & (XISlaveAttached | XISlaveDetached))
+        {
+            g_debug("SD %d now on %d", info->deviceid, info->attachment);
+            if (!update_row(gds, treestore, info->deviceid, NULL,
+                            info->use, info->attachment))
+                schedule_requery(gds, info->deviceid);
+        }
+    }
+
+    for (i = 0; i < ev->num_info; i++)
+    {
+        info = &ev->info[i];
+        if (info->flags & XIMasterRemoved)
+            remove_row(gds, treestore, info->deviceid);
+    }
+    view_refilter(gds);
+
+    stats_end(STAT_EVENT, start);
+
+    if (g_hash_table_size(gds->dirty) > 0)
+        start_refresh_timer(gds);
+}
+
+/**
+ * A property of device id changed. If the cache holds it, fetch it again
+ * with the device's next refresh.
+ */
+static void view_property_event(GDeviceSetup *gds, int id)
+{
+    if (gds->worker)
+        worker_invalidate(gds->worker, id);
+    if (gds->treeview && cache_lookup(gds, id))
+        schedule_requery(gds, id);
+}
+
+static void view_raw_event(GDeviceSetup *gds, XIRawEvent *ev)
+{
+    if (gds->monitor)
+        monitor_event(gds->monitor, ev);
+}
+
+static const ViewFuncs view_funcs = {
+    view_hierarchy_event,
+    view_property_event,
+    view_raw_event
+};
+
+/**
+ * Have the events of gds keep the tree store up to date.
+ */
+void refresh_init(GDeviceSetup *gds)
+{
+    gds->view = &view_funcs;
+}
+
+/**
+ * Use GDK's connection instead of one of our own. GDK has already
+ * negotiated its XI 2 version on it, so only check GDK uses XI 2 at all.
+ */
+Display* dpy_init_shared(GdkDisplay *display, int *xi_opcode)
+{
+    if (!GDK_IS_X11_DEVICE_MANAGER_XI2(gdk_display_get_device_manager(display)))
+        return NULL;
+
+    return dpy_init_existing(gdk_x11_display_get_xdisplay(display),
+                             xi_opcode);
+}
+
+/**
+ * Events on GDK's connection when sharing it. GDK has already fetched the
+ * event data and needs the events itself too.
+ */
+GdkFilterReturn xi_event_filter(GdkXEvent *xevent, GdkEvent *event,
+                                gpointer data)
+{
+    GDeviceSetup *gds = (GDeviceSetup*)data;
+
+    if (xi_filter_event(gds, (XEvent*)xevent))
+        return GDK_FILTER_REMOVE;
+
+    return GDK_FILTER_CONTINUE;
+}
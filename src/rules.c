@@ -0,0 +1,228 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.  You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "idm.h"
+
+/* Auto-attach rules are key files with one group per rule. All keys but
+ * "master" are optional, a SD has to match all keys given:
+ *   name    glob pattern for the device name
+ *   regex   regular expression for the device name
+ *   product vendor:product id in hex, e.g. 046d:c52b
+ *   use     "pointer" or "keyboard"
+ *   master  name of the MD pair to attach to, or "Floating"
+ * The first matching rule wins. */
+
+static void attach_rule_clear(gpointer data)
+{
+    AttachRule *rule = (AttachRule*)data;
+
+    g_free(rule->master);
+    if (rule->glob)
+        g_pattern_spec_free(rule->glob);
+    if (rule->regex)
+        g_regex_unref(rule->regex);
+}
+
+/**
+ * Compile the rule in the given group. On failure, rule may be partially
+ * filled in and still needs clearing.
+ */
+static gboolean rule_parse(GKeyFile *keyfile, const char *group,
+                           AttachRule *rule, GError **error)
+{
+    gchar *val;
+    gboolean ret = TRUE;
+
+    rule->master = g_key_file_get_string(keyfile, group, "master", error);
+    if (!rule->master)
+        return FALSE;
+
+    val = g_key_file_get_string(keyfile, group, "name", NULL);
+    if (val)
+        rule->glob = g_pattern_spec_new(val);
+    g_free(val);
+
+    val = g_key_file_get_string(keyfile, group, "regex", NULL);
+    if (val)
+    {
+        rule->regex = g_regex_new(val, G_REGEX_OPTIMIZE, 0, error);
+        g_free(val);
+        if (!rule->regex)
+            return FALSE;
+    }
+
+    val = g_key_file_get_string(keyfile, group, "product", NULL);
+    if (val && sscanf(val, "%x:%x", &rule->vendor, &rule->product) != 2)
+    {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                    "[%s]: invalid product '%s'", group, val);
+        ret = FALSE;
+    }
+    g_free(val);
+    if (!ret)
+        return FALSE;
+
+    val = g_key_file_get_string(keyfile, group, "use", NULL);
+    if (val && strcmp(val, "pointer") == 0)
+        rule->use = XISlavePointer;
+    else if (val && strcmp(val, "keyboard") == 0)
+        rule->use = XISlaveKeyboard;
+    else if (val)
+    {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                    "[%s]: invalid use '%s'", group, val);
+        ret = FALSE;
+    }
+    g_free(val);
+
+    return ret;
+}
+
+/**
+ * Load and compile the auto-attach rules at path.
+ */
+gboolean rules_load(GDeviceSetup *gds, const char *path, GError **error)
+{
+    GKeyFile *keyfile;
+    GArray *rules;
+    gchar **groups;
+    int i;
+    gboolean ret = TRUE;
+
+    keyfile = g_key_file_new();
+    if (!g_key_file_load_from_file(keyfile, path, G_KEY_FILE_NONE, error))
+    {
+        g_key_file_free(keyfile);
+        return FALSE;
+    }
+
+    rules = g_array_new(FALSE, TRUE, sizeof(AttachRule));
+    g_array_set_clear_func(rules, attach_rule_clear);
+
+    groups = g_key_file_get_groups(keyfile, NULL);
+    for (i = 0; ret && groups[i]; i++)
+    {
+        AttachRule rule = { 0 };
+
+        ret = rule_parse(keyfile, groups[i], &rule, error);
+        g_array_append_val(rules, rule);
+    }
+
+    g_strfreev(groups);
+    g_key_file_free(keyfile);
+
+    if (!ret)
+    {
+        g_array_unref(rules);
+        return FALSE;
+    }
+
+    if (gds->rules)
+        g_array_unref(gds->rules);
+    gds->rules = rules;
+
+    return TRUE;
+}
+
+/**
+ * Find the first rule for dev. entry is dev's cache entry, for its
+ * "Device Product ID", or NULL.
+ */
+static AttachRule* rules_match(GDeviceSetup *gds, XIDeviceInfo *dev,
+                               DeviceEntry *entry)
+{
+    int i;
+    int use;
+
+    use = is_keyboard_slave(dev) ? XISlaveKeyboard : XISlavePointer;
+
+    for (i = 0; i < gds->rules->len; i++)
+    {
+        AttachRule *rule = &g_array_index(gds->rules, AttachRule, i);
+
+        if (rule->use && rule->use != use)
+            continue;
+        if (rule->glob && !g_pattern_match_string(rule->glob, dev->name))
+            continue;
+        if (rule->regex && !g_regex_match(rule->regex, dev->name, 0, NULL))
+            continue;
+        if ((rule->vendor || rule->product) &&
+            (!entry || !entry->have_product ||
+             rule->vendor != entry->vendor || rule->product != entry->product))
+            continue;
+
+        return rule;
+    }
+
+    return NULL;
+}
+
+/**
+ * Move newly added SDs to the MD their rule asks for. All moves go out in
+ * one request, right away even within hierarchy_begin().
+ */
+void rules_apply(GDeviceSetup *gds, GArray *ids)
+{
+    HierarchyBatch *pending;
+    XIDeviceInfo **devs, *dev;
+    AttachRule *rule;
+    gchar *name;
+    int i, id;
+
+    /* the queries and property fetches for all devices go out at once,
+     * the properties end up in the cache */
+    devs = g_new0(XIDeviceInfo*, ids->len);
+    query_devices_by_id(gds->dpy, (int*)ids->data, ids->len, devs);
+    cache_update_devices(gds, devs, ids->len, NULL);
+
+    pending = gds->batch;
+    gds->batch = NULL;
+    hierarchy_begin(gds);
+
+    for (i = 0; i < ids->len; i++)
+    {
+        dev = devs[i];
+        if (!dev)
+            continue;
+
+        rule = is_xtest_device(dev->name) ? NULL :
+               rules_match(gds, dev, cache_lookup(gds, dev->deviceid));
+        if (rule && strcmp(rule->master, PROFILE_FLOATING) == 0)
+        {
+            if (dev->use != XIFloatingSlave)
+                float_device(gds, dev->deviceid);
+        } else if (rule)
+        {
+            name = g_strdup_printf("%s %s", rule->master,
+                                   is_keyboard_slave(dev) ? "keyboard" : "pointer");
+            id = cache_find_master(gds, name);
+            g_free(name);
+
+            if (id && (dev->use == XIFloatingSlave || dev->attachment != id))
+            {
+                g_debug("Auto-attaching %d to %d\n", dev->deviceid, id);
+                change_attachment(gds, dev->deviceid, id);
+            }
+        }
+
+        free_device_info(dev);
+    }
+
+    g_free(devs);
+
+    hierarchy_commit(gds);
+    gds->batch = pending;
+}
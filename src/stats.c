@@ -0,0 +1,348 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.  You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* Opt-in timing of server requests and tree store updates. Everything
+ * here is a no-op until stats_init() was called. */
+
+#include <glib-unix.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#include "stats.h"
+
+/* Samples are counted in log-linear buckets, four per power of two, so a
+ * percentile is off by less than a quarter of its value. */
+#define SUB_BUCKETS 4
+#define NUM_BUCKETS (64 * SUB_BUCKETS)
+
+typedef struct {
+    guint64 count;
+    gint64  sum;
+    gint64  min;
+    gint64  max;
+    guint64 buckets[NUM_BUCKETS];
+} Histogram;
+
+static const char *phase_names[NUM_STAT_PHASES] = {
+    "query",
+    "property",
+    "reconcile",
+    "requery",
+    "event",
+    "hierarchy",
+    "hierarchy-async",
+    "startup-paint",
+    "startup-fill",
+};
+
+static const char *counter_names[NUM_STAT_COUNTERS] = {
+    "rows-inserted",
+    "rows-removed",
+    "rows-moved",
+    "names-interned",
+    "name-bytes",
+};
+
+/* Memory use of the process, in bytes. 0 where unknown. */
+typedef struct {
+    guint64 rss;        /* resident set size */
+    guint64 heap;       /* allocated with malloc() and still in use */
+} MemoryUse;
+
+static gboolean enabled;
+static FILE *json;          /* JSON lines go here, or NULL */
+static gchar *server;       /* "vendor release", or NULL */
+static Histogram histograms[NUM_STAT_PHASES];
+static guint64 counters[NUM_STAT_COUNTERS];
+
+/* samples come from the I/O worker too */
+G_LOCK_DEFINE_STATIC(stats);
+
+static int bucket_index(gint64 us)
+{
+    int bits;
+
+    if (us < SUB_BUCKETS)
+        return MAX(us, 0);
+
+    /* the top three bits pick the bucket within the power of two */
+    bits = g_bit_storage(us);
+    return (bits - 2) * SUB_BUCKETS + (us >> (bits - 3)) - SUB_BUCKETS;
+}
+
+/**
+ * Largest value that goes into bucket i.
+ */
+static gint64 bucket_upper(int i)
+{
+    int bits;
+    gint64 m;
+
+    if (i < SUB_BUCKETS)
+        return i;
+
+    bits = i / SUB_BUCKETS + 2;
+    m = i % SUB_BUCKETS + SUB_BUCKETS;
+    return ((m + 1) << (bits - 3)) - 1;
+}
+
+static gint64 percentile(Histogram *h, int p)
+{
+    guint64 target, seen = 0;
+    int i;
+
+    if (h->count == 0)
+        return 0;
+
+    target = (h->count * p + 99) / 100;
+    for (i = 0; i < NUM_BUCKETS; i++)
+    {
+        seen += h->buckets[i];
+        if (seen >= target)
+            return MIN(bucket_upper(i), h->max);
+    }
+
+    return h->max;
+}
+
+static gboolean on_sigusr1(gpointer data)
+{
+    stats_dump();
+    return G_SOURCE_CONTINUE;
+}
+
+/**
+ * Start collecting. With json_path, every sample is also written to that
+ * file as a JSON line, "-" is stdout.
+ */
+void stats_init(const char *json_path)
+{
+    if (enabled)
+        return;
+
+    enabled = TRUE;
+
+    if (json_path && strcmp(json_path, "-") == 0)
+        json = stdout;
+    else if (json_path)
+    {
+        json = fopen(json_path, "a");
+        if (!json)
+            g_printerr("ERROR: Cannot open %s for statistics\n", json_path);
+    }
+
+    g_unix_signal_add(SIGUSR1, on_sigusr1, NULL);
+}
+
+/**
+ * Note which X server the numbers are for.
+ */
+void stats_set_server(const char *vendor, int release)
+{
+    if (!enabled)
+        return;
+
+    /* with --displays, every display's thread has its say */
+    G_LOCK(stats);
+    g_free(server);
+    server = g_strdup_printf("%s %d", vendor, release);
+    G_UNLOCK(stats);
+}
+
+gboolean stats_enabled(void)
+{
+    return enabled;
+}
+
+/**
+ * Timestamp for stats_end(), 0 if statistics are off.
+ */
+gint64 stats_start(void)
+{
+    return enabled ? g_get_monotonic_time() : 0;
+}
+
+/**
+ * Add the time since start to phase.
+ */
+void stats_end(StatPhase phase, gint64 start)
+{
+    Histogram *h = &histograms[phase];
+    gint64 us;
+
+    if (!enabled || !start)
+        return;
+
+    us = g_get_monotonic_time() - start;
+
+    G_LOCK(stats);
+    if (h->count == 0 || us < h->min)
+        h->min = us;
+    if (us > h->max)
+        h->max = us;
+    h->count++;
+    h->sum += us;
+    h->buckets[bucket_index(us)]++;
+
+    if (json)
+    {
+        fprintf(json, "{\"type\":\"sample\",\"time\":%" G_GINT64_FORMAT
+                      ",\"phase\":\"%s\",\"us\":%" G_GINT64_FORMAT "}\n",
+                g_get_real_time(), phase_names[phase], us);
+        fflush(json);
+    }
+    G_UNLOCK(stats);
+}
+
+void stats_count(StatCounter counter, int n)
+{
+    if (!enabled)
+        return;
+
+    G_LOCK(stats);
+    counters[counter] += n;
+    G_UNLOCK(stats);
+}
+
+static void get_memory_use(MemoryUse *mem)
+{
+    gchar *statm = NULL;
+    unsigned long size, resident;
+
+    memset(mem, 0, sizeof(*mem));
+
+    if (g_file_get_contents("/proc/self/statm", &statm, NULL, NULL) &&
+        sscanf(statm, "%lu %lu", &size, &resident) == 2)
+        mem->rss = (guint64)resident * sysconf(_SC_PAGESIZE);
+    g_free(statm);
+
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+    {
+        struct mallinfo2 mi = mallinfo2();
+
+        mem->heap = mi.uordblks + mi.hblkhd;
+    }
+#endif
+}
+
+static void write_json_string(FILE *f, const char *s)
+{
+    gchar *escaped = g_strescape(s, NULL);
+
+    fprintf(f, "\"%s\"", escaped);
+    g_free(escaped);
+}
+
+static void dump_json(MemoryUse *mem)
+{
+    int i;
+
+    fprintf(json, "{\"type\":\"summary\",\"time\":%" G_GINT64_FORMAT,
+            g_get_real_time());
+    if (server)
+    {
+        fprintf(json, ",\"server\":");
+        write_json_string(json, server);
+    }
+
+    fprintf(json, ",\"phases\":{");
+    for (i = 0; i < NUM_STAT_PHASES; i++)
+    {
+        Histogram *h = &histograms[i];
+
+        fprintf(json, "%s\"%s\":{\"count\":%" G_GUINT64_FORMAT
+                      ",\"min\":%" G_GINT64_FORMAT
+                      ",\"avg\":%" G_GINT64_FORMAT
+                      ",\"p99\":%" G_GINT64_FORMAT
+                      ",\"max\":%" G_GINT64_FORMAT "}",
+                i ? "," : "", phase_names[i], h->count, h->min,
+                h->count ? h->sum / (gint64)h->count : 0,
+                percentile(h, 99), h->max);
+    }
+
+    fprintf(json, "},\"counters\":{");
+    for (i = 0; i < NUM_STAT_COUNTERS; i++)
+        fprintf(json, "%s\"%s\":%" G_GUINT64_FORMAT,
+                i ? "," : "", counter_names[i], counters[i]);
+    fprintf(json, "},\"memory\":{\"rss\":%" G_GUINT64_FORMAT
+                  ",\"heap\":%" G_GUINT64_FORMAT "}}\n",
+            mem->rss, mem->heap);
+    fflush(json);
+}
+
+/**
+ * Print a summary to stderr, and to the JSON file if there is one.
+ */
+void stats_dump(void)
+{
+    MemoryUse mem;
+    int i;
+
+    if (!enabled)
+        return;
+
+    G_LOCK(stats);
+    if (server)
+        g_printerr("X server: %s\n", server);
+    g_printerr("%-16s %8s %10s %10s %10s %10s\n",
+               "phase", "count", "min(us)", "avg(us)", "p99(us)", "max(us)");
+    for (i = 0; i < NUM_STAT_PHASES; i++)
+    {
+        Histogram *h = &histograms[i];
+
+        if (h->count == 0)
+            continue;
+
+        g_printerr("%-16s %8" G_GUINT64_FORMAT " %10" G_GINT64_FORMAT
+                   " %10" G_GINT64_FORMAT " %10" G_GINT64_FORMAT
+                   " %10" G_GINT64_FORMAT "\n",
+                   phase_names[i], h->count, h->min,
+                   h->sum / (gint64)h->count, percentile(h, 99), h->max);
+    }
+    for (i = 0; i < NUM_STAT_COUNTERS; i++)
+        g_printerr("%-16s %8" G_GUINT64_FORMAT "\n",
+                   counter_names[i], counters[i]);
+
+    get_memory_use(&mem);
+    g_printerr("%-16s %8" G_GUINT64_FORMAT "\n", "rss(kB)", mem.rss / 1024);
+    if (mem.heap)
+        g_printerr("%-16s %8" G_GUINT64_FORMAT "\n", "heap(kB)",
+                   mem.heap / 1024);
+
+    if (json)
+        dump_json(&mem);
+    G_UNLOCK(stats);
+}
+
+/**
+ * Dump and stop collecting.
+ */
+void stats_shutdown(void)
+{
+    if (!enabled)
+        return;
+
+    stats_dump();
+
+    if (json && json != stdout)
+        fclose(json);
+    json = NULL;
+    g_free(server);
+    server = NULL;
+    enabled = FALSE;
+}
@@ -0,0 +1,65 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.  You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <glib.h>
+
+/* Timed phases */
+typedef enum {
+    STAT_QUERY,           /* XIQueryDevice round trips */
+    STAT_PROPERTY,        /* device property fetches */
+    STAT_RECONCILE,       /* full tree store update, without the query */
+    STAT_REQUERY,         /* update of the dirty rows, without the query */
+    STAT_EVENT,           /* XI_HierarchyChanged applied to the tree store */
+    STAT_HIERARCHY,       /* XIChangeHierarchy, waited for */
+    STAT_HIERARCHY_ASYNC, /* XIChangeHierarchy, until confirmed */
+    STAT_STARTUP_PAINT,   /* from main() to the first frame of the window */
+    STAT_STARTUP_FILL,    /* from main() to the filled device tree */
+    NUM_STAT_PHASES
+} StatPhase;
+
+/* Plain counters */
+typedef enum {
+    STAT_ROWS_INSERTED,
+    STAT_ROWS_REMOVED,
+    STAT_ROWS_MOVED,      /* re-attached SDs, taken out and put back */
+    STAT_NAMES_INTERNED,  /* distinct device names stored */
+    STAT_NAME_BYTES,      /* bytes they take */
+    NUM_STAT_COUNTERS
+} StatCounter;
+
+#ifdef HAVE_STATS
+void stats_init(const char *json_path);
+void stats_set_server(const char *vendor, int release);
+gboolean stats_enabled(void);
+gint64 stats_start(void);
+void stats_end(StatPhase phase, gint64 start);
+void stats_count(StatCounter counter, int n);
+void stats_dump(void);
+void stats_shutdown(void);
+#else
+/* built without instrumentation, the calls compile to nothing */
+static inline void stats_init(const char *json_path) { }
+static inline void stats_set_server(const char *vendor, int release) { }
+static inline gboolean stats_enabled(void) { return FALSE; }
+static inline gint64 stats_start(void) { return 0; }
+static inline void stats_end(StatPhase phase, gint64 start) { }
+static inline void stats_count(StatCounter counter, int n) { }
+static inline void stats_dump(void) { }
+static inline void stats_shutdown(void) { }
+#endif
+
+#endif
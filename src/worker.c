@@ -0,0 +1,444 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.  You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* The I/O worker: the refresh queries of the tree on a thread and X
+ * connection of their own, so a slow server doesn't hold up drawing while
+ * devices come and go. Only these move. The round trips of
+ * create_masters(), profile_apply(), undo, redo and replay, and of
+ * recovering from a failed batch, are still made on the main thread.
+ * The main thread queues requests on a GAsyncQueue, the worker answers
+ * each with a DeviceSnapshot that is handed back in an idle source on the
+ * main context, so snapshots are only ever applied on the main thread.
+ * The worker holds on to the sources not yet dispatched, so worker_free()
+ * can take them back. That's a lock per request and a source per snapshot
+ * rather than a lock-free handoff, which costs nothing next to the round
+ * trips of a query, and GAsyncQueue and GSource are what GLib has for
+ * this. Events, hierarchy changes and everything else stay on the main
+ * connection.
+ * Properties are kept per device like the cache does, keyed by id with the
+ * name to notice reused ids, and dropped on XI_PropertyEvent. */
+
+#include <X11/Xlib.h>
+#include <X11/extensions/XInput2.h>
+#include <gtk/gtk.h>
+#include <string.h>
+#include "gui.h"
+
+typedef enum {
+    WORK_QUERY_ALL,
+    WORK_QUERY_IDS,
+    WORK_INVALIDATE,
+    WORK_QUIT
+} WorkType;
+
+typedef struct {
+    WorkType  type;
+    int      *ids;      /* WORK_QUERY_IDS */
+    int       n;
+    int       id;       /* WORK_INVALIDATE */
+    guint     events;   /* gds->events when it was queued */
+} WorkItem;
+
+typedef struct {
+    gchar       *name;  /* of the device the props were fetched for */
+    DeviceProps  props;
+} WorkerProps;
+
+struct _Worker {
+    GDeviceSetup *gds;
+    GMainContext *context;       /* where snapshots are delivered */
+    GThread      *thread;
+    GAsyncQueue  *queue;         /* of WorkItem */
+    gint          all_queued;    /* a WORK_QUERY_ALL is waiting */
+    GMutex        lock;          /* for pending */
+    GList        *pending;       /* GSource of snapshots not delivered */
+    /* only touched by the worker thread */
+    Display      *dpy;
+    Atom          product_id_atom;
+    Atom          device_node_atom;
+    GHashTable   *props;         /* device id -> WorkerProps */
+};
+
+/* a snapshot on its way to the main thread */
+typedef struct {
+    Worker         *worker;
+    DeviceSnapshot *snap;
+} Delivery;
+
+static void worker_props_free(gpointer data)
+{
+    WorkerProps *wp = (WorkerProps*)data;
+
+    g_free(wp->name);
+    g_free(wp->props.node);
+    g_free(wp);
+}
+
+static void work_item_free(WorkItem *item)
+{
+    g_free(item->ids);
+    g_free(item);
+}
+
+void snapshot_free(DeviceSnapshot *snap)
+{
+    int i, n;
+
+    if (!snap)
+        return;
+
+    n = snap->all ? snap->ndevices : snap->n;
+    for (i = 0; i < n; i++)
+        g_free(snap->props[i].node);
+    g_free(snap->props);
+
+    if (snap->all)
+        free_device_info(snap->devices);
+    else
+    {
+        for (i = 0; i < snap->n; i++)
+            free_device_info(snap->infos[i]);
+        g_free(snap->infos);
+        g_free(snap->ids);
+    }
+    g_free(snap);
+}
+
+/**
+ * Fill in props for the n devices in devs, NULL entries are skipped. Only
+ * devices the worker has no properties for are asked for them.
+ */
+static void fill_props(Worker *worker, XIDeviceInfo **devs, int n,
+                       DeviceProps *props)
+{
+    GArray *fetch, *where;
+    guint *vendors, *products;
+    gboolean *have;
+    gchar **nodes;
+    guint i;
+
+    fetch = g_array_new(FALSE, FALSE, sizeof(int));
+    where = g_array_new(FALSE, FALSE, sizeof(int));
+
+    for (i = 0; i < (guint)n; i++)
+    {
+        WorkerProps *wp;
+
+        if (!devs[i])
+            continue;
+
+        wp = g_hash_table_lookup(worker->props,
+                                 GINT_TO_POINTER(devs[i]->deviceid));
+        if (wp && strcmp(wp->name, devs[i]->name) == 0)
+        {
+            props[i] = wp->props;
+            props[i].node = g_strdup(wp->props.node);
+            continue;
+        }
+
+        g_array_append_val(fetch, devs[i]->deviceid);
+        g_array_append_val(where, i);
+    }
+
+    if (fetch->len > 0)
+    {
+        vendors = g_new0(guint, fetch->len);
+        products = g_new0(guint, fetch->len);
+        have = g_new0(gboolean, fetch->len);
+        nodes = g_new0(gchar*, fetch->len);
+
+        get_product_ids(worker->dpy, worker->product_id_atom,
+                        (int*)fetch->data, fetch->len,
+                        vendors, products, have);
+        get_device_nodes(worker->dpy, worker->device_node_atom,
+                         (int*)fetch->data, fetch->len, nodes);
+
+        for (i = 0; i < fetch->len; i++)
+        {
+            int idx = g_array_index(where, int, i);
+            WorkerProps *wp = g_new0(WorkerProps, 1);
+
+            wp->name = g_strdup(devs[idx]->name);
+            wp->props.have_product = have[i];
+            wp->props.vendor = vendors[i];
+            wp->props.product = products[i];
+            wp->props.node = nodes[i];
+            g_hash_table_insert(worker->props,
+                                GINT_TO_POINTER(devs[idx]->deviceid), wp);
+
+            props[idx] = wp->props;
+            props[idx].node = g_strdup(wp->props.node);
+        }
+
+        g_free(vendors);
+        g_free(products);
+        g_free(have);
+        g_free(nodes);
+    }
+
+    g_array_unref(fetch);
+    g_array_unref(where);
+}
+
+static gboolean props_unseen(gpointer key, gpointer value, gpointer data)
+{
+    return !g_hash_table_contains((GHashTable*)data, key);
+}
+
+static DeviceSnapshot* snapshot_all(Worker *worker)
+{
+    DeviceSnapshot *snap = g_new0(DeviceSnapshot, 1);
+    XIDeviceInfo **devs;
+    GHashTable *seen;
+    int i;
+
+    snap->all = TRUE;
+    snap->devices = query_device_info(worker->dpy, XIAllDevices,
+                                      &snap->ndevices);
+    snap->props = g_new0(DeviceProps, snap->ndevices);
+
+    devs = g_new(XIDeviceInfo*, snap->ndevices);
+    seen = g_hash_table_new(g_direct_hash, g_direct_equal);
+    for (i = 0; i < snap->ndevices; i++)
+    {
+        devs[i] = &snap->devices[i];
+        g_hash_table_add(seen, GINT_TO_POINTER(devs[i]->deviceid));
+    }
+
+    /* what's gone gets no use for its properties anymore */
+    g_hash_table_foreach_remove(worker->props, props_unseen, seen);
+    g_hash_table_destroy(seen);
+
+    fill_props(worker, devs, snap->ndevices, snap->props);
+    g_free(devs);
+
+    return snap;
+}
+
+static DeviceSnapshot* snapshot_ids(Worker *worker, WorkItem *item)
+{
+    DeviceSnapshot *snap = g_new0(DeviceSnapshot, 1);
+    int i;
+
+    /* the ids are handed on with the snapshot */
+    snap->ids = item->ids;
+    snap->n = item->n;
+    item->ids = NULL;
+
+    snap->infos = g_new0(XIDeviceInfo*, snap->n);
+    snap->props = g_new0(DeviceProps, snap->n);
+    query_devices_by_id(worker->dpy, snap->ids, snap->n, snap->infos);
+
+    for (i = 0; i < snap->n; i++)
+        if (!snap->infos[i])
+            g_hash_table_remove(worker->props, GINT_TO_POINTER(snap->ids[i]));
+
+    fill_props(worker, snap->infos, snap->n, snap->props);
+
+    return snap;
+}
+
+static void delivery_free(gpointer data)
+{
+    Delivery *delivery = (Delivery*)data;
+
+    snapshot_free(delivery->snap);
+    g_free(delivery);
+}
+
+static gboolean deliver(gpointer data)
+{
+    Delivery *delivery = (Delivery*)data;
+    Worker *worker = delivery->worker;
+    GSource *source = g_main_current_source();
+
+    g_mutex_lock(&worker->lock);
+    worker->pending = g_list_remove(worker->pending, source);
+    g_mutex_unlock(&worker->lock);
+    g_source_unref(source);
+
+    apply_snapshot(worker->gds, delivery->snap);
+
+    return G_SOURCE_REMOVE;
+}
+
+static gpointer worker_thread(gpointer data)
+{
+    Worker *worker = (Worker*)data;
+    DeviceSnapshot *snap;
+    Delivery *delivery;
+    GSource *source;
+    WorkItem *item;
+    gboolean quit = FALSE;
+
+    while (!quit)
+    {
+        item = g_async_queue_pop(worker->queue);
+        snap = NULL;
+
+        switch (item->type)
+        {
+            case WORK_QUERY_ALL:
+                /* requests from here on need another query */
+                g_atomic_int_set(&worker->all_queued, 0);
+                snap = snapshot_all(worker);
+                break;
+            case WORK_QUERY_IDS:
+                snap = snapshot_ids(worker, item);
+                break;
+            case WORK_INVALIDATE:
+                g_hash_table_remove(worker->props, GINT_TO_POINTER(item->id));
+                break;
+            case WORK_QUIT:
+                quit = TRUE;
+                break;
+        }
+
+        if (snap)
+        {
+            snap->events = item->events;
+            delivery = g_new(Delivery, 1);
+            delivery->worker = worker;
+            delivery->snap = snap;
+            /* never g_main_context_invoke(), that would run deliver() right
+             * here whenever the main thread isn't iterating the context */
+            source = g_idle_source_new();
+            g_source_set_callback(source, deliver, delivery, delivery_free);
+            g_mutex_lock(&worker->lock);
+            worker->pending = g_list_prepend(worker->pending, source);
+            g_mutex_unlock(&worker->lock);
+            g_source_attach(source, worker->context);
+        }
+
+        work_item_free(item);
+    }
+
+    g_hash_table_destroy(worker->props);
+    XCloseDisplay(worker->dpy);
+
+    return NULL;
+}
+
+static void push(Worker *worker, WorkType type)
+{
+    WorkItem *item = g_new0(WorkItem, 1);
+
+    item->type = type;
+    item->events = worker->gds->events;
+    g_async_queue_push(worker->queue, item);
+}
+
+/**
+ * Start the worker on a connection of its own to the display of gds.
+ * Returns NULL if that connection can't be had, queries are then done on
+ * the main thread.
+ */
+Worker* worker_new(GDeviceSetup *gds)
+{
+    Worker *worker;
+    Display *dpy;
+
+    dpy = dpy_open_query(DisplayString(gds->dpy));
+    if (!dpy)
+    {
+        g_printerr("ERROR: Cannot open a second X connection, querying "
+                   "devices on the main thread.\n");
+        return NULL;
+    }
+
+    worker = g_new0(Worker, 1);
+    worker->gds = gds;
+    worker->context = g_main_context_default();
+    worker->queue = g_async_queue_new();
+    g_mutex_init(&worker->lock);
+    worker->dpy = dpy;
+    worker->product_id_atom = XInternAtom(dpy, "Device Product ID", False);
+    worker->device_node_atom = XInternAtom(dpy, "Device Node", False);
+    worker->props = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                          NULL, worker_props_free);
+    worker->thread = g_thread_new("idm-io", worker_thread, worker);
+
+    return worker;
+}
+
+/**
+ * Stop the worker and wait for it. Snapshots not yet delivered are
+ * dropped, their sources destroyed.
+ */
+void worker_free(Worker *worker)
+{
+    WorkItem *item;
+    GList *l;
+
+    if (!worker)
+        return;
+
+    push(worker, WORK_QUIT);
+    g_thread_join(worker->thread);
+
+    /* the thread is gone, nothing adds to pending anymore */
+    for (l = worker->pending; l; l = l->next)
+    {
+        g_source_destroy(l->data);
+        g_source_unref(l->data);
+    }
+    g_list_free(worker->pending);
+    g_mutex_clear(&worker->lock);
+
+    while ((item = g_async_queue_try_pop(worker->queue)))
+        work_item_free(item);
+    g_async_queue_unref(worker->queue);
+    g_free(worker);
+}
+
+/**
+ * Have all devices queried. Requests made before the worker gets to it
+ * are answered with one query.
+ */
+void worker_query_all(Worker *worker)
+{
+    if (g_atomic_int_compare_and_exchange(&worker->all_queued, 0, 1))
+        push(worker, WORK_QUERY_ALL);
+}
+
+/**
+ * Have the n devices in ids queried.
+ */
+void worker_query_ids(Worker *worker, const int *ids, int n)
+{
+    WorkItem *item;
+
+    if (n == 0)
+        return;
+
+    item = g_new0(WorkItem, 1);
+    item->type = WORK_QUERY_IDS;
+    item->ids = g_new(int, n);
+    memcpy(item->ids, ids, n * sizeof(int));
+    item->n = n;
+    item->events = worker->gds->events;
+    g_async_queue_push(worker->queue, item);
+}
+
+/**
+ * The properties of device id changed, have them fetched again.
+ */
+void worker_invalidate(Worker *worker, int id)
+{
+    WorkItem *item = g_new0(WorkItem, 1);
+
+    item->type = WORK_INVALIDATE;
+    item->id = id;
+    g_async_queue_push(worker->queue, item);
+}
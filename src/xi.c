@@ -0,0 +1,1674 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.  You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* Everything that talks to the X server: the connection, error traps,
+ * device queries, hierarchy changes and events. */
+
+#include <X11/Xlib.h>
+#include <X11/Xatom.h>
+#include <X11/cursorfont.h>
+#include <X11/extensions/XInput2.h>
+#ifdef HAVE_XCB
+#include <X11/Xlib-xcb.h>
+#include <X11/extensions/XI2proto.h>
+#include <xcb/xinput.h>
+#endif
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+#include "idm.h"
+#include "stats.h"
+
+/* Hierarchy changes sent but not confirmed yet */
+typedef struct {
+    GDeviceSetup     *gds;
+    HierarchyBatch   *batch;
+    JournalStep      *step;     /* for the journal once it's through */
+    GHashTable       *masters;  /* see known_masters() */
+    unsigned long     first;    /* serial of the XIChangeHierarchy */
+    unsigned long     marker;   /* serial of the request after it */
+    gint64            sent;     /* for the statistics */
+    gboolean          failed;
+    HierarchyDoneFunc done;
+    gpointer          data;
+} AsyncOp;
+
+typedef struct {
+    GSource       source;
+    GPollFD       pollfd;
+    GDeviceSetup *gds;
+} XEventSource;
+
+/**
+ * Select XI_HierarchyChanged and XI_PropertyEvent for all devices on the
+ * root window. If merge is set, keep
+ * what was selected on the root window before, e.g. by GDK on its own
+ * connection.
+ */
+static void select_device_events(Display *dpy, gboolean merge)
+{
+    XIEventMask evmask, *masks = NULL;
+    unsigned char mask[XIMaskLen(XI_LASTEVENT)] = { 0 };
+    int nmasks = 0;
+    int i;
+
+    if (merge)
+        masks = XIGetSelectedEvents(dpy, DefaultRootWindow(dpy), &nmasks);
+
+    for (i = 0; i < nmasks; i++)
+        if (masks[i].deviceid == XIAllDevices)
+            memcpy(mask, masks[i].mask, MIN(masks[i].mask_len, sizeof(mask)));
+    if (masks)
+        XFree(masks);
+
+    /* Get told about every change to the device hierarchy, and about
+     * property changes that make the cache stale */
+    XISetMask(mask, XI_HierarchyChanged);
+    XISetMask(mask, XI_PropertyEvent);
+    evmask.deviceid = XIAllDevices;
+    evmask.mask_len = sizeof(mask);
+    evmask.mask = mask;
+    XISelectEvents(dpy, DefaultRootWindow(dpy), &evmask, 1);
+}
+
+/**
+ * Add raw key, button and motion events to what's selected on the root
+ * window, or take them out again.
+ */
+void select_raw_events(Display *dpy, gboolean on)
+{
+    XIEventMask evmask, *masks;
+    unsigned char mask[XIMaskLen(XI_LASTEVENT)] = { 0 };
+    int nmasks = 0;
+    int i;
+
+    masks = XIGetSelectedEvents(dpy, DefaultRootWindow(dpy), &nmasks);
+    for (i = 0; i < nmasks; i++)
+        if (masks[i].deviceid == XIAllDevices)
+            memcpy(mask, masks[i].mask, MIN(masks[i].mask_len, sizeof(mask)));
+    if (masks)
+        XFree(masks);
+
+    if (on)
+    {
+        XISetMask(mask, XI_RawKeyPress);
+        XISetMask(mask, XI_RawButtonPress);
+        XISetMask(mask, XI_RawMotion);
+    } else
+    {
+        XIClearMask(mask, XI_RawKeyPress);
+        XIClearMask(mask, XI_RawButtonPress);
+        XIClearMask(mask, XI_RawMotion);
+    }
+
+    evmask.deviceid = XIAllDevices;
+    evmask.mask_len = sizeof(mask);
+    evmask.mask = mask;
+    XISelectEvents(dpy, DefaultRootWindow(dpy), &evmask, 1);
+    XFlush(dpy);
+}
+
+static gboolean xi_init(Display *dpy, int *xi_opcode, gboolean query_version)
+{
+    int opcode, event, error;
+    int major = 2, minor = 0; /* XInput 2.0 */
+
+    /* XInput Extension available? */
+    if (!XQueryExtension(dpy, "XInputExtension", &opcode, &event, &error))
+      {
+	g_debug("X Input extension not available.\n");
+	return FALSE;
+      }
+
+    /* Which version of XI? */
+    if (query_version && XIQueryVersion(dpy, &major, &minor) == BadRequest)
+      {
+	g_debug("XI2 not available. Server supports %d.%d\n", major, minor);
+	return FALSE;
+      }
+
+    *xi_opcode = opcode;
+
+    return TRUE;
+}
+
+Display* dpy_init(int *xi_opcode)
+{
+    return dpy_init_display(NULL, xi_opcode);
+}
+
+/**
+ * Like dpy_init(), for the display called name, NULL for $DISPLAY.
+ */
+Display* dpy_init_display(const char *name, int *xi_opcode)
+{
+    Display           *dpy;
+
+    dpy = XOpenDisplay(name);
+    if (!dpy)
+    {
+        g_debug("Unable to open display.\n");
+        return NULL;
+    }
+
+    if (!xi_init(dpy, xi_opcode, TRUE))
+    {
+        XCloseDisplay(dpy);
+        return NULL;
+    }
+
+    select_device_events(dpy, FALSE);
+
+    return dpy;
+}
+
+/**
+ * Use a connection opened elsewhere, e.g. GDK's, instead of one of our
+ * own. Its XI 2 version has been negotiated already, and we may not ask
+ * for a different one.
+ */
+Display* dpy_init_existing(Display *dpy, int *xi_opcode)
+{
+    if (!xi_init(dpy, xi_opcode, FALSE))
+        return NULL;
+
+    select_device_events(dpy, TRUE);
+
+    return dpy;
+}
+
+/**
+ * A connection for device queries only. No events are selected on it, so
+ * none pile up unread.
+ */
+Display* dpy_open_query(const char *name)
+{
+    Display *dpy;
+    int opcode;
+
+    dpy = XOpenDisplay(name);
+    if (!dpy)
+        return NULL;
+
+    if (!xi_init(dpy, &opcode, TRUE))
+    {
+        XCloseDisplay(dpy);
+        return NULL;
+    }
+
+    return dpy;
+}
+
+/* Hierarchy changes sent with hierarchy_commit_async() that the server
+ * hasn't confirmed yet, oldest first */
+static GQueue async_ops = G_QUEUE_INIT;
+
+/* Error trap for dpy. GDK's traps only cover GDK's own connection and
+ * we must not need GDK for this. Errors with a serial before the push are
+ * not ours and go to the previous handler. Xlib calls the handler on the
+ * thread that made the request, so each thread has a trap of its own, the
+ * I/O worker uses one on its connection. */
+typedef struct {
+    Display      *dpy;
+    unsigned long serial;
+    int           error;
+} ErrorTrap;
+
+static int (*trap_old_handler)(Display*, XErrorEvent*);
+static gsize trap_installed;
+static GPrivate trap_private = G_PRIVATE_INIT(g_free);
+
+static ErrorTrap* get_trap(void)
+{
+    ErrorTrap *trap = g_private_get(&trap_private);
+
+    if (!trap)
+    {
+        trap = g_new0(ErrorTrap, 1);
+        g_private_set(&trap_private, trap);
+    }
+
+    return trap;
+}
+
+/**
+ * Our error handler. Errors go to the current error trap, the async
+ * operation they belong to, anything else goes to the handler that was
+ * there before, e.g. GDK's.
+ */
+static int trap_handler(Display *dpy, XErrorEvent *ev)
+{
+    ErrorTrap *trap = get_trap();
+    GList *l;
+
+    if (dpy == trap->dpy && ev->serial >= trap->serial)
+    {
+        if (!trap->error)
+            trap->error = ev->error_code;
+        return 0;
+    }
+
+    /* only the main thread gets here, the worker traps all its requests */
+    for (l = async_ops.head; l; l = l->next)
+    {
+        AsyncOp *op = l->data;
+
+        if (op->gds->dpy == dpy &&
+            ev->serial >= op->first && ev->serial < op->marker)
+        {
+            op->failed = TRUE;
+            return 0;
+        }
+    }
+
+    return trap_old_handler ? trap_old_handler(dpy, ev) : 0;
+}
+
+static void install_error_handler(void)
+{
+    if (g_once_init_enter(&trap_installed))
+    {
+        trap_old_handler = XSetErrorHandler(trap_handler);
+        g_once_init_leave(&trap_installed, 1);
+    }
+}
+
+/**
+ * Trap the X errors of the requests sent from here on, until
+ * error_trap_pop(). Per thread.
+ */
+void error_trap_push(Display *dpy)
+{
+    ErrorTrap *trap = get_trap();
+
+    install_error_handler();
+    trap->dpy = dpy;
+    trap->serial = NextRequest(dpy);
+    trap->error = 0;
+}
+
+/**
+ * Sync and stop trapping errors. Returns the first error code seen
+ * since error_trap_push(), or 0.
+ */
+int error_trap_pop(Display *dpy)
+{
+    ErrorTrap *trap = get_trap();
+
+    XSync(dpy, False);
+    trap->dpy = NULL;
+
+    return trap->error;
+}
+
+/**
+ * Like error_trap_pop(), once the reply to a request sent after the
+ * trapped ones is in. Xlib handles errors in order with replies, so
+ * there's no need to sync again.
+ */
+static int error_trap_pop_replied(Display *dpy)
+{
+#ifdef HAVE_XCB
+    /* the reply came by XCB, Xlib hasn't looked at the errors before it */
+    return error_trap_pop(dpy);
+#else
+    ErrorTrap *trap = get_trap();
+
+    trap->dpy = NULL;
+
+    return trap->error;
+#endif
+}
+
+/* Backend. Device queries, property fetches and synchronous hierarchy
+ * changes all go through these, built either on Xlib or, with HAVE_XCB,
+ * on xcb-xinput. XCB sends a whole list of requests before waiting for
+ * the first reply, so n queries cost one round trip instead of n. */
+
+#ifdef HAVE_XCB
+/**
+ * Convert an XIQueryDevice reply into what XIQueryDevice() returns. The
+ * classes only carry type and sourceid, which is all we look at.
+ */
+static XIDeviceInfo* xcb_device_info(xcb_input_xi_query_device_reply_t *reply,
+                                     int *ndevices)
+{
+    xcb_input_xi_device_info_iterator_t it;
+    XIDeviceInfo *devices;
+    int i, j;
+
+    /* terminated by a zeroed entry, for free_device_info() */
+    devices = g_new0(XIDeviceInfo, reply->num_infos + 1);
+
+    it = xcb_input_xi_query_device_infos_iterator(reply);
+    for (i = 0; it.rem; i++, xcb_input_xi_device_info_next(&it))
+    {
+        xcb_input_xi_device_info_t *info = it.data;
+        xcb_input_device_class_iterator_t cit;
+        XIAnyClassInfo *classes;
+        XIDeviceInfo *dev = &devices[i];
+
+        dev->deviceid = info->deviceid;
+        dev->use = info->type;
+        dev->attachment = info->attachment;
+        dev->enabled = info->enabled;
+        dev->name = g_strndup(xcb_input_xi_device_info_name(info),
+                              info->name_len);
+        dev->num_classes = info->num_classes;
+        dev->classes = g_new0(XIAnyClassInfo*, MAX(info->num_classes, 1));
+
+        /* classes[0] always points to the block, for free_device_info() */
+        classes = g_new0(XIAnyClassInfo, MAX(info->num_classes, 1));
+        dev->classes[0] = classes;
+
+        cit = xcb_input_xi_device_info_classes_iterator(info);
+        for (j = 0; cit.rem; j++, xcb_input_device_class_next(&cit))
+        {
+            classes[j].type = cit.data->type;
+            classes[j].sourceid = cit.data->sourceid;
+            dev->classes[j] = &classes[j];
+        }
+    }
+
+    *ndevices = i;
+
+    return devices;
+}
+
+/**
+ * Put hierarchy changes into wire format for xcb_input_xi_change_hierarchy().
+ * Free the result with g_byte_array_unref().
+ */
+static GByteArray* xcb_hierarchy_changes(XIAnyHierarchyChangeInfo *c, int n)
+{
+    GByteArray *buf = g_byte_array_new();
+    static const guint8 pad[4];
+    int i;
+
+    for (i = 0; i < n; i++)
+    {
+        switch(c[i].type)
+        {
+            case XIAddMaster:
+                {
+                    xXIAddMasterInfo add;
+                    int len = strlen(c[i].add.name);
+
+                    add.type = XIAddMaster;
+                    add.name_len = len;
+                    add.length = (sizeof(add) + len + 3) / 4;
+                    add.send_core = c[i].add.send_core;
+                    add.enable = c[i].add.enable;
+                    g_byte_array_append(buf, (guint8*)&add, sizeof(add));
+                    g_byte_array_append(buf, (guint8*)c[i].add.name, len);
+                    g_byte_array_append(buf, pad, (4 - len % 4) % 4);
+                }
+                break;
+            case XIRemoveMaster:
+                {
+                    xXIRemoveMasterInfo remove;
+
+                    remove.type = XIRemoveMaster;
+                    remove.length = sizeof(remove) / 4;
+                    remove.deviceid = c[i].remove.deviceid;
+                    remove.return_mode = c[i].remove.return_mode;
+                    remove.pad = 0;
+                    remove.return_pointer = c[i].remove.return_pointer;
+                    remove.return_keyboard = c[i].remove.return_keyboard;
+                    g_byte_array_append(buf, (guint8*)&remove, sizeof(remove));
+                }
+                break;
+            case XIAttachSlave:
+                {
+                    xXIAttachSlaveInfo attach;
+
+                    attach.type = XIAttachSlave;
+                    attach.length = sizeof(attach) / 4;
+                    attach.deviceid = c[i].attach.deviceid;
+                    attach.new_master = c[i].attach.new_master;
+                    g_byte_array_append(buf, (guint8*)&attach, sizeof(attach));
+                }
+                break;
+            case XIDetachSlave:
+                {
+                    xXIDetachSlaveInfo detach;
+
+                    detach.type = XIDetachSlave;
+                    detach.length = sizeof(detach) / 4;
+                    detach.deviceid = c[i].detach.deviceid;
+                    detach.pad = 0;
+                    g_byte_array_append(buf, (guint8*)&detach, sizeof(detach));
+                }
+                break;
+        }
+    }
+
+    return buf;
+}
+#endif
+
+/**
+ * Free what query_device_info() or query_devices_by_id() returned.
+ * NULL is fine.
+ */
+void free_device_info(XIDeviceInfo *info)
+{
+#ifdef HAVE_XCB
+    XIDeviceInfo *dev;
+
+    if (!info)
+        return;
+
+    for (dev = info; dev->name; dev++)
+    {
+        g_free(dev->classes[0]);
+        g_free(dev->classes);
+        g_free(dev->name);
+    }
+    g_free(info);
+#else
+    if (info)
+        XIFreeDeviceInfo(info);
+#endif
+}
+
+/**
+ * XIQueryDevice() for either backend. Returns NULL if deviceid doesn't
+ * exist.
+ */
+XIDeviceInfo* query_device_info(Display *dpy, int deviceid,
+                                int *ndevices)
+{
+    XIDeviceInfo *info = NULL;
+    gint64 start = stats_start();
+#ifdef HAVE_XCB
+    xcb_connection_t *conn = XGetXCBConnection(dpy);
+    xcb_input_xi_query_device_reply_t *reply;
+    xcb_generic_error_t *error = NULL;
+
+    /* Xlib may still have unsent requests ahead of ours */
+    XFlush(dpy);
+
+    *ndevices = 0;
+    reply = xcb_input_xi_query_device_reply(conn,
+                xcb_input_xi_query_device(conn, deviceid), &error);
+    if (reply && reply->num_infos > 0)
+        info = xcb_device_info(reply, ndevices);
+
+    free(reply);
+    free(error);
+#else
+    /* only single devices can be gone */
+    if (deviceid == XIAllDevices || deviceid == XIAllMasterDevices)
+        info = XIQueryDevice(dpy, deviceid, ndevices);
+    else
+    {
+        error_trap_push(dpy);
+        info = XIQueryDevice(dpy, deviceid, ndevices);
+        if (error_trap_pop(dpy) || *ndevices < 1)
+        {
+            free_device_info(info);
+            info = NULL;
+        }
+    }
+#endif
+
+    stats_end(STAT_QUERY, start);
+
+    return info;
+}
+
+/**
+ * Query n devices at once. infos[i] is the XIDeviceInfo for ids[i], or
+ * NULL if that device doesn't exist.
+ */
+void query_devices_by_id(Display *dpy, const int *ids, int n,
+                         XIDeviceInfo **infos)
+{
+#ifdef HAVE_XCB
+    xcb_connection_t *conn = XGetXCBConnection(dpy);
+    xcb_input_xi_query_device_cookie_t *cookies;
+    gint64 start = stats_start();
+    int i;
+
+    XFlush(dpy);
+
+    cookies = g_new(xcb_input_xi_query_device_cookie_t, n);
+    for (i = 0; i < n; i++)
+        cookies[i] = xcb_input_xi_query_device(conn, ids[i]);
+
+    for (i = 0; i < n; i++)
+    {
+        xcb_input_xi_query_device_reply_t *reply;
+        xcb_generic_error_t *error = NULL;
+        int ndevices;
+
+        infos[i] = NULL;
+        reply = xcb_input_xi_query_device_reply(conn, cookies[i], &error);
+        if (reply && reply->num_infos > 0)
+            infos[i] = xcb_device_info(reply, &ndevices);
+
+        free(reply);
+        free(error);
+    }
+
+    g_free(cookies);
+    stats_end(STAT_QUERY, start);
+#else
+    int ndevices;
+    int i;
+
+    for (i = 0; i < n; i++)
+        infos[i] = query_device_info(dpy, ids[i], &ndevices);
+#endif
+}
+
+/**
+ * Fetch the "Device Product ID" of n devices at once. have[i] is FALSE if
+ * ids[i] has none.
+ */
+void get_product_ids(Display *dpy, Atom atom, const int *ids, int n,
+                     guint *vendors, guint *products, gboolean *have)
+{
+#ifdef HAVE_XCB
+    xcb_connection_t *conn = XGetXCBConnection(dpy);
+    xcb_input_xi_get_property_cookie_t *cookies;
+    gint64 start = stats_start();
+    int i;
+
+    XFlush(dpy);
+
+    cookies = g_new(xcb_input_xi_get_property_cookie_t, n);
+    for (i = 0; i < n; i++)
+        cookies[i] = xcb_input_xi_get_property(conn, ids[i], 0, atom,
+                                               XCB_ATOM_INTEGER, 0, 2);
+
+    for (i = 0; i < n; i++)
+    {
+        xcb_input_xi_get_property_reply_t *reply;
+        xcb_generic_error_t *error = NULL;
+
+        have[i] = FALSE;
+        reply = xcb_input_xi_get_property_reply(conn, cookies[i], &error);
+        if (reply && reply->type == XCB_ATOM_INTEGER &&
+            reply->format == 32 && reply->num_items == 2)
+        {
+            guint32 *data = xcb_input_xi_get_property_items(reply);
+
+            vendors[i] = data[0];
+            products[i] = data[1];
+            have[i] = TRUE;
+        }
+
+        free(reply);
+        free(error);
+    }
+
+    g_free(cookies);
+#else
+    Atom type;
+    int format;
+    unsigned long nitems, bytes_after;
+    unsigned char *data;
+    gint64 start = stats_start();
+    int i;
+
+    for (i = 0; i < n; i++)
+    {
+        data = NULL;
+        have[i] = FALSE;
+
+        error_trap_push(dpy);
+        XIGetProperty(dpy, ids[i], atom, 0, 2, False, XA_INTEGER,
+                      &type, &format, &nitems, &bytes_after, &data);
+        if (!error_trap_pop(dpy) && data &&
+            type == XA_INTEGER && format == 32 && nitems == 2)
+        {
+            vendors[i] = ((guint32*)data)[0];
+            products[i] = ((guint32*)data)[1];
+            have[i] = TRUE;
+        }
+
+        if (data)
+            XFree(data);
+    }
+#endif
+
+    stats_end(STAT_PROPERTY, start);
+}
+
+/**
+ * Fetch the "Device Node" of n devices at once. nodes[i] is NULL if ids[i]
+ * has none, free the others with g_free().
+ */
+void get_device_nodes(Display *dpy, Atom atom, const int *ids, int n,
+                      gchar **nodes)
+{
+#ifdef HAVE_XCB
+    xcb_connection_t *conn = XGetXCBConnection(dpy);
+    xcb_input_xi_get_property_cookie_t *cookies;
+    gint64 start = stats_start();
+    int i;
+
+    XFlush(dpy);
+
+    cookies = g_new(xcb_input_xi_get_property_cookie_t, n);
+    for (i = 0; i < n; i++)
+        cookies[i] = xcb_input_xi_get_property(conn, ids[i], 0, atom,
+                                               XCB_ATOM_STRING, 0, 256);
+
+    for (i = 0; i < n; i++)
+    {
+        xcb_input_xi_get_property_reply_t *reply;
+        xcb_generic_error_t *error = NULL;
+
+        nodes[i] = NULL;
+        reply = xcb_input_xi_get_property_reply(conn, cookies[i], &error);
+        if (reply && reply->type == XCB_ATOM_STRING &&
+            reply->format == 8 && reply->num_items > 0)
+            nodes[i] = g_strndup(xcb_input_xi_get_property_items(reply),
+                                 reply->num_items);
+
+        free(reply);
+        free(error);
+    }
+
+    g_free(cookies);
+#else
+    Atom type;
+    int format;
+    unsigned long nitems, bytes_after;
+    unsigned char *data;
+    gint64 start = stats_start();
+    int i;
+
+    for (i = 0; i < n; i++)
+    {
+        data = NULL;
+        nodes[i] = NULL;
+
+        error_trap_push(dpy);
+        XIGetProperty(dpy, ids[i], atom, 0, 256, False, XA_STRING,
+                      &type, &format, &nitems, &bytes_after, &data);
+        if (!error_trap_pop(dpy) && data &&
+            type == XA_STRING && format == 8 && nitems > 0)
+            nodes[i] = g_strndup((gchar*)data, nitems);
+
+        if (data)
+            XFree(data);
+    }
+#endif
+
+    stats_end(STAT_PROPERTY, start);
+}
+
+/**
+ * Send n hierarchy changes in one request and wait for the result.
+ * Returns FALSE if the server rejected them.
+ */
+static gboolean submit_changes(Display *dpy, XIAnyHierarchyChangeInfo *c,
+                               int n)
+{
+    gint64 start = stats_start();
+    gboolean ret;
+#ifdef HAVE_XCB
+    xcb_connection_t *conn = XGetXCBConnection(dpy);
+    xcb_generic_error_t *error;
+    xcb_void_cookie_t cookie;
+    GByteArray *buf;
+
+    XFlush(dpy);
+
+    buf = xcb_hierarchy_changes(c, n);
+    cookie = xcb_input_xi_change_hierarchy_checked(conn, n,
+                 (const xcb_input_hierarchy_change_t*)buf->data);
+    error = xcb_request_check(conn, cookie);
+    g_byte_array_unref(buf);
+
+    ret = (error == NULL);
+    free(error);
+#else
+    error_trap_push(dpy);
+    XIChangeHierarchy(dpy, c, n);
+    ret = (error_trap_pop(dpy) == 0);
+#endif
+
+    stats_end(STAT_HIERARCHY, start);
+
+    return ret;
+}
+
+static void batch_free(HierarchyBatch *batch)
+{
+    g_array_unref(batch->changes);
+    g_ptr_array_unref(batch->names);
+    g_free(batch);
+}
+
+/**
+ * Start collecting hierarchy changes. Until the matching
+ * hierarchy_commit(), change_attachment(), float_device(), remove_master()
+ * and create_master() only queue their change. Calls nest.
+ */
+void hierarchy_begin(GDeviceSetup *gds)
+{
+    if (!gds->batch)
+    {
+        gds->batch = g_new0(HierarchyBatch, 1);
+        gds->batch->changes = g_array_new(FALSE, FALSE,
+                                          sizeof(XIAnyHierarchyChangeInfo));
+        gds->batch->names = g_ptr_array_new_with_free_func(g_free);
+    }
+    gds->batch->depth++;
+}
+
+/**
+ * Throw away all changes queued since the outermost hierarchy_begin().
+ */
+void hierarchy_abort(GDeviceSetup *gds)
+{
+    if (!gds->batch)
+        return;
+
+    batch_free(gds->batch);
+    gds->batch = NULL;
+}
+
+/**
+ * Number of changes waiting for hierarchy_commit().
+ */
+int hierarchy_pending(GDeviceSetup *gds)
+{
+    return gds->batch ? gds->batch->changes->len : 0;
+}
+
+static void report_failure(XIAnyHierarchyChangeInfo *c)
+{
+    switch(c->type)
+    {
+        case XIAttachSlave:
+            g_printerr("ERROR: Attaching device %d to %d failed!\n",
+                       c->attach.deviceid, c->attach.new_master);
+            break;
+        case XIDetachSlave:
+            g_printerr("ERROR: Floating device %d failed!\n",
+                       c->detach.deviceid);
+            break;
+        case XIRemoveMaster:
+            g_printerr("ERROR: Removing MD %d failed!\n", c->remove.deviceid);
+            break;
+        case XIAddMaster:
+            g_printerr("ERROR: Creating MD %s failed!\n", c->add.name);
+            break;
+    }
+}
+
+/**
+ * The server applies changes in order and stops at the first one that
+ * fails, everything before it stays in place. Remove the changes that
+ * are already in effect from c, so they don't get applied twice. An
+ * XIAddMaster is only in effect if there is a MD of its name that isn't
+ * in masters, the MDs from before the changes. The MDs found that way are
+ * added to masters.
+ * Returns the number of changes left.
+ */
+static int drop_applied_changes(Display *dpy, XIAnyHierarchyChangeInfo *c,
+                                int n, GHashTable *masters)
+{
+    XIDeviceInfo *devices, *dev;
+    int ndevices;
+    int i, j, left = 0;
+
+    devices = query_device_info(dpy, XIAllDevices, &ndevices);
+
+    for (i = 0; i < n; i++)
+    {
+        gboolean applied = FALSE;
+        gchar *name = NULL;
+
+        if (c[i].type == XIAddMaster)
+            name = g_strdup_printf("%s pointer", c[i].add.name);
+
+        /* XIRemoveMaster is in effect unless we find the MD */
+        applied = (c[i].type == XIRemoveMaster);
+
+        for (j = 0; j < ndevices; j++)
+        {
+            dev = &devices[j];
+            switch(c[i].type)
+            {
+                case XIAttachSlave:
+                    if (dev->deviceid == c[i].attach.deviceid)
+                        applied = (dev->use != XIFloatingSlave &&
+                                   dev->attachment == c[i].attach.new_master);
+                    break;
+                case XIDetachSlave:
+                    if (dev->deviceid == c[i].detach.deviceid)
+                        applied = (dev->use == XIFloatingSlave);
+                    break;
+                case XIRemoveMaster:
+                    if (dev->deviceid == c[i].remove.deviceid &&
+                        (dev->use == XIMasterPointer ||
+                         dev->use == XIMasterKeyboard))
+                        applied = FALSE;
+                    break;
+                case XIAddMaster:
+                    if (!applied && dev->use == XIMasterPointer &&
+                        strcmp(dev->name, name) == 0 &&
+                        !g_hash_table_contains(masters,
+                                               GINT_TO_POINTER(dev->deviceid)))
+                    {
+                        g_hash_table_add(masters,
+                                         GINT_TO_POINTER(dev->deviceid));
+                        applied = TRUE;
+                    }
+                    break;
+            }
+        }
+
+        g_free(name);
+        if (!applied)
+            c[left++] = c[i];
+    }
+
+    free_device_info(devices);
+
+    return left;
+}
+
+static gboolean submit_all_changes(Display *dpy, XIAnyHierarchyChangeInfo *c,
+                                   int n, GHashTable *masters);
+
+/**
+ * The ids of the MDs there are before n changes go out, for
+ * drop_applied_changes() to tell the MDs the changes create from older
+ * ones of the same name. They come from the cache, so the changes don't
+ * wait for a query, unless there is no cache. NULL if the changes create
+ * no MDs.
+ */
+static GHashTable* known_masters(GDeviceSetup *gds,
+                                 const XIAnyHierarchyChangeInfo *c, int n)
+{
+    GHashTable *masters;
+    GHashTableIter it;
+    DeviceEntry *entry;
+    XIDeviceInfo *devices;
+    int ndevices, i;
+
+    for (i = 0; i < n; i++)
+        if (c[i].type == XIAddMaster)
+            break;
+    if (i == n)
+        return NULL;
+
+    masters = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+    if (gds->devices)
+    {
+        g_hash_table_iter_init(&it, gds->devices);
+        while (g_hash_table_iter_next(&it, NULL, (gpointer*)&entry))
+            if (entry->use == XIMasterPointer)
+                g_hash_table_add(masters, GINT_TO_POINTER(entry->id));
+        return masters;
+    }
+
+    devices = query_device_info(gds->dpy, XIAllDevices, &ndevices);
+    for (i = 0; i < ndevices; i++)
+        if (devices[i].use == XIMasterPointer)
+            g_hash_table_add(masters, GINT_TO_POINTER(devices[i].deviceid));
+    free_device_info(devices);
+
+    return masters;
+}
+
+/**
+ * The request with these n changes failed. The first change not in effect
+ * after it is the one that failed: report it and carry on with the
+ * changes after it. masters as from known_masters().
+ * Returns FALSE if any change failed.
+ */
+static gboolean recover_changes(Display *dpy, XIAnyHierarchyChangeInfo *c,
+                                int n, GHashTable *masters)
+{
+    n = drop_applied_changes(dpy, c, n, masters);
+    if (n == 0)
+        return TRUE;
+
+    report_failure(c);
+    submit_all_changes(dpy, c + 1, n - 1, masters);
+
+    return FALSE;
+}
+
+/**
+ * Submit n changes with as few requests as possible.
+ * Returns FALSE if any change failed.
+ */
+static gboolean submit_all_changes(Display *dpy, XIAnyHierarchyChangeInfo *c,
+                                   int n, GHashTable *masters)
+{
+    if (n == 0 || submit_changes(dpy, c, n))
+        return TRUE;
+
+    return recover_changes(dpy, c, n, masters);
+}
+
+/**
+ * Send everything queued since hierarchy_begin() as one XIChangeHierarchy
+ * request, followed by a single XSync. Only the outermost call submits.
+ * Returns FALSE if any of the changes failed.
+ */
+gboolean hierarchy_commit(GDeviceSetup *gds)
+{
+    HierarchyBatch *batch = gds->batch;
+    XIAnyHierarchyChangeInfo *c;
+    JournalStep *step;
+    GHashTable *masters;
+    int n;
+    gboolean ret;
+
+    if (!batch || --batch->depth > 0)
+        return TRUE;
+
+    n = batch->changes->len;
+    c = (XIAnyHierarchyChangeInfo*)batch->changes->data;
+    step = journal_prepare(gds, c, n);
+    masters = known_masters(gds, c, n);
+    ret = submit_all_changes(gds->dpy, c, n, masters);
+    journal_commit(gds, step, ret);
+    if (masters)
+        g_hash_table_destroy(masters);
+
+    batch_free(batch);
+    gds->batch = NULL;
+
+    return ret;
+}
+
+/**
+ * Like hierarchy_commit(), but doesn't wait for the server. The changes
+ * are sent in one XIChangeHierarchy, followed by a property change on
+ * gds->sync_window. The PropertyNotify for that tells us the server got
+ * through the changes, and hierarchy_async_check() then calls done with
+ * the result. Errors are matched to the request by serial number.
+ * done may be NULL.
+ */
+void hierarchy_commit_async(GDeviceSetup *gds, HierarchyDoneFunc done,
+                            gpointer data)
+{
+    HierarchyBatch *batch = gds->batch;
+    AsyncOp *op;
+
+    if (!batch || --batch->depth > 0)
+        return;
+
+    gds->batch = NULL;
+
+    if (batch->changes->len == 0)
+    {
+        batch_free(batch);
+        if (done)
+            done(gds, TRUE, data);
+        return;
+    }
+
+    if (!gds->sync_window)
+    {
+        gds->sync_window = XCreateSimpleWindow(gds->dpy,
+                                               DefaultRootWindow(gds->dpy),
+                                               0, 0, 1, 1, 0, 0, 0);
+        XSelectInput(gds->dpy, gds->sync_window, PropertyChangeMask);
+        gds->sync_atom = XInternAtom(gds->dpy, "_IDM_SYNC", False);
+    }
+
+    install_error_handler();
+
+    op = g_new0(AsyncOp, 1);
+    op->gds = gds;
+    op->batch = batch;
+    op->done = done;
+    op->data = data;
+    op->sent = stats_start();
+    op->step = journal_prepare(gds,
+                               (XIAnyHierarchyChangeInfo*)batch->changes->data,
+                               batch->changes->len);
+    op->masters = known_masters(gds,
+                                (XIAnyHierarchyChangeInfo*)batch->changes->data,
+                                batch->changes->len);
+
+    op->first = NextRequest(gds->dpy);
+    XIChangeHierarchy(gds->dpy,
+                      (XIAnyHierarchyChangeInfo*)batch->changes->data,
+                      batch->changes->len);
+    op->marker = NextRequest(gds->dpy);
+    XChangeProperty(gds->dpy, gds->sync_window, gds->sync_atom, XA_INTEGER,
+                    8, PropModeAppend, NULL, 0);
+    XFlush(gds->dpy);
+
+    g_queue_push_tail(&async_ops, op);
+}
+
+/**
+ * Finish the async operations the server has got through. Called whenever
+ * events came in. The operations of each display are in the order they
+ * were sent, those of others are skipped.
+ */
+static void hierarchy_async_check(GDeviceSetup *gds)
+{
+    GList *l, *next;
+    AsyncOp *op;
+    gboolean success;
+
+    for (l = async_ops.head; l; l = next)
+    {
+        next = l->next;
+        op = l->data;
+        if (op->gds != gds)
+            continue;
+        if (LastKnownRequestProcessed(gds->dpy) < op->marker)
+            break;
+
+        g_queue_delete_link(&async_ops, l);
+        stats_end(STAT_HIERARCHY_ASYNC, op->sent);
+
+        success = !op->failed;
+        if (op->failed)
+            success = recover_changes(gds->dpy,
+                                      (XIAnyHierarchyChangeInfo*)op->batch->changes->data,
+                                      op->batch->changes->len, op->masters);
+        journal_commit(gds, op->step, success);
+
+        if (op->done)
+            op->done(gds, success, op->data);
+
+        if (op->masters)
+            g_hash_table_destroy(op->masters);
+        batch_free(op->batch);
+        g_free(op);
+    }
+}
+
+/**
+ * Wait for all async operations of gds to finish.
+ */
+void hierarchy_async_flush(GDeviceSetup *gds)
+{
+    if (g_queue_is_empty(&async_ops))
+        return;
+
+    XSync(gds->dpy, False);
+    hierarchy_async_check(gds);
+}
+
+/**
+ * Apply a single change now, or queue it if hierarchy_begin() was called.
+ */
+static gboolean change_hierarchy(GDeviceSetup *gds,
+                                 XIAnyHierarchyChangeInfo *c)
+{
+    JournalStep *step;
+    GHashTable *masters;
+    gboolean ret;
+
+    if (gds->batch)
+    {
+        g_array_append_val(gds->batch->changes, *c);
+        return TRUE;
+    }
+
+    step = journal_prepare(gds, c, 1);
+    masters = known_masters(gds, c, 1);
+    ret = submit_all_changes(gds->dpy, c, 1, masters);
+    journal_commit(gds, step, ret);
+    if (masters)
+        g_hash_table_destroy(masters);
+
+    return ret;
+}
+
+/**
+ * Queue n changes as they are, within hierarchy_begin(). Only for changes
+ * without names, i.e. no XIAddMaster.
+ */
+void hierarchy_queue(GDeviceSetup *gds, const XIAnyHierarchyChangeInfo *c,
+                     int n)
+{
+    g_array_append_vals(gds->batch->changes, c, n);
+}
+
+/**
+ * Try to reattach id to id_to.
+ */
+gboolean change_attachment(GDeviceSetup *gds, int id, int id_to)
+{
+    XIAnyHierarchyChangeInfo c;
+
+    c.attach.type = XIAttachSlave;
+    c.attach.deviceid = id;
+    c.attach.new_master = id_to;
+
+    return change_hierarchy(gds, &c);
+}
+
+
+/**
+ * Set a device floating.
+ */
+gboolean float_device(GDeviceSetup *gds, int id)
+{
+    XIAnyHierarchyChangeInfo c;
+
+    c.detach.type = XIDetachSlave;
+    c.detach.deviceid = id;
+
+    return change_hierarchy(gds, &c);
+}
+
+
+/**
+ * Remove a master device from the display. All SDs attached to dev will be
+ * attached to VCP and VCK.
+ * Effective immediately, unless within hierarchy_begin().
+ */
+gboolean remove_master(GDeviceSetup *gds, int id)
+{
+    XIAnyHierarchyChangeInfo c;
+
+    c.remove.type = XIRemoveMaster;
+    c.remove.deviceid = id;
+    c.remove.return_mode = XIAttachToMaster;
+    c.remove.return_pointer = 2; /* VCP */
+    c.remove.return_keyboard = 3; /* VCK */
+
+    return change_hierarchy(gds, &c);
+}
+
+static gboolean add_master(GDeviceSetup *gds, const char *name,
+                           gboolean send_core, gboolean enable)
+{
+    XIAnyHierarchyChangeInfo c;
+    gchar *copy = g_strdup(name);
+
+    c.add.type = XIAddMaster;
+    c.add.name = copy;
+    c.add.send_core = send_core;
+    c.add.enable = enable;
+
+    /* the batch holds on to the name until it's submitted */
+    if (gds->batch)
+    {
+        g_ptr_array_add(gds->batch->names, copy);
+        return change_hierarchy(gds, &c);
+    }
+
+    if (!change_hierarchy(gds, &c))
+    {
+        g_free(copy);
+        return False;
+    }
+    g_free(copy);
+
+    return True;
+}
+
+/**
+ * Create a master device with the given name on the display. Applied
+ * immediately, unless within hierarchy_begin().
+ */
+gboolean create_master(GDeviceSetup *gds, const char* name)
+{
+    return add_master(gds, name, TRUE, TRUE);
+}
+
+/* Cursors create_masters() can give a MD pointer, from the cursor font */
+const char *const cursor_names[] = {
+    "left_ptr", "arrow", "crosshair", "cross", "dot", "target", "hand1",
+    "hand2", "pencil", "pirate", "star", "gumby", NULL
+};
+
+static const unsigned int cursor_shapes[] = {
+    XC_left_ptr, XC_arrow, XC_crosshair, XC_cross, XC_dot, XC_target,
+    XC_hand1, XC_hand2, XC_pencil, XC_pirate, XC_star, XC_gumby
+};
+
+static int find_cursor_shape(const char *name)
+{
+    int i;
+
+    for (i = 0; cursor_names[i]; i++)
+        if (strcmp(cursor_names[i], name) == 0)
+            return cursor_shapes[i];
+
+    return -1;
+}
+
+/**
+ * The ids of all devices there are before create_masters() adds its MDs,
+ * so find_new_master() can tell them from the new ones. They come from
+ * the cache like in known_masters(), only without a cache they are
+ * queried.
+ */
+static GHashTable* known_devices(GDeviceSetup *gds)
+{
+    GHashTable *known;
+    GHashTableIter it;
+    gpointer id;
+    XIDeviceInfo *devices;
+    int ndevices, i;
+
+    known = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+    if (gds->devices)
+    {
+        g_hash_table_iter_init(&it, gds->devices);
+        while (g_hash_table_iter_next(&it, &id, NULL))
+            g_hash_table_add(known, id);
+        return known;
+    }
+
+    devices = query_device_info(gds->dpy, XIAllDevices, &ndevices);
+    for (i = 0; i < ndevices; i++)
+        g_hash_table_add(known, GINT_TO_POINTER(devices[i].deviceid));
+    free_device_info(devices);
+
+    return known;
+}
+
+/**
+ * The MD of the pair name that was just created, or 0. MDs in known were
+ * there before, whatever their name, and the one found is added to it.
+ */
+static int find_new_master(XIDeviceInfo *devices, int ndevices,
+                           GHashTable *known, const char *name, int use)
+{
+    gchar *full;
+    int i, id = 0;
+
+    full = g_strdup_printf("%s %s", name,
+                           use == XIMasterPointer ? "pointer" : "keyboard");
+    for (i = 0; i < ndevices && !id; i++)
+        if (devices[i].use == use && strcmp(devices[i].name, full) == 0 &&
+            !g_hash_table_contains(known, GINT_TO_POINTER(devices[i].deviceid)))
+            id = devices[i].deviceid;
+    g_free(full);
+
+    if (id)
+        g_hash_table_add(known, GINT_TO_POINTER(id));
+
+    return id;
+}
+
+/**
+ * Create n MD pairs, attach their SDs, and give them their cursor and
+ * client window. The new ids are only known once the server has created
+ * the MDs, so this takes two round trips however many pairs there are:
+ * all XIAddMaster changes in one request with the query for the new ids
+ * right behind it, then attachments, cursors and client pointers, with
+ * one sync at the end. A pair of the same name that is there already
+ * isn't taken for a new one, see known_devices().
+ * Within hierarchy_begin() pairs without cursor, client window and SDs
+ * are queued like create_master() does, anything else is refused: it
+ * needs the new ids, and these only come with the commit. Otherwise the
+ * new ids are left in the pointer and keyboard of each spec.
+ * Returns FALSE if anything failed.
+ */
+gboolean create_masters(GDeviceSetup *gds, MasterSpec *specs, int n)
+{
+    XIAnyHierarchyChangeInfo *c;
+    XIDeviceInfo *devices;
+    JournalStep *step;
+    GHashTable *known;
+    GArray *attach;
+    int *pointers, *keyboards;
+    int ndevices, i, j, k;
+    gboolean ret = TRUE;
+    gint64 start;
+
+    if (n == 0)
+        return TRUE;
+
+    if (gds->batch)
+    {
+        for (i = 0; i < n; i++)
+        {
+            if (specs[i].cursor || specs[i].client_window != None ||
+                specs[i].nslaves > 0)
+            {
+                g_printerr("ERROR: Cursor, client pointer and devices of MD "
+                           "%s need the changes applied immediately!\n",
+                           specs[i].name);
+                return FALSE;
+            }
+        }
+
+        for (i = 0; i < n; i++)
+        {
+            add_master(gds, specs[i].name, specs[i].send_core,
+                       specs[i].enable);
+            specs[i].pointer = specs[i].keyboard = 0;
+        }
+        return TRUE;
+    }
+
+    start = stats_start();
+    step = journal_prepare_masters(gds, specs, n);
+
+    c = g_new0(XIAnyHierarchyChangeInfo, n);
+    for (i = 0; i < n; i++)
+    {
+        c[i].add.type = XIAddMaster;
+        c[i].add.name = (char*)specs[i].name;
+        c[i].add.send_core = specs[i].send_core;
+        c[i].add.enable = specs[i].enable;
+    }
+
+    known = known_devices(gds);
+
+    /* which names made it is told by the query, errors aren't looked at */
+    error_trap_push(gds->dpy);
+    XIChangeHierarchy(gds->dpy, c, n);
+    devices = query_device_info(gds->dpy, XIAllDevices, &ndevices);
+    error_trap_pop_replied(gds->dpy);
+    g_free(c);
+
+    pointers = g_new0(int, n);
+    keyboards = g_new0(int, n);
+    attach = g_array_new(FALSE, FALSE, sizeof(XIAnyHierarchyChangeInfo));
+
+    for (i = 0; i < n; i++)
+    {
+        pointers[i] = find_new_master(devices, ndevices, known,
+                                      specs[i].name, XIMasterPointer);
+        keyboards[i] = find_new_master(devices, ndevices, known,
+                                       specs[i].name, XIMasterKeyboard);
+        if (!pointers[i] || !keyboards[i])
+        {
+            g_printerr("ERROR: Creating MD %s failed!\n", specs[i].name);
+            pointers[i] = keyboards[i] = 0;
+            ret = FALSE;
+            continue;
+        }
+
+        /* keyboard SDs go below the keyboard, everything else below the
+         * pointer */
+        for (k = 0; k < specs[i].nslaves; k++)
+        {
+            XIAnyHierarchyChangeInfo change;
+
+            for (j = 0; j < ndevices; j++)
+                if (devices[j].deviceid == specs[i].slaves[k])
+                    break;
+            if (j == ndevices)
+            {
+                g_printerr("ERROR: Device %d is gone!\n", specs[i].slaves[k]);
+                ret = FALSE;
+                continue;
+            }
+
+            change.attach.type = XIAttachSlave;
+            change.attach.deviceid = specs[i].slaves[k];
+            change.attach.new_master =
+                is_keyboard_slave(&devices[j]) ? keyboards[i] : pointers[i];
+            g_array_append_val(attach, change);
+        }
+    }
+    free_device_info(devices);
+    g_hash_table_destroy(known);
+
+    error_trap_push(gds->dpy);
+
+    if (attach->len > 0)
+        XIChangeHierarchy(gds->dpy,
+                          (XIAnyHierarchyChangeInfo*)attach->data,
+                          attach->len);
+
+    for (i = 0; i < n; i++)
+    {
+        if (!pointers[i])
+            continue;
+
+        if (specs[i].cursor)
+        {
+            int shape = find_cursor_shape(specs[i].cursor);
+
+            if (shape < 0)
+            {
+                g_printerr("ERROR: Unknown cursor %s!\n", specs[i].cursor);
+                ret = FALSE;
+            } else
+            {
+                /* the window holds on to it */
+                Cursor cursor = XCreateFontCursor(gds->dpy, shape);
+
+                XIDefineCursor(gds->dpy, pointers[i],
+                               DefaultRootWindow(gds->dpy), cursor);
+                XFreeCursor(gds->dpy, cursor);
+            }
+        }
+
+        if (specs[i].client_window != None)
+            XISetClientPointer(gds->dpy, specs[i].client_window, pointers[i]);
+    }
+
+    if (error_trap_pop(gds->dpy))
+    {
+        /* if the attachments are all in place, it was the rest */
+        if (recover_changes(gds->dpy,
+                            (XIAnyHierarchyChangeInfo*)attach->data,
+                            attach->len, NULL))
+            g_printerr("ERROR: Setting cursor or client pointer failed!\n");
+        ret = FALSE;
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        specs[i].pointer = pointers[i];
+        specs[i].keyboard = keyboards[i];
+    }
+
+    g_array_unref(attach);
+    g_free(pointers);
+    g_free(keyboards);
+
+    journal_commit(gds, step, ret);
+    stats_end(STAT_HIERARCHY, start);
+
+    return ret;
+}
+
+
+/**
+ * Without a view, only the cache is kept up to date. The event
+ * only tells us the ids of new devices, so query them.
+ */
+static void cache_added_devices(GDeviceSetup *gds, XIHierarchyEvent *ev)
+{
+    XIDeviceInfo **infos;
+    GArray *ids;
+    int i;
+
+    ids = g_array_new(FALSE, FALSE, sizeof(int));
+    for (i = 0; i < ev->num_info; i++)
+        if ((ev->info[i].flags & (XIMasterAdded | XISlaveAdded)) &&
+            !cache_lookup(gds, ev->info[i].deviceid))
+            g_array_append_val(ids, ev->info[i].deviceid);
+
+    if (ids->len)
+    {
+        infos = g_new0(XIDeviceInfo*, ids->len);
+        query_devices_by_id(gds->dpy, (int*)ids->data, ids->len, infos);
+        cache_update_devices(gds, infos, ids->len, NULL);
+        for (i = 0; i < ids->len; i++)
+            free_device_info(infos[i]);
+        g_free(infos);
+    }
+
+    g_array_unref(ids);
+}
+
+/**
+ * Apply an XI_HierarchyChanged event to the cache, and hand it to the view
+ * if there is one.
+ */
+static void handle_hierarchy_event(GDeviceSetup *gds, XIHierarchyEvent *ev)
+{
+#ifdef HAVE_RULES
+    GArray *added;
+#endif
+    int i;
+
+    gds->events++;
+
+    for (i = 0; i < ev->num_info; i++)
+        cache_hierarchy_info(gds, &ev->info[i]);
+
+#ifdef HAVE_RULES
+    if (gds->rules)
+    {
+        added = g_array_new(FALSE, FALSE, sizeof(int));
+        for (i = 0; i < ev->num_info; i++)
+            if (ev->info[i].flags & XISlaveAdded)
+                g_array_append_val(added, ev->info[i].deviceid);
+        if (added->len)
+            rules_apply(gds, added);
+        g_array_unref(added);
+    }
+#endif
+
+    /* the view queries new devices with its next refresh */
+    if (gds->view)
+        gds->view->hierarchy_event(gds, ev);
+    else
+        cache_added_devices(gds, ev);
+
+    if (gds->hierarchy_changed)
+        gds->hierarchy_changed(gds, gds->hierarchy_changed_data);
+}
+
+/**
+ * A device property changed. If the cache holds it, fetch it again with
+ * the device's next refresh.
+ */
+static void handle_property_event(GDeviceSetup *gds, XIPropertyEvent *ev)
+{
+    if (ev->property != gds->product_id_atom &&
+        ev->property != gds->device_node_atom)
+        return;
+
+    cache_invalidate(gds, ev->deviceid);
+    if (gds->view)
+        gds->view->property_event(gds, ev->deviceid);
+}
+
+static gboolean x_event_prepare(GSource *source, gint *timeout)
+{
+    XEventSource *xsource = (XEventSource*)source;
+
+    *timeout = -1;
+    return XPending(xsource->gds->dpy) > 0;
+}
+
+static gboolean x_event_check(GSource *source)
+{
+    XEventSource *xsource = (XEventSource*)source;
+
+    if (xsource->pollfd.revents & G_IO_IN)
+        return XPending(xsource->gds->dpy) > 0;
+
+    return FALSE;
+}
+
+static void handle_xi_event(GDeviceSetup *gds, XGenericEventCookie *cookie)
+{
+    if (cookie->extension != gds->xi_opcode)
+        return;
+
+    if (cookie->evtype == XI_HierarchyChanged)
+        handle_hierarchy_event(gds, cookie->data);
+    else if (cookie->evtype == XI_PropertyEvent)
+        handle_property_event(gds, cookie->data);
+    else if (gds->view &&
+             (cookie->evtype == XI_RawKeyPress ||
+              cookie->evtype == XI_RawButtonPress ||
+              cookie->evtype == XI_RawMotion))
+        gds->view->raw_event(gds, cookie->data);
+}
+
+static gboolean x_event_dispatch(GSource *source, GSourceFunc callback,
+                                 gpointer data)
+{
+    GDeviceSetup *gds = ((XEventSource*)source)->gds;
+    XEvent ev;
+
+    while (XPending(gds->dpy))
+    {
+        XNextEvent(gds->dpy, &ev);
+
+        if (ev.type == KeyPress)
+            presets_key_press(gds, &ev.xkey);
+
+        if (ev.type != GenericEvent ||
+            !XGetEventData(gds->dpy, &ev.xcookie))
+            continue;
+
+        handle_xi_event(gds, &ev.xcookie);
+
+        XFreeEventData(gds->dpy, &ev.xcookie);
+    }
+
+    hierarchy_async_check(gds);
+
+    return TRUE;
+}
+
+/**
+ * An event on a connection shared with someone else, who has already
+ * fetched the event data and needs the events too. Returns TRUE if the
+ * event was a hotkey of ours, which nobody else has a window for.
+ */
+gboolean xi_filter_event(GDeviceSetup *gds, XEvent *ev)
+{
+    if (ev->type == GenericEvent && ev->xcookie.data)
+        handle_xi_event(gds, &ev->xcookie);
+
+    hierarchy_async_check(gds);
+
+    return ev->type == KeyPress && presets_key_press(gds, &ev->xkey);
+}
+
+static GSourceFuncs x_event_funcs = {
+    x_event_prepare,
+    x_event_check,
+    x_event_dispatch,
+    NULL
+};
+
+/**
+ * Dispatch the events of our own display connection from the main loop.
+ */
+GSource* x_event_source_new(GDeviceSetup *gds)
+{
+    GSource *source;
+    XEventSource *xsource;
+
+    source = g_source_new(&x_event_funcs, sizeof(XEventSource));
+    xsource = (XEventSource*)source;
+    xsource->gds = gds;
+    xsource->pollfd.fd = ConnectionNumber(gds->dpy);
+    xsource->pollfd.events = G_IO_IN | G_IO_HUP | G_IO_ERR;
+    g_source_add_poll(source, &xsource->pollfd);
+    g_source_attach(source, NULL);
+
+    return source;
+}